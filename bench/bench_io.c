@@ -0,0 +1,515 @@
+/*
+  bench_io: an IOR-style benchmark of the MPI-IO layer
+
+  Every rank writes, then reads back, ops transfers of one size through
+  the MPI_File calls alone, for each combination of
+
+    layout   shared: one file for all ranks, or fpp: a file per rank
+    pattern  contig: each rank owns one region of the shared file, or
+             strided: the ranks' transfers interleave
+    mode     indep: MPI_File_write_at/read_at, or coll: the _at_all calls
+    sync     sync: blocking calls, or async: up to -q requests in flight
+             through MPI_File_iwrite/iread or iwrite_at_all/iread_at_all
+
+  and each transfer size.  A file per rank is only accessed contiguously.
+  Rank 0 prints one JSON object per line: first the hints in effect on
+  the file, then one record per test with the aggregate bandwidth, the
+  operations per second and percentiles of the latency of single
+  operations over every rank.  Bandwidth counts from a barrier before
+  the first operation to the last rank finishing its last, fsync
+  included with -e.  A test that failed on any rank is only marked as
+  failed.
+
+  Example: upcrun -n 4 bench_io -t 64k,1m -l shared -H cb_nodes=2 posix:/scratch/bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mpi.h"
+
+#define BENCH_SIZES      "4k,64k,1m,4m"
+#define BENCH_MAX_SIZES  16
+#define BENCH_BYTES      (16L * 1024 * 1024)
+#define BENCH_DEPTH      4
+
+//Choices of each dimension, as bit masks
+#define BENCH_SHARED     1
+#define BENCH_FPP        2
+#define BENCH_CONTIG     1
+#define BENCH_STRIDED    2
+#define BENCH_INDEP      1
+#define BENCH_COLL       2
+#define BENCH_SYNC       1
+#define BENCH_ASYNC      2
+
+typedef struct bench_opts bench_opts;
+struct bench_opts {
+	char *path;
+	long sizes[BENCH_MAX_SIZES];
+	int nsizes;
+	long bytes;			//per rank and test
+	int layouts;
+	int patterns;
+	int modes;
+	int syncs;
+	int depth;			//async requests in flight
+	int reps;
+	int fsync;
+	int verify;
+	int keep;
+	MPI_Info info;
+};
+
+//One test
+typedef struct bench_case bench_case;
+struct bench_case {
+	int fpp;
+	int strided;
+	int coll;
+	int async;
+	long xfer;
+	long ops;
+};
+
+static int rank, nranks;
+
+static void usage(char *prog) {
+	if (rank == 0)
+		fprintf(stderr,
+			"usage: %s [options] [path]\n"
+			"  -t sizes    transfer sizes, e.g. 4k,64k,1m (default %s)\n"
+			"  -b bytes    moved by each rank per test (default 16m)\n"
+			"  -l list     layouts: shared,fpp\n"
+			"  -p list     patterns: contig,strided\n"
+			"  -m list     modes: indep,coll\n"
+			"  -a list     sync,async\n"
+			"  -q depth    async requests in flight (default %d)\n"
+			"  -i reps     repetitions of each test (default 1)\n"
+			"  -H key=val  an MPI_Info hint, repeatable\n"
+			"  -e          fsync after writing, inside the timing\n"
+			"  -x          do not check the data read\n"
+			"  -k          keep the files\n",
+			prog, BENCH_SIZES, BENCH_DEPTH);
+	MPI_Finalize();
+	exit(1);
+}
+
+/**
+ * Parse a size with an optional k, m or g suffix
+ */
+static long parse_size(char *s) {
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	switch (*end) {
+	case 'g': case 'G':
+		n *= 1024;
+	case 'm': case 'M':
+		n *= 1024;
+	case 'k': case 'K':
+		n *= 1024;
+	}
+
+	return n;
+}
+
+/**
+ * The mask of the words of a comma separated list found in names
+ */
+static int parse_list(char *list, const char *names[], int n) {
+	char *copy, *word, *save;
+	int i, mask = 0;
+
+	copy = strdup(list);
+	for (word = strtok_r(copy, ",", &save); word;
+	     word = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < n; i++) {
+			if (!strcmp(word, names[i]))
+				mask |= 1 << i;
+		}
+	}
+	free(copy);
+
+	return mask;
+}
+
+static void parse_opts(int argc, char **argv, bench_opts *o) {
+	static const char *layouts[] = { "shared", "fpp" };
+	static const char *patterns[] = { "contig", "strided" };
+	static const char *modes[] = { "indep", "coll" };
+	static const char *syncs[] = { "sync", "async" };
+	char *sizes = BENCH_SIZES, *word, *save, *eq;
+	int c;
+
+	memset(o, 0, sizeof(*o));
+	o->path = "posix:bench_io.dat";
+	o->bytes = BENCH_BYTES;
+	o->layouts = BENCH_SHARED | BENCH_FPP;
+	o->patterns = BENCH_CONTIG | BENCH_STRIDED;
+	o->modes = BENCH_INDEP | BENCH_COLL;
+	o->syncs = BENCH_SYNC | BENCH_ASYNC;
+	o->depth = BENCH_DEPTH;
+	o->reps = 1;
+	o->verify = 1;
+	MPI_Info_create(&o->info);
+
+	while ((c = getopt(argc, argv, "t:b:l:p:m:a:q:i:H:exk")) != -1) {
+		switch (c) {
+		case 't': sizes = optarg; break;
+		case 'b': o->bytes = parse_size(optarg); break;
+		case 'l': o->layouts = parse_list(optarg, layouts, 2); break;
+		case 'p': o->patterns = parse_list(optarg, patterns, 2); break;
+		case 'm': o->modes = parse_list(optarg, modes, 2); break;
+		case 'a': o->syncs = parse_list(optarg, syncs, 2); break;
+		case 'q': o->depth = atoi(optarg); break;
+		case 'i': o->reps = atoi(optarg); break;
+		case 'e': o->fsync = 1; break;
+		case 'x': o->verify = 0; break;
+		case 'k': o->keep = 1; break;
+		case 'H':
+			eq = strchr(optarg, '=');
+			if (!eq)
+				usage(argv[0]);
+			*eq = '\0';
+			MPI_Info_set(o->info, optarg, eq + 1);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc)
+		o->path = argv[optind];
+
+	sizes = strdup(sizes);
+	for (word = strtok_r(sizes, ",", &save);
+	     word && o->nsizes < BENCH_MAX_SIZES;
+	     word = strtok_r(NULL, ",", &save)) {
+		o->sizes[o->nsizes++] = parse_size(word);
+	}
+	free(sizes);
+
+	if (!o->nsizes || o->bytes <= 0 || o->depth < 1 || o->reps < 1)
+		usage(argv[0]);
+}
+
+//Byte offset of transfer i of this rank
+static MPI_Offset bench_offset(bench_case *c, long i) {
+	if (c->fpp)
+		return i * c->xfer;
+	if (c->strided)
+		return (i * nranks + rank) * c->xfer;
+
+	return ((MPI_Offset)rank * c->ops + i) * c->xfer;
+}
+
+//The byte every transfer i of this rank is filled with
+static int bench_byte(long i) {
+	return (rank * 31 + i * 7 + 1) & 0xff;
+}
+
+//Bytes of buf not holding the pattern of transfer i
+static long bench_check(char *buf, long xfer, long i) {
+	long j, bad = 0;
+
+	for (j = 0; j < xfer; j++) {
+		bad += (unsigned char)buf[j] != bench_byte(i);
+	}
+
+	return bad;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Print the hints in effect on a file
+ */
+static void print_hints(MPI_File fh) {
+	char key[MPI_MAX_INFO_KEY + 1], value[MPI_MAX_INFO_VAL + 1];
+	MPI_Info info;
+	int i, n, flag;
+
+	if (MPI_File_get_info(fh, &info))
+		return;
+
+	printf("{\"hints\": {");
+	MPI_Info_get_nkeys(info, &n);
+	for (i = 0; i < n; i++) {
+		MPI_Info_get_nthkey(info, i, key);
+		MPI_Info_get(info, key, MPI_MAX_INFO_VAL, value, &flag);
+		printf("%s\"%s\": \"%s\"", i ? ", " : "", key, value);
+	}
+	printf("}, \"ranks\": %d}\n", nranks);
+	fflush(stdout);
+	MPI_Info_free(&info);
+}
+
+/**
+ * Make transfer i, or start it in req if the test is async
+ * Returns the MPI error code
+ */
+static int bench_issue(MPI_File fh, bench_case *c, int write, char *buf,
+		       long i, MPI_Request *req) {
+	MPI_Offset off = bench_offset(c, i);
+	int ret;
+
+	if (c->async && c->coll)
+		return write ?
+			MPI_File_iwrite_at_all(fh, off, buf, c->xfer, MPI_BYTE, req) :
+			MPI_File_iread_at_all(fh, off, buf, c->xfer, MPI_BYTE, req);
+
+	if (c->async) {
+		ret = MPI_File_seek(fh, off, MPI_SEEK_SET);
+		if (ret)
+			return ret;
+		return write ?
+			MPI_File_iwrite(fh, buf, c->xfer, MPI_BYTE, req) :
+			MPI_File_iread(fh, buf, c->xfer, MPI_BYTE, req);
+	}
+
+	if (c->coll)
+		return write ?
+			MPI_File_write_at_all(fh, off, buf, c->xfer, MPI_BYTE,
+					      MPI_STATUS_IGNORE) :
+			MPI_File_read_at_all(fh, off, buf, c->xfer, MPI_BYTE,
+					     MPI_STATUS_IGNORE);
+
+	return write ?
+		MPI_File_write_at(fh, off, buf, c->xfer, MPI_BYTE,
+				  MPI_STATUS_IGNORE) :
+		MPI_File_read_at(fh, off, buf, c->xfer, MPI_BYTE,
+				 MPI_STATUS_IGNORE);
+}
+
+/**
+ * Run the write or read phase of a test, leaving the latency of each
+ * transfer in lat, the time taken in elapsed and the bytes that did not
+ * read back in bad
+ * Returns the MPI error code
+ */
+static int bench_phase(bench_opts *o, bench_case *c, int write, char *bufs,
+		       double *lat, double *elapsed, long *bad) {
+	static int hints_printed;
+	MPI_Request *reqs;
+	MPI_File fh;
+	double *start, t0;
+	char name[4096];
+	long i, j;
+	int ret, err = MPI_SUCCESS, depth = c->async ? o->depth : 1;
+
+	if (c->fpp)
+		snprintf(name, sizeof(name), "%s.%d", o->path, rank);
+	else
+		snprintf(name, sizeof(name), "%s", o->path);
+
+	memset(lat, 0, sizeof(double) * c->ops);
+	*elapsed = 0;
+	*bad = 0;
+	ret = MPI_File_open(c->fpp ? MPI_COMM_SELF : MPI_COMM_WORLD, name,
+			    write ? MPI_MODE_CREATE | MPI_MODE_WRONLY :
+			    MPI_MODE_RDONLY, o->info, &fh);
+	if (ret) {
+		//A file per rank may fail on this rank alone
+		MPI_Barrier(MPI_COMM_WORLD);
+		return ret;
+	}
+
+	if (!hints_printed && rank == 0) {
+		print_hints(fh);
+		hints_printed = 1;
+	}
+
+	reqs = calloc(depth, sizeof(MPI_Request));
+	start = calloc(c->ops, sizeof(double));
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	t0 = MPI_Wtime();
+	for (i = 0; i < c->ops + depth - 1; i++) {
+		//Complete the transfer whose slot is needed, or the stragglers
+		j = i - depth + 1;
+		if (c->async && j >= 0 && j < c->ops) {
+			ret = MPI_Wait(&reqs[j % depth], MPI_STATUS_IGNORE);
+			lat[j] = MPI_Wtime() - start[j];
+			if (ret)
+				err = ret;
+			if (!write && o->verify)
+				*bad += bench_check(bufs + (j % depth) * c->xfer,
+						    c->xfer, j);
+		}
+
+		if (i >= c->ops)
+			continue;
+
+		if (write)
+			memset(bufs + (i % depth) * c->xfer, bench_byte(i),
+			       c->xfer);
+
+		start[i] = MPI_Wtime();
+		ret = bench_issue(fh, c, write, bufs + (i % depth) * c->xfer, i,
+				  &reqs[i % depth]);
+		if (ret)
+			err = ret;
+
+		if (!c->async) {
+			lat[i] = MPI_Wtime() - start[i];
+			if (!write && o->verify)
+				*bad += bench_check(bufs, c->xfer, i);
+		}
+	}
+
+	if (write && o->fsync) {
+		ret = MPI_File_sync(fh);
+		if (ret)
+			err = ret;
+	}
+	*elapsed = MPI_Wtime() - t0;
+
+	ret = MPI_File_close(&fh);
+	if (ret)
+		err = ret;
+
+	free(reqs);
+	free(start);
+
+	return err;
+}
+
+/**
+ * Combine the results of a phase over the ranks and print them on rank 0
+ * A phase that failed on any rank is reported without its timings
+ */
+static void bench_report(bench_case *c, int write, int rep, int err,
+			 double *lat, double elapsed, long bad) {
+	double *all = NULL, time, bytes;
+	long n = c->ops * nranks, badall;
+	int errall;
+
+	if (rank == 0)
+		all = malloc(sizeof(double) * n);
+
+	MPI_Reduce(&elapsed, &time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&bad, &badall, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&err, &errall, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+	MPI_Gather(lat, c->ops, MPI_DOUBLE, all, c->ops, MPI_DOUBLE, 0,
+		   MPI_COMM_WORLD);
+
+	if (rank != 0)
+		return;
+
+	printf("{\"op\": \"%s\", \"layout\": \"%s\", \"pattern\": \"%s\", "
+	       "\"mode\": \"%s\", \"sync\": \"%s\", \"xfer\": %ld, "
+	       "\"ops\": %ld, \"rep\": %d, ",
+	       write ? "write" : "read", c->fpp ? "fpp" : "shared",
+	       c->strided ? "strided" : "contig", c->coll ? "coll" : "indep",
+	       c->async ? "async" : "sync", c->xfer, n, rep);
+
+	if (errall) {
+		printf("\"failed\": true, \"error\": %d}\n", errall);
+		fflush(stdout);
+		free(all);
+		return;
+	}
+
+	qsort(all, n, sizeof(double), bench_cmp);
+	bytes = (double)c->xfer * n;
+	printf("\"bytes\": %.0f, \"seconds\": %.6f, "
+	       "\"bw_mib\": %.2f, \"iops\": %.1f, \"lat_us\": {\"min\": %.1f, "
+	       "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+	       "\"failed\": false, \"error\": 0, \"bad_bytes\": %ld}\n",
+	       bytes, time,
+	       time > 0 ? bytes / time / (1024 * 1024) : 0,
+	       time > 0 ? n / time : 0, all[0] * 1e6, all[n / 2] * 1e6,
+	       all[n * 90 / 100] * 1e6, all[n * 99 / 100] * 1e6,
+	       all[n - 1] * 1e6, badall);
+	fflush(stdout);
+	free(all);
+}
+
+/**
+ * Write then read back one test, and remove its files
+ */
+static void bench_run(bench_opts *o, bench_case *c) {
+	char *bufs, name[4096];
+	double *lat, elapsed;
+	long bad;
+	int rep, err;
+
+	bufs = malloc(c->xfer * (c->async ? o->depth : 1));
+	lat = calloc(c->ops, sizeof(double));
+	if (!bufs || !lat) {
+		fprintf(stderr, "bench_io: out of memory for %ld byte transfers\n",
+			c->xfer);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	for (rep = 0; rep < o->reps; rep++) {
+		err = bench_phase(o, c, 1, bufs, lat, &elapsed, &bad);
+		bench_report(c, 1, rep, err, lat, elapsed, 0);
+
+		err = bench_phase(o, c, 0, bufs, lat, &elapsed, &bad);
+		bench_report(c, 0, rep, err, lat, elapsed, bad);
+	}
+
+	if (!o->keep) {
+		MPI_Barrier(MPI_COMM_WORLD);
+		if (c->fpp) {
+			snprintf(name, sizeof(name), "%s.%d", o->path, rank);
+			MPI_File_delete(name, MPI_INFO_NULL);
+		} else if (rank == 0) {
+			MPI_File_delete(o->path, MPI_INFO_NULL);
+		}
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+
+	free(bufs);
+	free(lat);
+}
+
+int main(int argc, char **argv) {
+	bench_opts o;
+	bench_case c;
+	int layout, pattern, mode, sync, s;
+
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+	parse_opts(argc, argv, &o);
+
+	for (layout = BENCH_SHARED; layout <= BENCH_FPP; layout <<= 1) {
+	for (pattern = BENCH_CONTIG; pattern <= BENCH_STRIDED; pattern <<= 1) {
+	for (mode = BENCH_INDEP; mode <= BENCH_COLL; mode <<= 1) {
+	for (sync = BENCH_SYNC; sync <= BENCH_ASYNC; sync <<= 1) {
+		if (!(o.layouts & layout) || !(o.patterns & pattern) ||
+		    !(o.modes & mode) || !(o.syncs & sync))
+			continue;
+
+		//A file per rank has nothing to interleave with
+		if (layout == BENCH_FPP && pattern == BENCH_STRIDED)
+			continue;
+
+		for (s = 0; s < o.nsizes; s++) {
+			c.fpp = layout == BENCH_FPP;
+			c.strided = pattern == BENCH_STRIDED;
+			c.coll = mode == BENCH_COLL;
+			c.async = sync == BENCH_ASYNC;
+			c.xfer = o.sizes[s];
+			c.ops = o.bytes / c.xfer > 0 ? o.bytes / c.xfer : 1;
+			bench_run(&o, &c);
+		}
+	}
+	}
+	}
+	}
+
+	MPI_Info_free(&o.info);
+	MPI_Finalize();
+
+	return 0;
+}
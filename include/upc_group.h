@@ -0,0 +1,84 @@
+#ifndef _UPC_GROUP_H
+#define _UPC_GROUP_H 1
+
+//Dissemination barrier rounds, enough for 2^32 threads
+#define GROUP_ROUNDS 32
+
+//Groups kept by each communicator
+#define GROUP_ALL    0
+#define GROUP_NODE   1
+#define GROUP_LEADER 2
+#define GROUP_KINDS  3
+
+//A member's synchronization block for one group
+typedef struct group_sync group_sync;
+struct group_sync {
+	int flag[2][GROUP_ROUNDS];	//last signal per round, by epoch parity
+	size_t scratch_size;
+	shared [] char *scratch;	//data published to the other members
+	nbc_slot nbc[NBC_SLOTS];	//non-blocking collectives in flight
+	int nbr_ready;			//neighbour exchange the scratch is ready for
+};
+
+typedef strict shared [] group_sync *group_sync_ptr;
+
+//A set of threads that run collectives together
+typedef struct coll_group coll_group;
+struct coll_group {
+	int size;
+	int rank;
+	int epoch;
+	int *threads;			//thread of each rank
+	group_sync_ptr *sync;		//sync block of each rank
+	int nbc_seq;			//non-blocking collectives started
+	void *nbc_owner[NBC_SLOTS];	//operation holding each NBC slot
+};
+
+//Locality detected at MPI_Init
+extern int *node_of;			//lowest thread on each thread's node
+
+group_sync_ptr group_sync_alloc();
+coll_group *group_new(int size, int *threads, group_sync_ptr *sync);
+void group_free(coll_group *g);
+int group_rank_of(coll_group *g, int thread);
+shared [] char *group_scratch(coll_group *g, size_t size);
+int group_agree(coll_group *g, int failed);
+void group_barrier(coll_group *g);
+int group_bcast(coll_group *g, void *buf, size_t size, int root);
+int group_reduce(coll_group *g, void *sendbuf, void *recvbuf, int count,
+		 MPI_Datatype datatype, MPI_Op op, int root);
+int group_gather(coll_group *g, void *sendbuf, size_t size,
+		 void *recvbuf, int root);
+int group_allgatherv(coll_group *g, void *sendbuf, size_t *sizes,
+		     void *recvbuf);
+int group_allgather(coll_group *g, void *sendbuf, size_t size,
+		    void *recvbuf);
+int group_scatter(coll_group *g, void *sendbuf, size_t size,
+		  void *recvbuf, int root);
+int group_alltoall(coll_group *g, void *sendbuf, size_t size,
+		   void *recvbuf);
+int group_scan(coll_group *g, void *sendbuf, void *recvbuf, int count,
+	       MPI_Datatype datatype, MPI_Op op);
+int group_reduce_scatter(coll_group *g, void *sendbuf, void *recvbuf,
+			 int *counts, MPI_Datatype datatype, MPI_Op op);
+
+int comm_init();
+void comm_finalize();
+int comm_groups(MPI_Comm comm, group_sync_ptr **sync);
+int comm_build(MPI_Comm parent, int color, int key, MPI_Comm *newcomm);
+int comm_rank_of(MPI_Comm comm, int thread);
+
+int hier_init();
+void hier_finalize();
+int thread_castable(int thread);
+void *thread_cast(shared void *ptr);
+int hier_barrier(MPI_Comm comm);
+int hier_bcast(MPI_Comm comm, void *buf, size_t size, int root);
+int hier_reduce(MPI_Comm comm, void *sendbuf, void *recvbuf, int count,
+		MPI_Datatype datatype, MPI_Op op, int root);
+int hier_allreduce(MPI_Comm comm, void *sendbuf, void *recvbuf, int count,
+		   MPI_Datatype datatype, MPI_Op op);
+int hier_allgather(MPI_Comm comm, void *sendbuf, size_t size,
+		   void *recvbuf);
+
+#endif /* _UPC_GROUP_H */
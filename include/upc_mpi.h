@@ -7,6 +7,7 @@ struct message_shared {
 	int source;
 	int dest;
 	int tag;
+	int context;		//communicator the message was sent on
 	int data_size;
 	shared char *data;
 };
@@ -17,6 +18,7 @@ struct message_local {
 	int source;
 	int dest;
 	int tag;
+	int context;
 	int data_size;
 	char *data;
 };
@@ -24,11 +26,34 @@ struct message_local {
 //The message array
 message_shared *message_list;
 
+//Matches a message sent on any communicator
+#define CONTEXT_ANY -1
+
+//Number of non-blocking collectives each thread can have in flight
+#define NBC_SLOTS 16
+
+//A thread's published state for one non-blocking collective
+typedef struct nbc_slot nbc_slot;
+struct nbc_slot {
+	int seq;		//last operation whose data is published
+	int ack;		//last operation this thread has consumed
+	size_t data_size;
+	shared [] char *data;
+};
+
 int upc_all_mpi_init();
 int upc_all_mpi_finalize();
-int new_message(void *data, size_t data_size, int source, int dest, int tag);
+int new_message(void *data, size_t data_size, int source, int dest, int tag,
+		int context);
+int new_message_typed(void *buf, int count, MPI_Datatype datatype,
+		      int source, int dest, int tag, int context);
 int delete_message(int off);
-message_local *get_message(int source, int dest, int tag);
-int find_message(int source, int dest, int tag);
+message_local *get_message(int source, int dest, int tag, int context);
+int find_message(int source, int dest, int tag, int context);
+int find_message_nolock(int source, int dest, int tag, int context);
+shared [] char *thread_block(shared void *buf, int thread);
+void nbc_progress();
+void nbc_barrier_flush();
+void nbc_upc_enter();
 
 #endif /* _UPC_MPI_H */
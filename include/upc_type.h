@@ -0,0 +1,80 @@
+#ifndef _UPC_TYPE_H
+#define _UPC_TYPE_H 1
+
+//Handles of derived datatypes start here; lower ones are the basic types
+#define TYPE_FIRST     64
+#define TYPE_BASICS    (MPI_UINT64_T + 1)
+
+//Kinds of basic datatype
+#define TYPE_CLASS_BYTE   0	//opaque bytes
+#define TYPE_CLASS_INT    1	//signed integer
+#define TYPE_CLASS_UINT   2
+#define TYPE_CLASS_FLOAT  3
+#define TYPE_CLASS_PAIR   4	//value and int index, for MPI_MINLOC/MAXLOC
+
+//A predefined datatype
+typedef struct type_basic type_basic;
+struct type_basic {
+	size_t size;
+	size_t align;
+	int class;
+	int (*combine)(void *inout, void *in, int count, MPI_Op op);
+	//upc_all_reduce of one element per thread, or NULL if the library
+	//has none for the type
+	void (*upc_reduce)(shared void *dst, shared void *src, MPI_Op op);
+};
+
+//How a derived datatype was made
+#define TYPE_CONTIGUOUS  1
+#define TYPE_VECTOR      2
+#define TYPE_INDEXED     3
+#define TYPE_STRUCT      4
+#define TYPE_SUBARRAY    5
+
+//count runs of len bytes starting at off, stride bytes apart
+typedef struct type_run type_run;
+struct type_run {
+	MPI_Aint off;
+	size_t len;
+	int count;
+	MPI_Aint stride;
+};
+
+//The copy plan of one instance of a datatype
+typedef struct type_plan type_plan;
+struct type_plan {
+	int nruns;
+	int cap;
+	type_run *runs;
+	int dense;			//one run filling the extent
+};
+
+//A derived datatype: blocklens[i] instances of types[i] at disps[i] bytes
+typedef struct type_desc type_desc;
+struct type_desc {
+	int combiner;
+	int count;
+	int *blocklens;
+	MPI_Aint *disps;
+	MPI_Datatype *types;
+	size_t size;			//bytes of data in one instance
+	MPI_Aint lb;
+	MPI_Aint extent;
+	size_t align;			//strictest alignment of the basic types
+	int committed;
+	int refs;			//the handle and every type built from it
+	type_plan *plan;		//compiled at commit, or when a parent needs it
+};
+
+const type_basic *type_basic_of(MPI_Datatype datatype);
+type_desc *type_get(MPI_Datatype datatype);
+size_t type_size(MPI_Datatype datatype);
+int type_dense(MPI_Datatype datatype);
+void type_hold(MPI_Datatype datatype);
+void type_release(MPI_Datatype datatype);
+int type_pack(void *inbuf, int count, MPI_Datatype datatype, void *outbuf);
+int type_unpack(void *inbuf, size_t bytes, void *outbuf, int count,
+		MPI_Datatype datatype);
+void type_finalize();
+
+#endif /* _UPC_TYPE_H */
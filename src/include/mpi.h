@@ -11,6 +11,8 @@
  */
 #define MPI_ANY_SOURCE         -1                      /* match any source rank */
 #define MPI_ANY_TAG            -1                      /* match any message tag */
+#define MPI_UNDEFINED      -32766                      /* no color, rank or value */
+#define MPI_PROC_NULL          -2                      /* no neighbour; transfers are skipped */
 #define MPI_WTIME_IS_GLOBAL     0
 
 /* Error codes */
@@ -32,7 +34,10 @@
 #define MPI_ERR_TRUNCATE              15
 #define MPI_ERR_OTHER                 16
 #define MPI_ERR_INTERN                17
-#define MPI_ERR_LASTCODE              18
+#define MPI_ERR_WIN                   18
+#define MPI_ERR_RMA_RANGE             19
+#define MPI_ERR_RMA_SYNC              20
+#define MPI_ERR_LASTCODE              21
 
 /* C datatypes */
 #define MPI_BYTE                      0
@@ -55,11 +60,31 @@
 #define MPI_LONG_LONG                 17
 #define MPI_UNSIGNED_LONG_LONG        18
 #define MPI_DOUBLE_INT                19
+#define MPI_FLOAT_INT                 20
+#define MPI_2INT                      21
+#define MPI_LONG_DOUBLE_INT           22
+#define MPI_INT8_T                    23
+#define MPI_UINT8_T                   24
+#define MPI_INT16_T                   25
+#define MPI_UINT16_T                  26
+#define MPI_INT32_T                   27
+#define MPI_UINT32_T                  28
+#define MPI_INT64_T                   29
+#define MPI_UINT64_T                  30
+#define MPI_DATATYPE_NULL             -1
+
+/* Array orders for MPI_Type_create_subarray */
+#define MPI_ORDER_C                   56
+#define MPI_ORDER_FORTRAN             57
 
 /* MPI_Reduce constants */
 #define MPI_MAX                       UPC_MAX
 #define MPI_MIN                       UPC_MIN
 #define MPI_SUM                       UPC_ADD
+#define MPI_REPLACE                   -2       /* RMA only: store the origin value */
+#define MPI_NO_OP                     -3       /* RMA only: leave the target alone */
+#define MPI_MINLOC                    -4       /* value and index pairs only */
+#define MPI_MAXLOC                    -5
 
 #define MPI_ERRORS_RETURN             1
 
@@ -71,13 +96,49 @@ typedef int MPI_Op;
  * MPI_Comm
  */
 
-typedef struct MPI_Comm MPI_Comm;
+struct coll_group;
+struct comm_topo;
+
+typedef struct MPI_Comm *MPI_Comm;
 struct MPI_Comm {
     int size;
+    int rank;
+    int context;                  /* point-to-point context, collectives use context + 1 */
+    int *threads;                 /* thread of each rank */
+    int world;                    /* every thread, in thread order */
+    int num_nodes;
+    int hier;                     /* members on more than one node, some sharing one */
+    struct coll_group *group;     /* all members */
+    struct coll_group *node;      /* members on this thread's node */
+    struct coll_group *leaders;   /* first member on each node, NULL unless one */
+    struct comm_topo *topo;       /* Cartesian or graph topology, or NULL */
+};
+
+/* Topology types */
+#define MPI_CART                      1
+#define MPI_DIST_GRAPH                3
+
+#define MPI_UNWEIGHTED ((int *) 0)
+
+/* Communicator split types */
+#define MPI_COMM_TYPE_SHARED          1
+
+extern MPI_Comm MPI_COMM_WORLD;
+extern MPI_Comm MPI_COMM_SELF;
+#define MPI_COMM_NULL ((MPI_Comm) 0)
+
+/*
+ * MPI_Group
+ */
+
+typedef struct MPI_Group *MPI_Group;
+struct MPI_Group {
+    int size;
+    int rank;                     /* MPI_UNDEFINED if the caller is not a member */
+    int *threads;
 };
 
-MPI_Comm MPI_COMM_WORLD;
-#define MPI_COMM_SELF MPI_COMM_WORLD
+#define MPI_GROUP_NULL ((MPI_Group) 0)
 
 /*
  * MPI_Status
@@ -96,14 +157,44 @@ struct MPI_Status {
 typedef struct MPI_Request MPI_Request;
 struct MPI_Request {
     int done;
+    int type;
+    void *state;
 };
 
+/* MPI_Request types */
+#define REQUEST_FLAG                  0        /* complete once done is set */
+#define REQUEST_COLL                  1        /* non-blocking collective */
+#define REQUEST_FILE                  2        /* queued file operation */
+#define REQUEST_SPLIT                 3        /* nonblocking collective file operation */
+
+/*
+ * MPI_Win
+ */
+
+typedef long MPI_Aint;
+typedef struct MPI_Win *MPI_Win;
+
+#define MPI_WIN_NULL ((MPI_Win) 0)
+
+/* Window assertions, accepted and ignored */
+#define MPI_MODE_NOCHECK              1
+#define MPI_MODE_NOSTORE              2
+#define MPI_MODE_NOPUT                4
+#define MPI_MODE_NOPRECEDE            8
+#define MPI_MODE_NOSUCCEED            16
+
+/* Passive target lock types */
+#define MPI_LOCK_EXCLUSIVE            234
+#define MPI_LOCK_SHARED               235
+
 
 #include "mpi_info.h"
 #include "mpi_io.h"
 #include "mpi_utils.h"
 
 #define MPI_STATUS_IGNORE ((MPI_Status *) 0)
+#define MPI_IN_PLACE ((void *) 1)
+#define MPI_STATUSES_IGNORE ((MPI_Status *) 0)
 #define MPI_MAX_PROCESSOR_NAME 256
 
 /* Functions */
@@ -122,6 +213,26 @@ int MPI_Send(void *buf, int count, MPI_Datatype datatype, int dest,
 int MPI_Unpack(void *inbuf, int insize, int *position,
 	       void *outbuf, int outcount, MPI_Datatype datatype,
 	       MPI_Comm comm);
+int MPI_Type_contiguous(int count, MPI_Datatype oldtype,
+			MPI_Datatype *newtype);
+int MPI_Type_vector(int count, int blocklength, int stride,
+		    MPI_Datatype oldtype, MPI_Datatype *newtype);
+int MPI_Type_indexed(int count, int *array_of_blocklengths,
+		     int *array_of_displacements, MPI_Datatype oldtype,
+		     MPI_Datatype *newtype);
+int MPI_Type_create_struct(int count, int *array_of_blocklengths,
+			   MPI_Aint *array_of_displacements,
+			   MPI_Datatype *array_of_types,
+			   MPI_Datatype *newtype);
+int MPI_Type_create_subarray(int ndims, int *array_of_sizes,
+			     int *array_of_subsizes, int *array_of_starts,
+			     int order, MPI_Datatype oldtype,
+			     MPI_Datatype *newtype);
+int MPI_Type_commit(MPI_Datatype *datatype);
+int MPI_Type_free(MPI_Datatype *datatype);
+int MPI_Type_size(MPI_Datatype datatype, int *size);
+int MPI_Type_get_extent(MPI_Datatype datatype, MPI_Aint *lb,
+			MPI_Aint *extent);
 int MPI_Comm_rank(MPI_Comm comm, int *rank);
 int MPI_Comm_size(MPI_Comm comm, int *size);
 int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag,
@@ -132,6 +243,115 @@ int MPI_Reduce(void *sendbuf, void *recvbuf, int count,
 int MPI_Allgather(void *sendbuf, int  sendcount,
 		  MPI_Datatype sendtype, void *recvbuf, int recvcount,
 		  MPI_Datatype recvtype, MPI_Comm comm);
+int MPI_Allreduce(void *sendbuf, void *recvbuf, int count,
+		  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+int MPI_Gather(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+	       void *recvbuf, int recvcount, MPI_Datatype recvtype,
+	       int root, MPI_Comm comm);
+int MPI_Scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype,
+		int root, MPI_Comm comm);
+int MPI_Alltoall(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+		 MPI_Comm comm);
+int MPI_Scan(void *sendbuf, void *recvbuf, int count,
+	     MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+int MPI_Reduce_scatter(void *sendbuf, void *recvbuf, int *recvcounts,
+		       MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+int MPI_Reduce_scatter_block(void *sendbuf, void *recvbuf, int recvcount,
+			     MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request *request);
+int MPI_Ibcast(void *buffer, int count, MPI_Datatype datatype,
+	       int root, MPI_Comm comm, MPI_Request *request);
+int MPI_Ireduce(void *sendbuf, void *recvbuf, int count,
+		MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm,
+		MPI_Request *request);
+int MPI_Iallreduce(void *sendbuf, void *recvbuf, int count,
+		   MPI_Datatype datatype, MPI_Op op, MPI_Comm comm,
+		   MPI_Request *request);
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status);
+int MPI_Wait(MPI_Request *request, MPI_Status *status);
+int MPI_Waitall(int count, MPI_Request *requests, MPI_Status *statuses);
+
+int MPI_Comm_split(MPI_Comm comm, int color, int key, MPI_Comm *newcomm);
+int MPI_Comm_dup(MPI_Comm comm, MPI_Comm *newcomm);
+int MPI_Comm_split_type(MPI_Comm comm, int split_type, int key,
+			MPI_Info info, MPI_Comm *newcomm);
+int MPI_Comm_create(MPI_Comm comm, MPI_Group group, MPI_Comm *newcomm);
+int MPI_Comm_free(MPI_Comm *comm);
+int MPI_Comm_group(MPI_Comm comm, MPI_Group *group);
+int MPI_Group_incl(MPI_Group group, int n, int *ranks, MPI_Group *newgroup);
+int MPI_Group_size(MPI_Group group, int *size);
+int MPI_Group_rank(MPI_Group group, int *rank);
+int MPI_Group_free(MPI_Group *group);
+int MPI_Cart_create(MPI_Comm comm_old, int ndims, int *dims, int *periods,
+		    int reorder, MPI_Comm *comm_cart);
+int MPI_Cart_coords(MPI_Comm comm, int rank, int maxdims, int *coords);
+int MPI_Cart_rank(MPI_Comm comm, int *coords, int *rank);
+int MPI_Cart_shift(MPI_Comm comm, int direction, int disp,
+		   int *rank_source, int *rank_dest);
+int MPI_Dist_graph_create_adjacent(MPI_Comm comm_old, int indegree,
+				   int *sources, int *sourceweights,
+				   int outdegree, int *destinations,
+				   int *destweights, MPI_Info info,
+				   int reorder, MPI_Comm *comm_dist_graph);
+int MPI_Neighbor_allgather(void *sendbuf, int sendcount,
+			   MPI_Datatype sendtype, void *recvbuf,
+			   int recvcount, MPI_Datatype recvtype,
+			   MPI_Comm comm);
+int MPI_Neighbor_alltoall(void *sendbuf, int sendcount,
+			  MPI_Datatype sendtype, void *recvbuf,
+			  int recvcount, MPI_Datatype recvtype,
+			  MPI_Comm comm);
+
+int MPI_Win_create(void *base, MPI_Aint size, int disp_unit, MPI_Info info,
+		   MPI_Comm comm, MPI_Win *win);
+int MPI_Win_allocate_shared(MPI_Aint size, int disp_unit, MPI_Info info,
+			    MPI_Comm comm, void *baseptr, MPI_Win *win);
+int MPI_Win_shared_query(MPI_Win win, int rank, MPI_Aint *size,
+			 int *disp_unit, void *baseptr);
+int MPI_Win_allocate(MPI_Aint size, int disp_unit, MPI_Info info,
+		     MPI_Comm comm, void *baseptr, MPI_Win *win);
+int MPI_Win_free(MPI_Win *win);
+int MPI_Put(void *origin_addr, int origin_count,
+	    MPI_Datatype origin_datatype, int target_rank,
+	    MPI_Aint target_disp, int target_count,
+	    MPI_Datatype target_datatype, MPI_Win win);
+int MPI_Get(void *origin_addr, int origin_count,
+	    MPI_Datatype origin_datatype, int target_rank,
+	    MPI_Aint target_disp, int target_count,
+	    MPI_Datatype target_datatype, MPI_Win win);
+int MPI_Win_fence(int assert, MPI_Win win);
+int MPI_Win_post(MPI_Group group, int assert, MPI_Win win);
+int MPI_Win_start(MPI_Group group, int assert, MPI_Win win);
+int MPI_Win_complete(MPI_Win win);
+int MPI_Win_wait(MPI_Win win);
+int MPI_Win_test(MPI_Win win, int *flag);
+int MPI_Win_sync(MPI_Win win);
+int MPI_Accumulate(void *origin_addr, int origin_count,
+		   MPI_Datatype origin_datatype, int target_rank,
+		   MPI_Aint target_disp, int target_count,
+		   MPI_Datatype target_datatype, MPI_Op op, MPI_Win win);
+int MPI_Get_accumulate(void *origin_addr, int origin_count,
+		       MPI_Datatype origin_datatype, void *result_addr,
+		       int result_count, MPI_Datatype result_datatype,
+		       int target_rank, MPI_Aint target_disp,
+		       int target_count, MPI_Datatype target_datatype,
+		       MPI_Op op, MPI_Win win);
+int MPI_Fetch_and_op(void *origin_addr, void *result_addr,
+		     MPI_Datatype datatype, int target_rank,
+		     MPI_Aint target_disp, MPI_Op op, MPI_Win win);
+int MPI_Compare_and_swap(void *origin_addr, void *compare_addr,
+			 void *result_addr, MPI_Datatype datatype,
+			 int target_rank, MPI_Aint target_disp, MPI_Win win);
+int MPI_Win_lock(int lock_type, int rank, int assert, MPI_Win win);
+int MPI_Win_unlock(int rank, MPI_Win win);
+int MPI_Win_lock_all(int assert, MPI_Win win);
+int MPI_Win_unlock_all(MPI_Win win);
+int MPI_Win_flush(int rank, MPI_Win win);
+int MPI_Win_flush_all(MPI_Win win);
+int MPI_Win_flush_local(int rank, MPI_Win win);
+int MPI_Win_flush_local_all(MPI_Win win);
 
 int MPI_Errhandler_set(MPI_Comm comm, MPI_Errhandler errhandler);
 
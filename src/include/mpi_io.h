@@ -24,11 +24,49 @@
 
 #define MPI_Offset               upc_off_t
 
+struct file_cache;
+struct file_driver;
+struct file_prefetch;
+struct file_split;
+struct file_view;
+struct file_zip;
+
 typedef MPI_Request MPIO_Request;
 typedef struct MPI_File *MPI_File;
 struct MPI_File {
-        upcio_file_t *fd;
-        MPI_Info info;
+        const struct file_driver *driver;
+        void *handle;               /* the driver's state on this thread */
+        int amode;
+        MPI_Offset position;        /* individual file pointer, bytes of view data */
+        int pending;                /* asynchronous operations in flight */
+        MPI_Comm comm;              /* duplicate of the communicator it was opened on */
+        int cb_nodes;               /* collective buffering aggregators, 0 for one per node */
+        size_t cb_buffer_size;
+        int cb_read;                /* collective accesses use two-phase I/O */
+        int cb_write;
+        MPI_Offset striping_unit;
+        int striping_factor;        /* stripe targets, 0 when unknown */
+        int ds_read;                /* independent strided accesses are sieved */
+        int ds_write;
+        size_t ind_rd_buffer_size;  /* data sieving buffers */
+        size_t ind_wr_buffer_size;
+        int direct_io;              /* the posix driver uses O_DIRECT */
+        size_t write_behind;        /* write-behind buffer size, 0 when off */
+        struct file_cache *cache;
+        int read_ahead;             /* sequential and strided reads are read ahead */
+        struct file_prefetch *prefetch;
+        char *access_style;         /* as given in the hint, or NULL */
+        int compression;            /* collective writes are compressed */
+        MPI_Offset compression_chunk;
+        int compression_typesize;
+        struct file_zip *zip;       /* index of a compressed file, or NULL */
+        struct file_split *split;   /* the split collective in progress */
+        upc_lock_t *sieve_lock;     /* held across a sieved read-modify-write */
+        shared [] char *shared_fp;  /* shared file pointer, bytes of view data, on rank 0 */
+        MPI_Offset disp;            /* the view */
+        MPI_Datatype etype;
+        MPI_Datatype filetype;
+        struct file_view *view;     /* NULL while the view is contiguous */
 };
 
 int MPI_File_open(MPI_Comm comm, char *filename,
@@ -42,13 +80,65 @@ int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset,
 			 MPI_Status *status);
 int MPI_File_write_at_all(MPI_File fh, MPI_Offset offset, void *buf,			  
 			  int count, MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_read_all(MPI_File fh, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_write_all(MPI_File fh, void *buf, int count,
+		       MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_read_at_all_begin(MPI_File fh, MPI_Offset offset, void *buf,
+			       int count, MPI_Datatype datatype);
+int MPI_File_read_at_all_end(MPI_File fh, void *buf, MPI_Status *status);
+int MPI_File_write_at_all_begin(MPI_File fh, MPI_Offset offset, void *buf,
+				int count, MPI_Datatype datatype);
+int MPI_File_write_at_all_end(MPI_File fh, void *buf, MPI_Status *status);
+int MPI_File_read_all_begin(MPI_File fh, void *buf, int count,
+			    MPI_Datatype datatype);
+int MPI_File_read_all_end(MPI_File fh, void *buf, MPI_Status *status);
+int MPI_File_write_all_begin(MPI_File fh, void *buf, int count,
+			     MPI_Datatype datatype);
+int MPI_File_write_all_end(MPI_File fh, void *buf, MPI_Status *status);
+int MPI_File_iread_at_all(MPI_File fh, MPI_Offset offset, void *buf,
+			  int count, MPI_Datatype datatype,
+			  MPI_Request *request);
+int MPI_File_iwrite_at_all(MPI_File fh, MPI_Offset offset, void *buf,
+			   int count, MPI_Datatype datatype,
+			   MPI_Request *request);
+int MPI_File_iread_all(MPI_File fh, void *buf, int count,
+		       MPI_Datatype datatype, MPI_Request *request);
+int MPI_File_iwrite_all(MPI_File fh, void *buf, int count,
+			MPI_Datatype datatype, MPI_Request *request);
+int MPI_File_set_view(MPI_File fh, MPI_Offset disp, MPI_Datatype etype,
+		      MPI_Datatype filetype, char *datarep, MPI_Info info);
+int MPI_File_get_view(MPI_File fh, MPI_Offset *disp, MPI_Datatype *etype,
+		      MPI_Datatype *filetype, char *datarep);
+int MPI_File_read_at(MPI_File fh, MPI_Offset offset, void *buf, int count,
+		     MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_write_at(MPI_File fh, MPI_Offset offset, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_read(MPI_File fh, void *buf, int count, MPI_Datatype datatype,
+		  MPI_Status *status);
+int MPI_File_write(MPI_File fh, void *buf, int count, MPI_Datatype datatype,
+		   MPI_Status *status);
 int MPI_File_seek(MPI_File fh, MPI_Offset offset, int whence);
+int MPI_File_read_shared(MPI_File fh, void *buf, int count,
+			 MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_write_shared(MPI_File fh, void *buf, int count,
+			  MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_read_ordered(MPI_File fh, void *buf, int count,
+			  MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_write_ordered(MPI_File fh, void *buf, int count,
+			   MPI_Datatype datatype, MPI_Status *status);
+int MPI_File_seek_shared(MPI_File fh, MPI_Offset offset, int whence);
+int MPI_File_get_position_shared(MPI_File fh, MPI_Offset *offset);
 int MPI_File_set_size(MPI_File fh, MPI_Offset size);
 int MPI_File_close(MPI_File *fh);
 int MPI_File_delete(char *filename, MPI_Info info);
 int MPI_File_get_info(MPI_File fh, MPI_Info *info_used);
+int MPI_File_set_info(MPI_File fh, MPI_Info info);
 int MPI_File_sync(MPI_File fh);
 int MPI_File_get_size(MPI_File fh, MPI_Offset *size);
+int MPIO_File_map(MPI_File fh, MPI_Offset offset, void **ptr,
+		  MPI_Offset *size);
 int MPIO_Wait(MPIO_Request *request, MPI_Status *status);
+int MPIO_Test(MPIO_Request *request, int *flag, MPI_Status *status);
 
 #endif /* End _MPI_IO_H */ 
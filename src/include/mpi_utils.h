@@ -2,5 +2,6 @@
 #define _MPI_UTILS_H 1
 
 size_t sizeof_datatype(int datatype);
+int reduce_local(void *inout, void *in, int count, int datatype, int op);
 
 #endif /*End _MPI_UTILS_H*/
@@ -0,0 +1,41 @@
+#ifndef _UPC_AIO_H
+#define _UPC_AIO_H 1
+
+#include <pthread.h>
+#include "upc_file.h"
+
+//Environment variable giving the number of I/O worker threads
+#define AIO_THREADS_ENV  "MPITOUPC_IO_THREADS"
+#define AIO_THREADS      2
+
+//One queued file operation
+typedef struct aio_job aio_job;
+struct aio_job {
+	ssize_t (*run)(aio_job *job);	//performs the transfer, -1 on failure
+	MPI_File file;			//moved through its driver's pio only
+	char *buf;			//bytes to write, or to read into
+	size_t size;
+	MPI_Offset offset;
+	file_seg *segs;			//pieces of a strided view, or NULL
+	int nsegs;
+	size_t sieve;			//bytes of the sieve buffer for segs
+	ssize_t result;
+	int done;			//set by the worker under the pool lock
+	int *pending;			//operations in flight on the file
+	void *ubuf;			//user buffer to unpack a read into
+	int count;
+	MPI_Datatype datatype;
+	int packed;			//buf was allocated to pack a derived type
+	aio_job *next;
+};
+
+aio_job *aio_job_new(MPI_File fh, void *buf, int count,
+		     MPI_Datatype datatype, int write);
+int aio_submit(aio_job *job);
+int aio_test(aio_job *job);
+void aio_wait(aio_job *job);
+int aio_finish(aio_job *job);
+void aio_drain(MPI_File fh);
+void aio_finalize();
+
+#endif /* _UPC_AIO_H */
@@ -0,0 +1,193 @@
+#ifndef _UPC_FILE_H
+#define _UPC_FILE_H 1
+
+//Environment variable giving the number of collective buffering aggregators
+#define FILE_CB_NODES_ENV       "MPITOUPC_CB_NODES"
+
+//Environment variable naming the default backend, pupc or posix
+#define FILE_DRIVER_ENV         "MPITOUPC_IO_DRIVER"
+
+//Buffer, offset and length alignment for O_DIRECT transfers
+#define FILE_DIRECT_ALIGN       4096
+#define FILE_DIRECT_BOUNCE      (4 * 1024 * 1024)
+
+//Defaults of the collective buffering hints
+#define FILE_CB_BUFFER_SIZE     (16 * 1024 * 1024)
+#define FILE_STRIPING_UNIT      (1024 * 1024)
+
+//Defaults of the data sieving buffer hints
+#define FILE_IND_RD_BUFFER_SIZE (4 * 1024 * 1024)
+#define FILE_IND_WR_BUFFER_SIZE (512 * 1024)
+
+//Write-behind cache: writes smaller than the buffer are merged in it
+#define FILE_WRITE_BEHIND_SIZE  (1024 * 1024)
+#define FILE_CACHE_RUNS         64
+
+//Rounds of aggregator writes a split collective keeps in flight
+#define FILE_SPLIT_ROUNDS       4
+
+//Read-ahead: buffers per file, the block prefetched for sequential reads,
+//and the largest read that is prefetched
+#define FILE_PREFETCH_SLOTS     8
+#define FILE_PREFETCH_BLOCK     (1024 * 1024)
+#define FILE_PREFETCH_LARGEST   (16 * 1024 * 1024)
+
+//Compressed files: default chunk size and element width for the byte
+//shuffle, and the bytes before the first chunk that hold the header
+#define FILE_ZIP_CHUNK          (1024 * 1024)
+#define FILE_ZIP_TYPESIZE       8
+#define FILE_ZIP_HEADER         512
+
+//len bytes of a rank's access at off in the file; the data of successive
+//segments follows on in the rank's packed buffer
+typedef struct file_seg file_seg;
+struct file_seg {
+	MPI_Offset off;
+	MPI_Offset len;
+};
+
+//A noncontiguous file view: the runs of one instance of the filetype,
+//relative to the displacement, tiled every extent bytes
+typedef struct file_view file_view;
+struct file_view {
+	int nsegs;
+	file_seg *segs;
+	MPI_Offset *data;		//bytes of data before each run
+	MPI_Offset size;		//bytes of data in one instance
+	MPI_Offset extent;
+};
+
+//The write-behind cache of a file on one thread: dirty runs, sorted and
+//apart, within one aligned chunk of the file
+typedef struct file_cache file_cache;
+struct file_cache {
+	char *buf;
+	size_t cap;
+	MPI_Offset base;		//file offset of buf
+	int nruns;
+	file_seg runs[FILE_CACHE_RUNS];
+};
+
+struct aio_job;
+
+//A prefetched range of a file
+typedef struct file_slot file_slot;
+struct file_slot {
+	struct aio_job *job;		//the read, until it is collected
+	char *buf;
+	size_t cap;
+	MPI_Offset off;
+	MPI_Offset len;			//bytes asked for, then bytes read
+	int used;			//holds a range
+	int served;			//a read was served from it
+};
+
+//The read pattern of a file on one thread and its prefetched ranges
+typedef struct file_prefetch file_prefetch;
+struct file_prefetch {
+	MPI_Offset last;		//offset of the last read, or -1
+	MPI_Offset stride;		//between the last two reads
+	MPI_Offset size;		//of the last read
+	int hits;			//reads that followed the pattern
+	MPI_Offset next;		//first offset not yet prefetched
+	MPI_Offset eof;			//end of file a short read found, or -1
+	int depth;			//ranges kept in flight ahead
+	file_slot slots[FILE_PREFETCH_SLOTS];
+};
+
+//A collective access started by a split or nonblocking call: the data
+//has reached the aggregators, whose writes run on the I/O workers
+typedef struct file_split file_split;
+struct file_split {
+	int err;			//of the exchange
+	int njobs;
+	struct aio_job **jobs;		//NULL once collected
+};
+
+//A chunk of a compressed file, as its index is stored in the file
+typedef struct file_zchunk file_zchunk;
+struct file_zchunk {
+	MPI_Offset off;			//of the stored bytes, 0 if never written
+	MPI_Offset len;			//bytes stored
+	MPI_Offset ulen;		//bytes of data in the chunk
+	MPI_Offset raw;			//stored as is, not compressed
+};
+
+//A chunk an aggregator rewrote, until the ranks share it
+typedef struct file_zupdate file_zupdate;
+struct file_zupdate {
+	MPI_Offset chunk;
+	file_zchunk entry;
+};
+
+//The index of a compressed file, the same on every rank between
+//collective writes
+typedef struct file_zip file_zip;
+struct file_zip {
+	MPI_Offset chunk;		//bytes of data per chunk
+	int typesize;			//width of the byte shuffle, 1 for none
+	MPI_Offset size;		//bytes of data in the file
+	MPI_Offset nchunks;
+	file_zchunk *index;
+	shared [] char *end;		//end of the stored bytes, on rank 0
+	int nupdates;
+	file_zupdate *updates;		//rewritten by this rank
+	int dirty;			//the index in the file is stale
+};
+
+//A file system backend
+//open, close, sync and set_size are collective over the file's communicator
+//pio may run on an I/O worker, so it must not call into the UPC runtime
+typedef struct file_driver file_driver;
+struct file_driver {
+	const char *name;
+	const char *prefix;		//selects the driver in a filename
+	int (*open)(MPI_File fh, char *filename, int amode);
+	int (*close)(MPI_File fh);
+	ssize_t (*pio)(void *handle, void *buf, size_t size, MPI_Offset off,
+		       int write);
+	int (*sync)(MPI_File fh);
+	MPI_Offset (*size)(MPI_File fh);
+	int (*set_size)(MPI_File fh, MPI_Offset size);
+	//Address of byte off of a mapped file and the bytes mapped from it,
+	//or NULL for a driver without a mapping
+	void *(*map)(MPI_File fh, MPI_Offset off, MPI_Offset *avail);
+};
+
+extern const file_driver file_pupc;
+extern const file_driver file_posix;
+extern const file_driver file_mmap;
+
+ssize_t file_pio(MPI_File fh, void *buf, size_t size, MPI_Offset off,
+		 int write);
+int file_view_new(MPI_Datatype filetype, file_view **view);
+void file_view_free(file_view *view);
+int file_view_map(MPI_File fh, MPI_Offset pos, MPI_Offset bytes,
+		  file_seg **segs, int *nsegs);
+ssize_t file_sieve(MPI_File fh, file_seg *segs, int nsegs, char *buf,
+		   size_t bufsize, int write);
+int file_cache_write(MPI_File fh, void *buf, size_t size, MPI_Offset off);
+int file_cache_flush(MPI_File fh, MPI_Offset off, MPI_Offset len);
+void file_cache_free(MPI_File fh);
+ssize_t file_read_ahead(MPI_File fh, void *buf, size_t size, MPI_Offset off);
+size_t file_prefetch_serve(MPI_File fh, void *buf, size_t size,
+			   MPI_Offset off);
+void file_prefetch_note(MPI_File fh, MPI_Offset off, size_t size);
+void file_prefetch_drop(MPI_File fh, MPI_Offset off, MPI_Offset len);
+void file_prefetch_free(MPI_File fh);
+int file_cb_nodes(MPI_File fh);
+int file_twophase(MPI_File fh, file_seg *segs, int nsegs, char *buf,
+		  int write, file_split *split);
+int file_split_test(file_split *split);
+void file_split_wait(file_split *split);
+int file_split_finish(file_split *split);
+int file_zip_open(MPI_File fh);
+ssize_t file_zip_read(MPI_File fh, void *buf, size_t size, MPI_Offset off);
+int file_zip_write(MPI_File fh, file_seg *runs, int n, char *local,
+		   MPI_Offset start);
+int file_zip_share(MPI_File fh);
+int file_zip_flush(MPI_File fh);
+int file_zip_set_size(MPI_File fh, MPI_Offset size);
+void file_zip_free(MPI_File fh);
+
+#endif /* _UPC_FILE_H */
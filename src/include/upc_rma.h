@@ -0,0 +1,73 @@
+#ifndef _UPC_RMA_H
+#define _UPC_RMA_H 1
+
+//Control words each rank keeps per peer, with affinity to itself
+#define WIN_POSTED     0	//last exposure epoch the peer has posted to us
+#define WIN_COMPLETED  1	//last access epoch the peer has completed on us
+#define WIN_CTL_WORDS  2
+
+#define WIN_CTL(entry, word, rank) ((entry)->ctl[(rank) * WIN_CTL_WORDS + (word)])
+
+//Passive target lock word after the per-peer words: holders of a
+//shared lock, or -1 while one rank holds it exclusively
+#define WIN_LOCK_WORD(win, entry) ((entry)->ctl[(win)->comm->size * WIN_CTL_WORDS])
+
+//Set in lock_type for a lock taken with MPI_MODE_NOCHECK, which never
+//touched the lock word
+#define WIN_LOCK_NOCHECK 0x10000
+
+//Locks serializing accumulates the runtime has no atomics for; each
+//covers every WIN_LOCKS-th stripe of WIN_STRIPE bytes
+#define WIN_LOCKS      16
+#define WIN_STRIPE     4096
+
+//What every rank knows about each rank's part of a window
+typedef struct win_entry win_entry;
+struct win_entry {
+	shared [] char *base;		//exposed memory
+	size_t size;
+	int disp_unit;
+	strict shared [] int *ctl;	//WIN_CTL_WORDS per rank, then the lock word
+	upc_lock_t *lock;		//guards the lock word
+	upc_lock_t *stripe[WIN_LOCKS];
+};
+
+#ifdef __BERKELEY_UPC__
+typedef bupc_handle_t win_handle;
+#endif
+
+struct MPI_Win {
+	MPI_Comm comm;			//private duplicate of the creating communicator
+	void *base;			//the caller's memory
+	size_t size;
+	int disp_unit;
+	int allocated;			//memory was allocated by the window
+	int shadow;			//base is private; local is its public copy
+	shared [] char *local;		//this rank's exposed memory
+	shared [] char *segment;	//block shared by the node, held by rank 0
+	char *snapshot;			//public copy at the last synchronization
+	win_entry *members;
+	int *post_seq;			//exposure epochs posted to each rank
+	int *start_seq;			//access epochs started on each rank
+	int *post_group;		//ranks of the current exposure epoch
+	int npost;
+	int *start_group;		//ranks of the current access epoch
+	int nstart;
+	int *lock_type;			//passive target lock held on each rank, or 0
+#ifdef __BERKELEY_UPC__
+	win_handle *pending;		//transfers not yet known to be complete
+	int npending;
+	int cap;
+#endif
+};
+
+int rma_init();
+void rma_finalize();
+int64_t atomic_fetch_add(shared [] char *addr, int64_t val,
+			 upc_lock_t *lock);
+int64_t atomic_swap(shared [] char *addr, int64_t val, upc_lock_t *lock);
+int win_flush_all(MPI_Win win);
+int win_target(MPI_Win win, int rank, MPI_Aint disp, size_t bytes,
+	       shared [] char **addr);
+
+#endif /* _UPC_RMA_H */
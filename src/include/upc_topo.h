@@ -0,0 +1,24 @@
+#ifndef _UPC_TOPO_H
+#define _UPC_TOPO_H 1
+
+//Neighbour flags at the start of a receiver's scratch are padded to this
+#define TOPO_ALIGN 16
+
+//The topology attached to a communicator
+typedef struct comm_topo comm_topo;
+struct comm_topo {
+	int type;			//MPI_CART or MPI_DIST_GRAPH
+	int ndims;
+	int *dims;
+	int *periods;
+	int indegree;
+	int outdegree;
+	int *sources;			//ranks received from, or MPI_PROC_NULL
+	int *destinations;		//ranks sent to, or MPI_PROC_NULL
+	int *slot;			//our index in each destination's sources
+	int epoch;			//neighbour exchanges started
+};
+
+void topo_free(comm_topo *t);
+
+#endif /* _UPC_TOPO_H */
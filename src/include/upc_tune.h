@@ -0,0 +1,43 @@
+#ifndef _UPC_TUNE_H
+#define _UPC_TUNE_H 1
+
+//Collectives with more than one algorithm
+#define COLL_BARRIER     0
+#define COLL_BCAST       1
+#define COLL_REDUCE      2
+#define COLL_ALLREDUCE   3
+#define COLL_ALLGATHER   4
+#define COLL_COUNT       5
+
+//Collective algorithms
+#define ALG_UPC          0	//upc_barrier or the UPC collectives library
+#define ALG_LINEAR       1	//point-to-point messages from the root
+#define ALG_FLAT         2	//flag-synchronized group of all members
+#define ALG_HIER         3	//two-level, node-aware
+#define ALG_COUNT        4
+
+//Environment variables read at MPI_Init
+#define TUNE_FILE_ENV    "MPITOUPC_TUNING_FILE"
+#define TUNE_RULES_ENV   "MPITOUPC_TUNING"
+#define TUNE_OUTPUT_ENV  "MPITOUPC_TUNE"
+
+//Wildcards in a tuning rule
+#define TUNE_ANY         -1
+#define TUNE_ANY_SIZE    ((size_t) -1)
+
+//Use alg for coll when the communicator size, its node count and the
+//message size match
+typedef struct tune_rule tune_rule;
+struct tune_rule {
+	int coll;
+	int threads;
+	int nodes;
+	size_t max_bytes;
+	int alg;
+};
+
+int tune_init();
+void tune_finalize();
+int coll_select(MPI_Comm comm, int coll, size_t bytes);
+
+#endif /* _UPC_TUNE_H */
@@ -10,6 +10,11 @@
 #include <sys/time.h>
 #include "mpi.h"
 #include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_tune.h"
+#include "upc_rma.h"
+#include "upc_type.h"
+#include "upc_aio.h"
 
 /**
  * Exit the program
@@ -20,44 +25,107 @@ int MPI_Abort(MPI_Comm comm, int errorcode) {
 	return MPI_SUCCESS;
 }
 
-//Call upc_barrier
+//Synchronize the members with the selected barrier algorithm
 int MPI_Barrier(MPI_Comm comm) {
+	int alg;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	alg = coll_select(comm, COLL_BARRIER, 0);
+	if (alg == ALG_HIER)
+		return hier_barrier(comm);
+
+	if (alg == ALG_FLAT) {
+		group_barrier(comm->group);
+		return MPI_SUCCESS;
+	}
+
+	nbc_upc_enter();
 	upc_barrier;
 
 	return MPI_SUCCESS;
 }
 
 /** 
- *  Broadcasts a message to all threads
+ *  Broadcasts a message to all members
  *
- *  The root thread will first send a message to all threads.
- *  Then all threads try to receive the message.
+ *  With the linear algorithm the root will first send a message to
+ *  every other member on the communicator's collective context.  Then
+ *  they all try to receive the message.
 */
 int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype,
 	      int root, MPI_Comm comm) {
-	int i, err;
-	
+	shared void *src, *dst;
+	message_local *msg;
+	size_t size;
+	int i, err, alg;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	size = count * sizeof_datatype(datatype);
+	alg = coll_select(comm, COLL_BCAST, size);
+	if (alg == ALG_HIER)
+		return hier_bcast(comm, buffer, size, root);
+
+	if (alg == ALG_FLAT)
+		return group_bcast(comm->group, buffer, size, root);
+
+	if (alg == ALG_UPC && size) {
+		nbc_upc_enter();
+		src = upc_all_alloc(THREADS, size);
+		dst = upc_all_alloc(THREADS, size);
+		if (MYTHREAD == root)
+			upc_memput(thread_block(src, root), buffer, size);
+
+		upc_all_broadcast(dst, thread_block(src, root), size,
+				  UPC_IN_ALLSYNC | UPC_OUT_ALLSYNC);
+		upc_memget(buffer, thread_block(dst, MYTHREAD), size);
+		upc_barrier;
+		if (!MYTHREAD) {
+			upc_free(src);
+			upc_free(dst);
+		}
+
+		return MPI_SUCCESS;
+	}
+
 	err = MPI_SUCCESS;
-	for (i = 0; i < THREADS && MYTHREAD == root; i++) {
-		err = MPI_Send(buffer, count, datatype, i, i, comm);
-		if (err) {
-			err = MPI_ERR_BUFFER;
-			break;
+	if (comm->rank == root) {
+		for (i = 0; i < comm->size; i++) {
+			if (i == root)
+				continue;
+
+			if (new_message(buffer, size, MYTHREAD, comm->threads[i],
+					root, comm->context + 1)) {
+				err = MPI_ERR_BUFFER;
+				break;
+			}
 		}
-	}	
 
-	err = MPI_Recv(buffer, count, datatype, root, MYTHREAD, comm, MPI_STATUS_IGNORE);
-	if (err) {
-		err = MPI_ERR_BUFFER;
-	} else {
-		err = MPI_SUCCESS;
+		return err;
 	}
 
-	return err;
+	msg = NULL;
+	while (msg == NULL) {
+		msg = get_message(comm->threads[root], MYTHREAD, root,
+				  comm->context + 1);
+		usleep(10);
+	}
+
+	memcpy(buffer, msg->data, size);
+	free(msg->data);
+	free(msg);
+
+	return MPI_SUCCESS;
 }
 
 /**
- * Initialize the shared memory and the MPI_COMM_WORLD communicator
+ * Initialize the shared memory and the predefined communicators
  */
 
 int MPI_Init(int *argc, char ***argv) {
@@ -65,14 +133,26 @@ int MPI_Init(int *argc, char ***argv) {
 
 	//Currently ignoring arguments passed to MPI_Init
 	ret = upc_all_mpi_init();
+	if (!ret)
+		ret = hier_init();
+
+	//Create MPI_COMM_WORLD and MPI_COMM_SELF
+	if (!ret)
+		ret = comm_init();
+
+	//Atomic domains for one-sided accumulates
+	if (!ret)
+		ret = rma_init();
+
+	//Load the tuning table, or build one if asked to
+	if (!ret)
+		ret = tune_init();
+
 	if (!ret)
 		ret = MPI_SUCCESS;
 	else
 		ret = MPI_ERR_BUFFER;
 
-	//Set the size of MPI_COMM_WORLD
-	MPI_COMM_WORLD.size = (int) THREADS;
-
 	return ret;
 }
 
@@ -80,6 +160,13 @@ int MPI_Init(int *argc, char ***argv) {
  * Free all of the shared memory used
  */
 int MPI_Finalize(void) {
+	nbc_upc_enter();
+	aio_finalize();
+	tune_finalize();
+	type_finalize();
+	rma_finalize();
+	comm_finalize();
+	hier_finalize();
 	upc_all_mpi_finalize();
 
 	return MPI_SUCCESS;
@@ -91,14 +178,21 @@ int MPI_Finalize(void) {
 int MPI_Pack(void *inbuf, int incount, MPI_Datatype datatype,
 	     void *outbuf, int outsize, int *position, MPI_Comm comm) {
 	size_t size;
+	int err;
+
+	if (!position || *position < 0 || *position > outsize)
+		return MPI_ERR_ARG;
 
 	//The output buffer size isn't large enough
-	if (outsize - *position < incount)
+	size = incount * sizeof_datatype(datatype);
+	if ((size_t) (outsize - *position) < size)
 		return MPI_ERR_BUFFER;
 
-	size = sizeof_datatype(datatype);
-	memcpy((char *)outbuf + *position, inbuf, incount * size);
-	*position += incount * size;
+	err = type_pack(inbuf, incount, datatype, (char *)outbuf + *position);
+	if (err)
+		return err;
+
+	*position += size;
 	
 	return MPI_SUCCESS;
 }
@@ -110,14 +204,22 @@ int MPI_Unpack(void *inbuf, int insize, int *position,
 	       void *outbuf, int outcount, MPI_Datatype datatype,
 	       MPI_Comm comm) {
 	size_t size;
+	int err;
 
-	//The output buffer size isn't large enough
-	if (outcount > insize) 
-		return MPI_ERR_BUFFER;
+	if (!position || *position < 0 || *position > insize)
+		return MPI_ERR_ARG;
 
-	size = sizeof_datatype(datatype);
-	memcpy(outbuf, (char *)inbuf + *position, outcount * size);
-	*position += outcount * size;
+	//The input buffer doesn't hold that many elements
+	size = outcount * sizeof_datatype(datatype);
+	if ((size_t) (insize - *position) < size)
+		return MPI_ERR_TRUNCATE;
+
+	err = type_unpack((char *)inbuf + *position, size, outbuf, outcount,
+			  datatype);
+	if (err)
+		return err;
+
+	*position += size;
 	
 	return MPI_SUCCESS;
 }
@@ -129,24 +231,55 @@ int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
 	     int tag, MPI_Comm comm, MPI_Status *status) {
 	message_local *recv_msg = NULL; 
 	size_t size;
+	int ret;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (type_get(datatype) && !type_get(datatype)->committed)
+		return MPI_ERR_TYPE;
+
+	//Nothing arrives from a missing neighbour
+	if (source == MPI_PROC_NULL) {
+		if (status != NULL) {
+			status->MPI_SOURCE = MPI_PROC_NULL;
+			status->MPI_TAG = MPI_ANY_TAG;
+			status->MPI_ERROR = MPI_SUCCESS;
+		}
+
+		return MPI_SUCCESS;
+	}
+
+	if (source != MPI_ANY_SOURCE && (source < 0 || source >= comm->size))
+		return MPI_ERR_RANK;
+
+	if (source != MPI_ANY_SOURCE)
+		source = comm->threads[source];
 
 	while(recv_msg == NULL) {
-		recv_msg = get_message(source, MYTHREAD, tag);
+		recv_msg = get_message(source, MYTHREAD, tag, comm->context);
 		usleep(10);
 	}
 
 	if (status != NULL) {
-		status->MPI_SOURCE = recv_msg->source;
+		status->MPI_SOURCE = comm_rank_of(comm, recv_msg->source);
 		status->MPI_TAG = recv_msg->tag;
 		status->MPI_ERROR = MPI_SUCCESS;
 	}
 
-	size = sizeof_datatype(datatype);
-	memcpy(buf, recv_msg->data, size * count);
+	//Derived datatypes scatter straight from the message
+	size = sizeof_datatype(datatype) * count;
+	ret = type_unpack(recv_msg->data, recv_msg->data_size, buf, count,
+			  datatype);
+	if (!ret && recv_msg->data_size > size)
+		ret = MPI_ERR_TRUNCATE;
+	if (status != NULL)
+		status->MPI_ERROR = ret;
+
 	free(recv_msg->data);
 	free(recv_msg);
 
-	return MPI_SUCCESS;
+	return ret;
 }
 
 /**
@@ -154,11 +287,23 @@ int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
  */
 int MPI_Send(void *buf, int count, MPI_Datatype datatype, int dest,
 	     int tag, MPI_Comm comm) {
-	size_t size;
 	int ret;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (dest == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	if (dest < 0 || dest >= comm->size)
+		return MPI_ERR_RANK;
+
+	if (type_get(datatype) && !type_get(datatype)->committed)
+		return MPI_ERR_TYPE;
 	
-	size = count * sizeof_datatype(datatype);
-	ret = new_message(buf, size, MYTHREAD, dest, tag);
+	//Derived datatypes are gathered straight into the message
+	ret = new_message_typed(buf, count, datatype, MYTHREAD,
+				comm->threads[dest], tag, comm->context);
 	if (ret) {
 		return MPI_ERR_BUFFER;
 	}
@@ -167,10 +312,13 @@ int MPI_Send(void *buf, int count, MPI_Datatype datatype, int dest,
 }
 
 /**
- * Get the caller's thread id
+ * Get the caller's rank in the communicator
  */
 int MPI_Comm_rank(MPI_Comm comm, int *rank) {
-	*rank = (int) MYTHREAD;
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	*rank = comm->rank;
 
 	return MPI_SUCCESS;
 }
@@ -179,7 +327,10 @@ int MPI_Comm_rank(MPI_Comm comm, int *rank) {
  * Get the communicator's size
  */
 int MPI_Comm_size(MPI_Comm comm, int *size) {
-	*size = comm.size;
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	*size = comm->size;
 
 	return MPI_SUCCESS;
 }
@@ -190,8 +341,16 @@ int MPI_Comm_size(MPI_Comm comm, int *size) {
 int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag,
 	       MPI_Status *status) {
 	int found = 0;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (source != MPI_ANY_SOURCE && (source < 0 || source >= comm->size))
+		return MPI_ERR_RANK;
 	
-	found = find_message(source, MYTHREAD, tag);
+	found = find_message(source == MPI_ANY_SOURCE ? source :
+			     comm->threads[source], MYTHREAD, tag,
+			     comm->context);
 	*flag = found;
 
 	if (status != NULL) {
@@ -221,91 +380,58 @@ double MPI_Wtime() {
  */
 int MPI_Reduce(void *sendbuf, void *recvbuf, int count,
 	       MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm) {
-	int size;
+	const type_basic *basic;
 	shared void *dst, *src;
+	int size, err, alg;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	//The root's contribution is already in recvbuf
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
 
 	size = sizeof_datatype(datatype);
-	src = upc_all_alloc(1, count * size * THREADS);
-	dst = upc_all_alloc(1, count * size);
+	alg = coll_select(comm, COLL_REDUCE, count * size);
+
+	//The UPC library reduces to a single value, so it only handles count
+	//1, of the types and ops it knows
+	basic = type_basic_of(datatype);
+	if (alg == ALG_UPC && (count != 1 || !basic->upc_reduce))
+		alg = ALG_FLAT;
+
+	if (alg == ALG_HIER)
+		return hier_reduce(comm, sendbuf, recvbuf, count, datatype, op,
+				   root);
+
+	if (alg == ALG_FLAT)
+		return group_reduce(comm->group, sendbuf, recvbuf, count,
+				    datatype, op, root);
+
+	nbc_upc_enter();
+	src = upc_all_alloc(THREADS, size);
+	dst = upc_all_alloc(1, size);
+	upc_memput(thread_block(src, MYTHREAD), sendbuf, size);
 	upc_barrier;
-	if (datatype == MPI_CHAR) {
-		upc_memput(((shared char *)src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceC(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_UNSIGNED_CHAR) {
-		upc_memput(((shared unsigned char *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceUC(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
+	basic->upc_reduce(dst, src, op);
 
-	} else if (datatype == MPI_SHORT_INT) {
-		upc_memput(((shared short int *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceS(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_UNSIGNED_SHORT) {
-		upc_memput(((shared unsigned short *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceUS(dst, src, op, count * THREADS,
-				 0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_INT) {
-		upc_memput(((shared int *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceI(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_UNSIGNED) {
-		upc_memput(((shared unsigned int *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceUI(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_LONG) {
-		upc_memput(((shared long *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceL(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_UNSIGNED_LONG) {
-		upc_memput(((shared unsigned long *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceUL(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_FLOAT) {
-		upc_memput(((shared float *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceF(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_DOUBLE) {
-		upc_memput(((shared double *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceD(dst, src, op, count * THREADS,
-				0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else if (datatype == MPI_LONG_DOUBLE) {
-		upc_memput(((shared long double *) src) + (MYTHREAD * count), 
-			   sendbuf, count * size);
-		upc_barrier;
-		upc_all_reduceLD(dst, src, op, count * THREADS,
-				 0, NULL, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-	} else {
-		return MPI_ERR_ARG;
-	}
+	if (MYTHREAD == root)
+		upc_memget(recvbuf, dst, size);
 
-	upc_memget(recvbuf, dst, count * size);
+	upc_barrier;
 	if (!MYTHREAD) {
 	  upc_free(src);
 	  upc_free(dst);
 	}
 
-	return MPI_SUCCESS;
+	return err;
 }
 
 /**
@@ -314,44 +440,20 @@ int MPI_Reduce(void *sendbuf, void *recvbuf, int count,
 int MPI_Allgather(void *sendbuf, int  sendcount,
 		  MPI_Datatype sendtype, void *recvbuf, int recvcount,
 		  MPI_Datatype recvtype, MPI_Comm comm) {
-	shared char *src_char;	
-	shared unsigned char *src_uchar;
-	shared short int *src_sint;
-	shared unsigned short *src_usint;
-	shared int *src_int;
-	shared unsigned int *src_uint;
-	shared long *src_long;
-	shared unsigned long *src_ulong;
-	shared float *src_float;
-	shared double *src_double;
-	shared long double *src_ldouble;
-
-	shared char *dst_char;	
-	shared unsigned char *dst_uchar;
-	shared short int *dst_sint;
-	shared unsigned short *dst_usint;
-	shared int *dst_int;
-	shared unsigned int *dst_uint;
-	shared long *dst_long;
-	shared unsigned long *dst_ulong;
-	shared float *dst_float;
-	shared double *dst_double;
-	shared long double *dst_ldouble;
-
-	shared [] char *row_char;	
-	shared [] unsigned char *row_uchar;
-	shared [] short int *row_sint;
-	shared [] unsigned short *row_usint;
-	shared [] int *row_int;
-	shared [] unsigned int *row_uint;
-	shared [] long *row_long;
-	shared [] unsigned long *row_ulong;
-	shared [] float *row_float;
-	shared [] double *row_double;
-	shared [] long double *row_ldouble;
-
-
-	int size;
+	shared void *src, *dst;
+	size_t size;
+	int alg;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	//This member's block is already in place in recvbuf
+	if (sendbuf == MPI_IN_PLACE) {
+		sendbuf = (char *)recvbuf +
+			comm->rank * recvcount * sizeof_datatype(recvtype);
+		sendcount = recvcount;
+		sendtype = recvtype;
+	}
 	
 	if (sendtype != recvtype) {
 		return MPI_ERR_ARG;
@@ -361,132 +463,208 @@ int MPI_Allgather(void *sendbuf, int  sendcount,
 		return MPI_ERR_ARG;
 	}
 
-	size = sizeof_datatype(sendtype);
+	size = recvcount * sizeof_datatype(recvtype);
+	if (!size)
+		return MPI_SUCCESS;
+
+	alg = coll_select(comm, COLL_ALLGATHER, size);
+	if (alg == ALG_HIER)
+		return hier_allgather(comm, sendbuf, size, recvbuf);
+
+	if (alg == ALG_FLAT)
+		return group_allgather(comm->group, sendbuf, size, recvbuf);
+
+	//Every thread's block of dst receives all of the blocks of src
+	nbc_upc_enter();
+	src = upc_all_alloc(THREADS, size);
+	dst = upc_all_alloc(THREADS, THREADS * size);
+	upc_memput(thread_block(src, MYTHREAD), sendbuf, size);
+	upc_all_gather_all(dst, src, size, UPC_IN_ALLSYNC | UPC_OUT_ALLSYNC);
+	upc_memget(recvbuf, thread_block(dst, MYTHREAD), THREADS * size);
 	upc_barrier;
-	if (sendtype == MPI_CHAR) {
-		src_char = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared char *)src_char) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_char = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_char, src_char, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_char = (shared [] char *)&dst_char[MYTHREAD];
-		upc_memget(recvbuf, row_char, recvcount * size);
-		upc_free(src_char);
-		upc_free(dst_char);
-	} else if (sendtype == MPI_UNSIGNED_CHAR) {
-		src_uchar = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared unsigned char *)src_uchar) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_uchar = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_uchar, src_uchar, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_uchar = (shared [] unsigned char *)&dst_uchar[MYTHREAD];
-		upc_memget(recvbuf, row_uchar, recvcount * size);
-		upc_free(src_uchar);
-		upc_free(dst_uchar);
-	} else if (sendtype == MPI_SHORT_INT) {
-		src_sint = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared short int *)src_sint) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_sint = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_sint, src_sint, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_sint = (shared [] short int *)&dst_sint[MYTHREAD];
-		upc_memget(recvbuf, row_sint, recvcount * size);
-		upc_free(src_sint);
-		upc_free(dst_sint);
-	} else if (sendtype == MPI_UNSIGNED_SHORT) {
-		src_usint = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared unsigned short *)src_usint) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_usint = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_usint, src_usint, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_usint = (shared [] unsigned short *)&dst_usint[MYTHREAD];
-		upc_memget(recvbuf, row_usint, recvcount * size);
-		upc_free(src_usint);
-		upc_free(dst_usint);
-	} else if (sendtype == MPI_INT) {
-		src_int = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared int *)src_int) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_int = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_int, src_int, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_int = (shared [] int *)&dst_int[MYTHREAD];
-		upc_memget(recvbuf, row_int, recvcount * size);
-		upc_free(src_int);
-		upc_free(dst_int);
-	} else if (sendtype == MPI_UNSIGNED) {
-		src_uint = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared unsigned int *)src_uint) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_uint = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_uint, src_uint, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_uint = (shared [] unsigned int *)&dst_uint[MYTHREAD];
-		upc_memget(recvbuf, row_uint, recvcount * size);
-		upc_free(src_uint);
-		upc_free(dst_uint);
-	} else if (sendtype == MPI_LONG) {
-		src_long = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared long *)src_long) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_long = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_long, src_long, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_long = (shared [] long *)&dst_long[MYTHREAD];
-		upc_memget(recvbuf, row_long, recvcount * size);
-		upc_free(src_long);
-		upc_free(dst_long);
-	} else if (sendtype == MPI_UNSIGNED_LONG) {
-		src_ulong = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared unsigned long *)src_ulong) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_ulong = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_ulong, src_ulong, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_ulong = (shared [] unsigned long *)&dst_ulong[MYTHREAD];
-		upc_memget(recvbuf, row_ulong, recvcount * size);
-		upc_free(src_ulong);
-		upc_free(dst_ulong);
-	} else if (sendtype == MPI_FLOAT) {
-		src_float = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared float *)src_float) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_float = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_float, src_float, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_float = (shared [] float *)&dst_float[MYTHREAD];
-		upc_memget(recvbuf, row_float, recvcount * size);
-		upc_free(src_float);
-		upc_free(dst_float);
-	} else if (sendtype == MPI_DOUBLE) {
-		src_double = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared double *)src_double) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_double = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_double, src_double, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_double = (shared [] double *)&dst_double[MYTHREAD];
-		upc_memget(recvbuf, row_double, recvcount * size);
-		upc_free(src_double);
-		upc_free(dst_double);
-	} else if (sendtype == MPI_LONG_DOUBLE) {
-		src_ldouble = upc_all_alloc(sendcount, THREADS * sendcount * size);
-		upc_memput(((shared long double *)src_ldouble) + (sendcount), 
-			   sendbuf, sendcount * size);
-		dst_ldouble = upc_all_alloc(THREADS * THREADS, recvcount * size);
-		upc_barrier;
-		upc_all_gather_all(dst_ldouble, src_ldouble, recvcount * size, UPC_IN_NOSYNC | UPC_OUT_NOSYNC);
-		row_ldouble = (shared [] long double *)&dst_ldouble[MYTHREAD];
-		upc_memget(recvbuf, row_ldouble, recvcount * size);
-		upc_free(src_ldouble);
-		upc_free(dst_ldouble);
-	} else {
-		return MPI_ERR_ARG;
+	if (!MYTHREAD) {
+		upc_free(src);
+		upc_free(dst);
 	}
 
 	return MPI_SUCCESS;
 }
+
+/**
+ * Perform a reduce whose result is returned to every member
+ * Either two-level or a reduce to the first member followed by a
+ * broadcast
+ */
+int MPI_Allreduce(void *sendbuf, void *recvbuf, int count,
+		  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
+
+	if (coll_select(comm, COLL_ALLREDUCE,
+			count * sizeof_datatype(datatype)) == ALG_HIER)
+		return hier_allreduce(comm, sendbuf, recvbuf, count, datatype, op);
+
+	err = group_reduce(comm->group, sendbuf, recvbuf, count, datatype,
+			   op, 0);
+	if (!err)
+		err = group_bcast(comm->group, recvbuf,
+				  count * sizeof_datatype(datatype), 0);
+
+	return err;
+}
+
+/**
+ * Gather sendcount elements from every member into recvbuf on root
+ */
+int MPI_Gather(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+	       void *recvbuf, int recvcount, MPI_Datatype recvtype,
+	       int root, MPI_Comm comm) {
+	size_t size;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	size = sendcount * sizeof_datatype(sendtype);
+
+	//The root's block is already in place in recvbuf
+	if (sendbuf == MPI_IN_PLACE) {
+		size = recvcount * sizeof_datatype(recvtype);
+		sendbuf = (char *)recvbuf + root * size;
+	}
+
+	return group_gather(comm->group, sendbuf, size, recvbuf, root);
+}
+
+/**
+ * Scatter sendcount elements of the root's sendbuf to each member
+ */
+int MPI_Scatter(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		void *recvbuf, int recvcount, MPI_Datatype recvtype,
+		int root, MPI_Comm comm) {
+	size_t size;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	size = recvcount * sizeof_datatype(recvtype);
+	if (comm->rank == root)
+		size = sendcount * sizeof_datatype(sendtype);
+
+	//The root leaves its own block where it is in sendbuf
+	if (recvbuf == MPI_IN_PLACE)
+		recvbuf = (char *)sendbuf + root * size;
+
+	return group_scatter(comm->group, sendbuf, size, recvbuf, root);
+}
+
+/**
+ * Send sendcount elements to, and receive recvcount elements from,
+ * every member
+ */
+int MPI_Alltoall(void *sendbuf, int sendcount, MPI_Datatype sendtype,
+		 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+		 MPI_Comm comm) {
+	size_t size;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	size = recvcount * sizeof_datatype(recvtype);
+
+	//The data to send is in recvbuf and is replaced by what arrives
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+	else if (sendcount * sizeof_datatype(sendtype) != size)
+		return MPI_ERR_ARG;
+
+	return group_alltoall(comm->group, sendbuf, size, recvbuf);
+}
+
+/**
+ * Inclusive prefix reduction over the members in rank order
+ */
+int MPI_Scan(void *sendbuf, void *recvbuf, int count,
+	     MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
+
+	return group_scan(comm->group, sendbuf, recvbuf, count, datatype, op);
+}
+
+/**
+ * Reduce the send buffers element-wise and scatter the result so that
+ * rank i receives recvcounts[i] elements
+ */
+int MPI_Reduce_scatter(void *sendbuf, void *recvbuf, int *recvcounts,
+		       MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!recvcounts)
+		return MPI_ERR_ARG;
+
+	//The whole vector is in recvbuf and is replaced by this rank's segment
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	//Validate the datatype and op before any collective work
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
+
+	return group_reduce_scatter(comm->group, sendbuf, recvbuf, recvcounts,
+				    datatype, op);
+}
+
+/**
+ * Reduce the send buffers element-wise and scatter recvcount elements
+ * of the result to each member
+ */
+int MPI_Reduce_scatter_block(void *sendbuf, void *recvbuf, int recvcount,
+			     MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+	int *recvcounts;
+	int i, ret;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	recvcounts = malloc(sizeof(int) * comm->size);
+	if (!recvcounts)
+		return MPI_ERR_OTHER;
+
+	for (i = 0; i < comm->size; i++) {
+		recvcounts[i] = recvcount;
+	}
+
+	ret = MPI_Reduce_scatter(sendbuf, recvbuf, recvcounts, datatype,
+				 op, comm);
+	free(recvcounts);
+
+	return ret;
+}
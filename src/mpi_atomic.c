@@ -0,0 +1,570 @@
+/*
+  Accumulate operations and passive target synchronization
+
+  Every element of an accumulate is updated with one remote atomic where
+  the runtime has them: the UPC 1.3 atomics library when the compiler
+  provides it, otherwise Berkeley's 32 and 64 bit atomics, with compare
+  and swap loops for the ops they lack.  Other datatypes are updated
+  under striped locks on the target, so two accumulates touching the
+  same element always take the same lock.  Which of the two a datatype
+  uses never changes, as mixing them would break the atomicity MPI
+  promises between accumulates.
+
+  The same atomics advance the shared file pointers of MPI-IO.
+
+  Passive target locks are a word on the target counting the ranks that
+  hold it shared, or -1 while one holds it exclusively, updated under a
+  UPC lock that is only held for the update.
+*/
+
+#include <upc.h>
+#ifdef __UPC_ATOMIC__
+#include <upc_atomic.h>
+#endif
+#include <stdint.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "mpi_utils.h"
+#include "upc_group.h"
+#include "upc_rma.h"
+#include "upc_type.h"
+
+#ifdef __UPC_ATOMIC__
+//Datatypes the atomics library covers, each with a domain made at MPI_Init
+static struct {
+	MPI_Datatype datatype;
+	upc_type_t type;
+} atomic_types[] = {
+	{ MPI_INT, UPC_INT },
+	{ MPI_UNSIGNED, UPC_UINT },
+	{ MPI_LONG, UPC_LONG },
+	{ MPI_UNSIGNED_LONG, UPC_ULONG },
+	{ MPI_LONG_LONG, UPC_INT64 },
+	{ MPI_LONG_LONG_INT, UPC_INT64 },
+	{ MPI_UNSIGNED_LONG_LONG, UPC_UINT64 },
+	{ MPI_FLOAT, UPC_FLOAT },
+	{ MPI_DOUBLE, UPC_DOUBLE },
+};
+
+#define ATOMIC_TYPES (sizeof(atomic_types) / sizeof(atomic_types[0]))
+#define ATOMIC_OPS (UPC_ADD | UPC_MIN | UPC_MAX | UPC_GET | UPC_SET | UPC_CSWAP)
+
+static upc_atomicdomain_t *atomic_domains[ATOMIC_TYPES];
+
+/**
+ * Find the atomic domain for datatype, or NULL if there is none
+ */
+static upc_atomicdomain_t *atomic_domain(MPI_Datatype datatype) {
+	int i;
+
+	for (i = 0; i < ATOMIC_TYPES; i++) {
+		if (atomic_types[i].datatype == datatype)
+			return atomic_domains[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Create the atomic domains, collectively over all threads
+ */
+int rma_init() {
+	int i;
+
+	for (i = 0; i < ATOMIC_TYPES; i++) {
+		atomic_domains[i] = upc_all_atomicdomain_alloc(atomic_types[i].type,
+							       ATOMIC_OPS, 0);
+		if (!atomic_domains[i])
+			return MPI_ERR_OTHER;
+	}
+
+	return MPI_SUCCESS;
+}
+
+void rma_finalize() {
+	int i;
+
+	for (i = 0; i < ATOMIC_TYPES; i++) {
+		if (atomic_domains[i])
+			upc_all_atomicdomain_free(atomic_domains[i]);
+		atomic_domains[i] = NULL;
+	}
+}
+
+static int atomic_supported(MPI_Datatype datatype) {
+	return atomic_domain(datatype) != NULL;
+}
+
+/**
+ * Apply op to the element at addr, leaving its old value in fetch
+ * cswap replaces it with operand if it equals compare
+ */
+static void atomic_elem(shared [] char *addr, void *operand, void *compare,
+			void *fetch, MPI_Datatype datatype, MPI_Op op,
+			int cswap) {
+	upc_atomicdomain_t *domain = atomic_domain(datatype);
+
+	if (cswap)
+		upc_atomic_strict(domain, fetch, UPC_CSWAP, addr, compare, operand);
+	else if (op == MPI_NO_OP)
+		upc_atomic_strict(domain, fetch, UPC_GET, addr, NULL, NULL);
+	else if (op == MPI_REPLACE)
+		upc_atomic_strict(domain, fetch, UPC_SET, addr, operand, NULL);
+	else
+		upc_atomic_strict(domain, fetch, op, addr, operand, NULL);
+}
+
+#elif defined(__BERKELEY_UPC__)
+
+int rma_init() {
+	return MPI_SUCCESS;
+}
+
+void rma_finalize() {
+}
+
+/**
+ * Numbers of 4 or 8 bytes, whose bits the runtime's atomics can swap
+ */
+static int atomic_supported(MPI_Datatype datatype) {
+	const type_basic *b = type_basic_of(datatype);
+
+	if (!b || (b->size != 4 && b->size != 8))
+		return 0;
+
+	return b->class == TYPE_CLASS_INT || b->class == TYPE_CLASS_UINT ||
+	       b->class == TYPE_CLASS_FLOAT;
+}
+
+//One atomic element of bits bits; a sum of integers is a single
+//fetch-and-add, other ops retry a compare and swap until no one raced us
+#define ATOMIC_ELEM(bits, addr, operand, compare, fetch, datatype, op, cswap) do { \
+	uint##bits##_t old, val, cmp, prev;					\
+	if (operand)								\
+		memcpy(&val, (operand), sizeof(val));				\
+	if (cswap) {								\
+		memcpy(&cmp, (compare), sizeof(cmp));				\
+		old = bupc_atomicU##bits##_cswap_strict((addr), cmp, val);	\
+	} else if ((op) == MPI_NO_OP) {					\
+		old = bupc_atomicU##bits##_read_strict(addr);			\
+	} else if ((op) == MPI_REPLACE) {					\
+		old = bupc_atomicU##bits##_swap_strict((addr), val);		\
+	} else if ((op) == MPI_SUM &&						\
+		   type_basic_of(datatype)->class != TYPE_CLASS_FLOAT) {	\
+		old = bupc_atomicU##bits##_fetchadd_strict((addr), val);	\
+	} else {								\
+		old = bupc_atomicU##bits##_read_strict(addr);			\
+		for (;;) {							\
+			cmp = old;						\
+			reduce_local(&cmp, (operand), 1, (datatype), (op));	\
+			prev = bupc_atomicU##bits##_cswap_strict((addr), old, cmp); \
+			if (prev == old)					\
+				break;						\
+			old = prev;						\
+		}								\
+	}									\
+	if (fetch)								\
+		memcpy((fetch), &old, sizeof(old));				\
+} while (0)
+
+/**
+ * Apply op to the element at addr, leaving its old value in fetch
+ * cswap replaces it with operand if it equals compare
+ */
+static void atomic_elem(shared [] char *addr, void *operand, void *compare,
+			void *fetch, MPI_Datatype datatype, MPI_Op op,
+			int cswap) {
+	if (sizeof_datatype(datatype) == 4)
+		ATOMIC_ELEM(32, addr, operand, compare, fetch, datatype, op, cswap);
+	else
+		ATOMIC_ELEM(64, addr, operand, compare, fetch, datatype, op, cswap);
+}
+
+#else
+
+int rma_init() {
+	return MPI_SUCCESS;
+}
+
+void rma_finalize() {
+}
+
+static int atomic_supported(MPI_Datatype datatype) {
+	return 0;
+}
+
+static void atomic_elem(shared [] char *addr, void *operand, void *compare,
+			void *fetch, MPI_Datatype datatype, MPI_Op op,
+			int cswap) {
+}
+#endif
+
+/**
+ * Combine count elements of in into inout, including the RMA only ops
+ */
+static int rma_combine(void *inout, void *in, int count,
+		       MPI_Datatype datatype, MPI_Op op) {
+	if (op == MPI_NO_OP)
+		return MPI_SUCCESS;
+
+	if (op == MPI_REPLACE) {
+		memcpy(inout, in, count * sizeof_datatype(datatype));
+		return MPI_SUCCESS;
+	}
+
+	return reduce_local(inout, in, count, datatype, op);
+}
+
+/**
+ * Add val to the 64 bit integer at addr and return its old value, with
+ * one remote atomic where the runtime has them, otherwise under lock
+ */
+int64_t atomic_fetch_add(shared [] char *addr, int64_t val,
+			 upc_lock_t *lock) {
+	int64_t old;
+
+	if (atomic_supported(MPI_LONG_LONG)) {
+		atomic_elem(addr, &val, NULL, &old, MPI_LONG_LONG, MPI_SUM, 0);
+		return old;
+	}
+
+	upc_lock(lock);
+	upc_memget(&old, addr, sizeof(old));
+	val += old;
+	upc_memput(addr, &val, sizeof(val));
+	upc_unlock(lock);
+
+	return old;
+}
+
+/**
+ * Store val in the 64 bit integer at addr and return its old value, in
+ * one step like atomic_fetch_add
+ */
+int64_t atomic_swap(shared [] char *addr, int64_t val, upc_lock_t *lock) {
+	int64_t old;
+
+	if (atomic_supported(MPI_LONG_LONG)) {
+		atomic_elem(addr, &val, NULL, &old, MPI_LONG_LONG, MPI_REPLACE, 0);
+		return old;
+	}
+
+	upc_lock(lock);
+	upc_memget(&old, addr, sizeof(old));
+	upc_memput(addr, &val, sizeof(val));
+	upc_unlock(lock);
+
+	return old;
+}
+
+/**
+ * Update count elements at off in rank's window under its stripe locks
+ * Each element takes the lock of the stripe it starts in
+ */
+static int atomic_locked(MPI_Win win, int rank, size_t off,
+			 shared [] char *addr, void *operand, void *compare,
+			 void *result, int count, MPI_Datatype datatype,
+			 MPI_Op op, int cswap) {
+	win_entry *e = &win->members[rank];
+	size_t size, bytes, done, piece;
+	upc_lock_t *lock;
+	char *tmp;
+
+	size = sizeof_datatype(datatype);
+	bytes = count * size;
+	tmp = malloc(bytes < WIN_STRIPE + size ? bytes : WIN_STRIPE + size);
+	if (!tmp)
+		return MPI_ERR_OTHER;
+
+	for (done = 0; done < bytes; done += piece) {
+		lock = e->stripe[((off + done) / WIN_STRIPE) % WIN_LOCKS];
+		piece = WIN_STRIPE - (off + done) % WIN_STRIPE;
+		piece = (piece + size - 1) / size * size;
+		if (piece > bytes - done)
+			piece = bytes - done;
+
+		upc_lock(lock);
+		upc_memget(tmp, addr + done, piece);
+		if (result)
+			memcpy((char *)result + done, tmp, piece);
+
+		if (cswap) {
+			if (!memcmp(tmp, compare, size))
+				upc_memput(addr, operand, size);
+		} else if (op != MPI_NO_OP) {
+			rma_combine(tmp, (char *)operand + done, piece / size,
+				    datatype, op);
+			upc_memput(addr + done, tmp, piece);
+		}
+		upc_unlock(lock);
+	}
+
+	free(tmp);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Apply op to count elements of the target, fetching the old values
+ * into result if it is not NULL
+ */
+static int rma_atomic(MPI_Win win, int rank, MPI_Aint disp, void *operand,
+		      void *compare, void *result, int count,
+		      MPI_Datatype datatype, MPI_Op op, int cswap) {
+	shared [] char *addr;
+	size_t size;
+	int i, err;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	//Accumulates work element by element on the basic types
+	if (type_get(datatype))
+		return MPI_ERR_TYPE;
+
+	if (!cswap && op != MPI_REPLACE && op != MPI_NO_OP) {
+		err = reduce_local(NULL, NULL, 0, datatype, op);
+		if (err)
+			return err;
+	}
+
+	size = sizeof_datatype(datatype);
+	err = win_target(win, rank, disp, count * size, &addr);
+	if (err || !count)
+		return err;
+
+	if (!atomic_supported(datatype))
+		return atomic_locked(win, rank,
+				     (size_t) disp * win->members[rank].disp_unit,
+				     addr, operand, compare, result, count,
+				     datatype, op, cswap);
+
+	//MPI_NO_OP reads no operand, and the origin buffer may be NULL
+	if (!cswap && op == MPI_NO_OP)
+		operand = NULL;
+
+	for (i = 0; i < count; i++) {
+		atomic_elem(addr + i * size,
+			    operand ? (char *)operand + i * size : NULL,
+			    compare, result ? (char *)result + i * size : NULL,
+			    datatype, op, cswap);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Combine origin_addr into the target's window element by element
+ */
+int MPI_Accumulate(void *origin_addr, int origin_count,
+		   MPI_Datatype origin_datatype, int target_rank,
+		   MPI_Aint target_disp, int target_count,
+		   MPI_Datatype target_datatype, MPI_Op op, MPI_Win win) {
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	if (origin_datatype != target_datatype || origin_count != target_count)
+		return MPI_ERR_ARG;
+
+	return rma_atomic(win, target_rank, target_disp, origin_addr, NULL,
+			  NULL, target_count, target_datatype, op, 0);
+}
+
+/**
+ * Accumulate, returning the target's previous contents in result_addr
+ */
+int MPI_Get_accumulate(void *origin_addr, int origin_count,
+		       MPI_Datatype origin_datatype, void *result_addr,
+		       int result_count, MPI_Datatype result_datatype,
+		       int target_rank, MPI_Aint target_disp,
+		       int target_count, MPI_Datatype target_datatype,
+		       MPI_Op op, MPI_Win win) {
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	if (result_datatype != target_datatype || result_count != target_count)
+		return MPI_ERR_ARG;
+
+	if (op != MPI_NO_OP && (origin_datatype != target_datatype ||
+				origin_count != target_count))
+		return MPI_ERR_ARG;
+
+	return rma_atomic(win, target_rank, target_disp, origin_addr, NULL,
+			  result_addr, target_count, target_datatype, op, 0);
+}
+
+/**
+ * Single element Get_accumulate; a counter increment is one remote atomic
+ */
+int MPI_Fetch_and_op(void *origin_addr, void *result_addr,
+		     MPI_Datatype datatype, int target_rank,
+		     MPI_Aint target_disp, MPI_Op op, MPI_Win win) {
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	return rma_atomic(win, target_rank, target_disp, origin_addr, NULL,
+			  result_addr, 1, datatype, op, 0);
+}
+
+/**
+ * Replace the target element with origin_addr if it equals compare_addr
+ * The previous value is returned in result_addr either way
+ */
+int MPI_Compare_and_swap(void *origin_addr, void *compare_addr,
+			 void *result_addr, MPI_Datatype datatype,
+			 int target_rank, MPI_Aint target_disp, MPI_Win win) {
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	return rma_atomic(win, target_rank, target_disp, origin_addr,
+			  compare_addr, result_addr, 1, datatype, MPI_REPLACE, 1);
+}
+
+/**
+ * Start a passive target epoch on rank
+ * MPI_MODE_NOCHECK promises no conflicting lock, so none is taken
+ */
+int MPI_Win_lock(int lock_type, int rank, int assert, MPI_Win win) {
+	win_entry *e;
+	int held;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	if (rank < 0 || rank >= win->comm->size)
+		return MPI_ERR_RANK;
+
+	if (lock_type != MPI_LOCK_EXCLUSIVE && lock_type != MPI_LOCK_SHARED)
+		return MPI_ERR_ARG;
+
+	if (win->lock_type[rank])
+		return MPI_ERR_RMA_SYNC;
+
+	if (assert & MPI_MODE_NOCHECK) {
+		win->lock_type[rank] = lock_type | WIN_LOCK_NOCHECK;
+		return MPI_SUCCESS;
+	}
+	win->lock_type[rank] = lock_type;
+
+	e = &win->members[rank];
+	for (;;) {
+		upc_lock(e->lock);
+		held = WIN_LOCK_WORD(win, e);
+		if (lock_type == MPI_LOCK_SHARED && held >= 0) {
+			WIN_LOCK_WORD(win, e) = held + 1;
+			break;
+		} else if (lock_type == MPI_LOCK_EXCLUSIVE && held == 0) {
+			WIN_LOCK_WORD(win, e) = -1;
+			break;
+		}
+		upc_unlock(e->lock);
+		nbc_progress();
+	}
+	upc_unlock(e->lock);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Complete every transfer to rank and release its lock
+ */
+int MPI_Win_unlock(int rank, MPI_Win win) {
+	win_entry *e;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	if (rank < 0 || rank >= win->comm->size)
+		return MPI_ERR_RANK;
+
+	if (!win->lock_type[rank])
+		return MPI_ERR_RMA_SYNC;
+
+	win_flush_all(win);
+
+	//A lock taken with MPI_MODE_NOCHECK left the word alone, so the
+	//holds in it belong to other ranks
+	if (!(win->lock_type[rank] & WIN_LOCK_NOCHECK)) {
+		e = &win->members[rank];
+		upc_lock(e->lock);
+		if (WIN_LOCK_WORD(win, e) < 0)
+			WIN_LOCK_WORD(win, e) = 0;
+		else if (WIN_LOCK_WORD(win, e) > 0)
+			WIN_LOCK_WORD(win, e)--;
+		upc_unlock(e->lock);
+	}
+
+	win->lock_type[rank] = 0;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Take a shared lock on every rank, in rank order
+ */
+int MPI_Win_lock_all(int assert, MPI_Win win) {
+	int i, err;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	for (i = 0; i < win->comm->size; i++) {
+		err = MPI_Win_lock(MPI_LOCK_SHARED, i, assert, win);
+		if (err) {
+			while (--i >= 0) {
+				MPI_Win_unlock(i, win);
+			}
+			return err;
+		}
+	}
+
+	return MPI_SUCCESS;
+}
+
+int MPI_Win_unlock_all(MPI_Win win) {
+	int i, err, ret;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	ret = MPI_SUCCESS;
+	for (i = 0; i < win->comm->size; i++) {
+		err = MPI_Win_unlock(i, win);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/**
+ * Complete the transfers to rank without ending the epoch
+ * Transfers are not tracked per target, so every one is completed
+ */
+int MPI_Win_flush(int rank, MPI_Win win) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	if (rank < 0 || rank >= win->comm->size)
+		return MPI_ERR_RANK;
+
+	return win_flush_all(win);
+}
+
+int MPI_Win_flush_all(MPI_Win win) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	return win_flush_all(win);
+}
+
+int MPI_Win_flush_local(int rank, MPI_Win win) {
+	return MPI_Win_flush(rank, win);
+}
+
+int MPI_Win_flush_local_all(MPI_Win win) {
+	return MPI_Win_flush_all(win);
+}
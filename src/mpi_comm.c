@@ -0,0 +1,548 @@
+/*
+  Communicators
+
+  A communicator is an ordered set of threads with a context id.  The
+  context id is carried in every message sent on the communicator, so
+  traffic on different communicators never matches, and collectives run
+  on the communicator's own groups so only its members synchronize.
+
+  New communicators are created collectively over a parent: every
+  member of the parent allocates sync blocks for the new groups and
+  publishes them with its color and key in an allgather over the
+  parent, then builds the groups from the entries sharing its color.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_topo.h"
+
+MPI_Comm MPI_COMM_WORLD = MPI_COMM_NULL;
+MPI_Comm MPI_COMM_SELF = MPI_COMM_NULL;
+
+//Context ids of the predefined communicators; ids come in pairs
+#define CONTEXT_WORLD 0
+#define CONTEXT_SELF  2
+
+//Lowest context id this thread has not taken part in yet
+static int next_context = 4;
+
+//What each member of the parent publishes when a communicator is created
+typedef struct comm_entry comm_entry;
+struct comm_entry {
+	int color;
+	int key;
+	int rank;			//rank in the parent
+	int context;			//next_context of the member
+	group_sync_ptr sync[GROUP_KINDS];
+};
+
+/**
+ * Allocate a communicator of size ranks with no groups yet
+ */
+static MPI_Comm comm_new(int size) {
+	MPI_Comm comm;
+
+	comm = malloc(sizeof(struct MPI_Comm));
+	if (!comm)
+		return MPI_COMM_NULL;
+
+	memset(comm, 0, sizeof(struct MPI_Comm));
+	comm->size = size;
+	comm->threads = malloc(sizeof(int) * size);
+	if (!comm->threads) {
+		free(comm);
+		return MPI_COMM_NULL;
+	}
+
+	return comm;
+}
+
+/**
+ * Free a communicator and its groups once every member is done with them
+ */
+static void comm_free(MPI_Comm comm) {
+	group_free(comm->leaders);
+	group_free(comm->node);
+	group_free(comm->group);
+	topo_free(comm->topo);
+	free(comm->threads);
+	free(comm);
+}
+
+/**
+ * Create the groups of comm, whose size, rank and threads are set
+ * sync[kind][rank] is the sync block rank allocated for each group kind;
+ * this thread's leader block is freed if it does not lead its node
+ */
+int comm_groups(MPI_Comm comm, group_sync_ptr **sync) {
+	group_sync_ptr *s;
+	int *threads;
+	char *seen;
+	int r, n, node, leads;
+
+	threads = malloc(sizeof(int) * comm->size);
+	s = malloc(sizeof(group_sync_ptr) * comm->size);
+	seen = calloc(THREADS, 1);
+	if (!threads || !s || !seen) {
+		free(threads);
+		free(s);
+		free(seen);
+		return 1;
+	}
+
+	comm->world = comm->size == THREADS;
+	for (r = 0; r < comm->size; r++) {
+		if (comm->threads[r] != r)
+			comm->world = 0;
+	}
+
+	comm->group = group_new(comm->size, comm->threads, sync[GROUP_ALL]);
+
+	//The members on this thread's node, in rank order
+	n = 0;
+	for (r = 0; r < comm->size; r++) {
+		if (node_of[comm->threads[r]] == node_of[MYTHREAD]) {
+			threads[n] = comm->threads[r];
+			s[n] = sync[GROUP_NODE][r];
+			n++;
+		}
+	}
+
+	comm->node = group_new(n, threads, s);
+
+	//The lowest ranked member on each node leads it
+	n = 0;
+	leads = 0;
+	for (r = 0; r < comm->size; r++) {
+		node = node_of[comm->threads[r]];
+		if (seen[node])
+			continue;
+
+		seen[node] = 1;
+		threads[n] = comm->threads[r];
+		s[n] = sync[GROUP_LEADER][r];
+		if (r == comm->rank)
+			leads = 1;
+
+		n++;
+	}
+
+	comm->num_nodes = n;
+	comm->hier = n > 1 && n < comm->size;
+	comm->leaders = NULL;
+	if (leads)
+		comm->leaders = group_new(n, threads, s);
+	else
+		upc_free(sync[GROUP_LEADER][comm->rank]);
+
+	free(threads);
+	free(s);
+	free(seen);
+
+	return !comm->group || !comm->node || (leads && !comm->leaders);
+}
+
+/**
+ * Return the rank of thread in comm, or -1
+ */
+int comm_rank_of(MPI_Comm comm, int thread) {
+	if (comm->world)
+		return thread;
+
+	return group_rank_of(comm->group, thread);
+}
+
+/**
+ * Create MPI_COMM_WORLD and MPI_COMM_SELF
+ */
+int comm_init() {
+	shared [GROUP_KINDS] group_sync_ptr *dir;
+	group_sync_ptr *sync[GROUP_KINDS];
+	int t, k, err;
+
+	MPI_COMM_WORLD = comm_new(THREADS);
+	MPI_COMM_SELF = comm_new(1);
+	for (k = 0; k < GROUP_KINDS; k++) {
+		sync[k] = malloc(sizeof(group_sync_ptr) * THREADS);
+		if (!sync[k])
+			return 1;
+	}
+
+	if (!MPI_COMM_WORLD || !MPI_COMM_SELF)
+		return 1;
+
+	MPI_COMM_WORLD->rank = MYTHREAD;
+	MPI_COMM_WORLD->context = CONTEXT_WORLD;
+	for (t = 0; t < THREADS; t++) {
+		MPI_COMM_WORLD->threads[t] = t;
+	}
+
+	//Publish a sync block per group kind, then collect the members'
+	dir = upc_all_alloc(THREADS, sizeof(group_sync_ptr) * GROUP_KINDS);
+	for (k = 0; k < GROUP_KINDS; k++) {
+		dir[MYTHREAD * GROUP_KINDS + k] = group_sync_alloc();
+	}
+
+	upc_barrier;
+	for (k = 0; k < GROUP_KINDS; k++) {
+		for (t = 0; t < THREADS; t++) {
+			sync[k][t] = dir[t * GROUP_KINDS + k];
+		}
+	}
+
+	err = comm_groups(MPI_COMM_WORLD, sync);
+	upc_barrier;
+	if (!MYTHREAD)
+		upc_free(dir);
+
+	//MPI_COMM_SELF holds only this thread
+	MPI_COMM_SELF->rank = 0;
+	MPI_COMM_SELF->context = CONTEXT_SELF;
+	MPI_COMM_SELF->threads[0] = MYTHREAD;
+	for (k = 0; k < GROUP_KINDS; k++) {
+		sync[k][0] = group_sync_alloc();
+	}
+
+	err |= comm_groups(MPI_COMM_SELF, sync);
+	for (k = 0; k < GROUP_KINDS; k++) {
+		free(sync[k]);
+	}
+
+	return err;
+}
+
+/**
+ * Free MPI_COMM_WORLD and MPI_COMM_SELF
+ */
+void comm_finalize() {
+	if (MPI_COMM_SELF)
+		comm_free(MPI_COMM_SELF);
+
+	if (MPI_COMM_WORLD)
+		comm_free(MPI_COMM_WORLD);
+
+	MPI_COMM_SELF = MPI_COMM_NULL;
+	MPI_COMM_WORLD = MPI_COMM_NULL;
+}
+
+/**
+ * Order entries by key, then by rank in the parent
+ */
+static int comm_entry_cmp(const void *a, const void *b) {
+	const comm_entry *x = a;
+	const comm_entry *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+
+	return x->rank - y->rank;
+}
+
+/**
+ * Collectively split parent by color, ranking each part by key
+ * Threads passing MPI_UNDEFINED get MPI_COMM_NULL
+ */
+int comm_build(MPI_Comm parent, int color, int key, MPI_Comm *newcomm) {
+	group_sync_ptr *sync[GROUP_KINDS];
+	comm_entry mine, *all, *members;
+	MPI_Comm comm;
+	int r, k, n, context, err;
+
+	mine.color = color;
+	mine.key = key;
+	mine.rank = parent->rank;
+	mine.context = next_context;
+	for (k = 0; k < GROUP_KINDS; k++) {
+		mine.sync[k] = NULL;
+		if (color != MPI_UNDEFINED)
+			mine.sync[k] = group_sync_alloc();
+	}
+
+	all = malloc(sizeof(comm_entry) * parent->size);
+	if (!all)
+		return MPI_ERR_OTHER;
+
+	err = group_allgather(parent->group, &mine, sizeof(comm_entry), all);
+
+	//Every member of the parent agrees on an id none of them has used
+	context = 0;
+	for (r = 0; r < parent->size; r++) {
+		if (all[r].context > context)
+			context = all[r].context;
+	}
+
+	next_context = context + 2;
+	*newcomm = MPI_COMM_NULL;
+	if (color == MPI_UNDEFINED || err) {
+		free(all);
+		return err;
+	}
+
+	//Collect the entries of this color in their new rank order
+	members = all;
+	n = 0;
+	for (r = 0; r < parent->size; r++) {
+		if (all[r].color == color)
+			members[n++] = all[r];
+	}
+
+	qsort(members, n, sizeof(comm_entry), comm_entry_cmp);
+	comm = comm_new(n);
+	for (k = 0; k < GROUP_KINDS; k++) {
+		sync[k] = malloc(sizeof(group_sync_ptr) * n);
+		if (!sync[k])
+			err = MPI_ERR_OTHER;
+	}
+
+	if (!comm || err) {
+		for (k = 0; k < GROUP_KINDS; k++) {
+			free(sync[k]);
+		}
+
+		free(all);
+		free(comm);
+		return MPI_ERR_OTHER;
+	}
+
+	comm->context = context;
+	for (r = 0; r < n; r++) {
+		comm->threads[r] = parent->threads[members[r].rank];
+		if (members[r].rank == parent->rank)
+			comm->rank = r;
+
+		for (k = 0; k < GROUP_KINDS; k++) {
+			sync[k][r] = members[r].sync[k];
+		}
+	}
+
+	if (comm_groups(comm, sync))
+		err = MPI_ERR_OTHER;
+
+	for (k = 0; k < GROUP_KINDS; k++) {
+		free(sync[k]);
+	}
+
+	free(all);
+	*newcomm = comm;
+
+	return err;
+}
+
+/**
+ * Split comm into one communicator per color, ordered by key
+ */
+int MPI_Comm_split(MPI_Comm comm, int color, int key, MPI_Comm *newcomm) {
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!newcomm || (color < 0 && color != MPI_UNDEFINED))
+		return MPI_ERR_ARG;
+
+	return comm_build(comm, color, key, newcomm);
+}
+
+/**
+ * Split comm into the members sharing memory with each other
+ * A node whose threads cannot all reach each other's memory splits
+ * further, named after the lowest thread each member can reach
+ */
+int MPI_Comm_split_type(MPI_Comm comm, int split_type, int key,
+			MPI_Info info, MPI_Comm *newcomm) {
+	int r, t, color;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!newcomm)
+		return MPI_ERR_ARG;
+
+	if (split_type == MPI_UNDEFINED)
+		return comm_build(comm, MPI_UNDEFINED, key, newcomm);
+
+	if (split_type != MPI_COMM_TYPE_SHARED)
+		return MPI_ERR_ARG;
+
+	color = MYTHREAD;
+	for (r = 0; r < comm->size; r++) {
+		t = comm->threads[r];
+		if (t < color && node_of[t] == node_of[MYTHREAD] &&
+		    thread_castable(t))
+			color = t;
+	}
+
+	return comm_build(comm, color, key, newcomm);
+}
+
+/**
+ * Create a communicator with the same members as comm and a new context
+ */
+int MPI_Comm_dup(MPI_Comm comm, MPI_Comm *newcomm) {
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!newcomm)
+		return MPI_ERR_ARG;
+
+	return comm_build(comm, 0, comm->rank, newcomm);
+}
+
+/**
+ * Create a communicator of the members of group, a subset of comm
+ */
+int MPI_Comm_create(MPI_Comm comm, MPI_Group group, MPI_Comm *newcomm) {
+	int i;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	if (!newcomm)
+		return MPI_ERR_ARG;
+
+	for (i = 0; i < group->size; i++) {
+		if (comm_rank_of(comm, group->threads[i]) < 0)
+			return MPI_ERR_GROUP;
+	}
+
+	if (group->rank == MPI_UNDEFINED)
+		return comm_build(comm, MPI_UNDEFINED, 0, newcomm);
+
+	return comm_build(comm, 0, group->rank, newcomm);
+}
+
+/**
+ * Free a communicator created by this library
+ */
+int MPI_Comm_free(MPI_Comm *comm) {
+	if (!comm || *comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (*comm == MPI_COMM_WORLD || *comm == MPI_COMM_SELF)
+		return MPI_ERR_COMM;
+
+	comm_free(*comm);
+	*comm = MPI_COMM_NULL;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Create a group of the given threads
+ */
+static MPI_Group group_handle_new(int size, int *threads) {
+	MPI_Group group;
+	int i;
+
+	group = malloc(sizeof(struct MPI_Group));
+	if (!group)
+		return MPI_GROUP_NULL;
+
+	group->size = size;
+	group->rank = MPI_UNDEFINED;
+	group->threads = malloc(sizeof(int) * size + 1);
+	if (!group->threads) {
+		free(group);
+		return MPI_GROUP_NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		group->threads[i] = threads[i];
+		if (threads[i] == MYTHREAD)
+			group->rank = i;
+	}
+
+	return group;
+}
+
+/**
+ * Return the group of comm's members
+ */
+int MPI_Comm_group(MPI_Comm comm, MPI_Group *group) {
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!group)
+		return MPI_ERR_ARG;
+
+	*group = group_handle_new(comm->size, comm->threads);
+	if (!*group)
+		return MPI_ERR_OTHER;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Create a group of the n members of group listed in ranks
+ */
+int MPI_Group_incl(MPI_Group group, int n, int *ranks, MPI_Group *newgroup) {
+	int *threads;
+	int i;
+
+	if (group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	if (!newgroup || n < 0 || (n && !ranks))
+		return MPI_ERR_ARG;
+
+	threads = malloc(sizeof(int) * n + 1);
+	if (!threads)
+		return MPI_ERR_OTHER;
+
+	for (i = 0; i < n; i++) {
+		if (ranks[i] < 0 || ranks[i] >= group->size) {
+			free(threads);
+			return MPI_ERR_RANK;
+		}
+
+		threads[i] = group->threads[ranks[i]];
+	}
+
+	*newgroup = group_handle_new(n, threads);
+	free(threads);
+	if (!*newgroup)
+		return MPI_ERR_OTHER;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Get the number of members in a group
+ */
+int MPI_Group_size(MPI_Group group, int *size) {
+	if (group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	*size = group->size;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Get the caller's rank in a group, MPI_UNDEFINED if not a member
+ */
+int MPI_Group_rank(MPI_Group group, int *rank) {
+	if (group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	*rank = group->rank;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Free a group
+ */
+int MPI_Group_free(MPI_Group *group) {
+	if (!group || *group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	free((*group)->threads);
+	free(*group);
+	*group = MPI_GROUP_NULL;
+
+	return MPI_SUCCESS;
+}
@@ -11,7 +11,15 @@ int MPI_Info_create(MPI_Info *info) {
 	  return MPI_ERR_ARG;
 
 	*info = malloc(sizeof(struct MPI_Info));
+	if (!*info)
+		return MPI_ERR_OTHER;
+
 	(*info)->entries = (info_entry **) malloc(sizeof(info_entry *) * BUCKETS);
+	if (!(*info)->entries) {
+		free(*info);
+		*info = MPI_INFO_NULL;
+		return MPI_ERR_OTHER;
+	}
 	(*info)->num_entries = 0;
 
 	for (i = 0; i < BUCKETS; i++) {
@@ -44,16 +52,64 @@ int MPI_Info_free(MPI_Info *info) {
 		(*info)->entries[i] = NULL;
 	}
 
+	free((*info)->entries);
 	free(*info);
+	*info = MPI_INFO_NULL;
+
 	return MPI_SUCCESS;
 }
 
+/**
+ * Makes newinfo a copy of every key/value pair in info
+ */
+int MPI_Info_dup(MPI_Info info, MPI_Info *newinfo) {
+	int i, ret;
+	info_entry *p;
+
+	if (!info || !newinfo)
+		return MPI_ERR_ARG;
+
+	ret = MPI_Info_create(newinfo);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < BUCKETS; i++) {
+		for (p = info->entries[i]; p; p = p->next) {
+			ret = MPI_Info_set(*newinfo, p->key, p->value);
+			if (ret) {
+				MPI_Info_free(newinfo);
+				return ret;
+			}
+		}
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Returns the entry of key in info, or NULL
+ */
+static info_entry *info_find(MPI_Info info, char *key) {
+	int bucket;
+	info_entry *p;
+
+	bucket = hash_key(key);
+	if (bucket < 0)
+		return NULL;
+
+	for (p = info->entries[bucket]; p; p = p->next) {
+		if (!strcmp(p->key, key))
+			return p;
+	}
+
+	return NULL;
+}
 
 /**
  * Sets nkeys to be the number of keys in the given info
  */
 int MPI_Info_get_nkeys(MPI_Info info, int *nkeys) {
-	if (!info)
+	if (!info || !nkeys)
 		return MPI_ERR_ARG;
 
 	*nkeys = info->num_entries;
@@ -63,109 +119,155 @@ int MPI_Info_get_nkeys(MPI_Info info, int *nkeys) {
 
 /**
  * Sets the key parameter to be the nth key in the given info
+ * key must hold MPI_MAX_INFO_KEY + 1 characters
  */
 int MPI_Info_get_nthkey(MPI_Info info, int n, char *key) {
 	int cur_key;
 	int i;
 	info_entry *p;
-	char *ret_key;
-
-	cur_key = -1;
-	ret_key = NULL;
 
-	if (info->num_entries == 0)
+	if (!info || !key || n < 0 || n >= info->num_entries)
 		return MPI_ERR_ARG;
 
+	cur_key = -1;
 	for (i = 0; i < BUCKETS; i++) {
-		p = info->entries[i];
-		while (p) {
+		for (p = info->entries[i]; p; p = p->next) {
 			cur_key++;
 			if (cur_key == n) {
-				ret_key = p->key;
-				break;
+				strcpy(key, p->key);
+				return MPI_SUCCESS;
 			}
-			
-			p = p->next;
 		}
-
-		info->entries[i] = NULL;
 	}
 
-	if (ret_key == NULL)
-		return MPI_ERR_OTHER;
-	
-	return MPI_SUCCESS;
+	return MPI_ERR_OTHER;
 }
 
 /**
- * Adds a key/value pair in the given info
+ * Adds a key/value pair in the given info, replacing the value of a key
+ * already there
  */
 int MPI_Info_set(MPI_Info info, char *key, char *value) {
 	int bucket;
 	info_entry *p, *n;
+	char *copy;
 
-	if (key == NULL || value == NULL)
+	if (!info || key == NULL || value == NULL)
+		return MPI_ERR_ARG;
+
+	if (strlen(key) > MPI_MAX_INFO_KEY || strlen(value) > MPI_MAX_INFO_VAL)
 		return MPI_ERR_ARG;
 
 	bucket = hash_key(key);
 	if (bucket < 0 || bucket >= BUCKETS)
-		return MPI_ERR_UNKNOWN;
-	
+		return MPI_ERR_ARG;
+
+	p = info_find(info, key);
+	if (p) {
+		copy = malloc(strlen(value) + 1);
+		if (!copy)
+			return MPI_ERR_OTHER;
+		memcpy(copy, value, strlen(value) + 1);
+		free(p->value);
+		p->value = copy;
+		return MPI_SUCCESS;
+	}
+
 	n = malloc(sizeof(info_entry));
+	if (!n)
+		return MPI_ERR_OTHER;
 	memset(n, 0, sizeof(info_entry));
 	n->key = malloc(strlen(key) + 1);
 	n->value = malloc(strlen(value) + 1);
-	memcpy(n->key, key, strlen(key) + 1);
-	memcpy(n->value, key, strlen(key) + 1);
-	
-	if (info->entries[bucket]) {
-		info->entries[bucket] = n;
-		return MPI_SUCCESS;
+	if (!n->key || !n->value) {
+		free(n->key);
+		free(n->value);
+		free(n);
+		return MPI_ERR_OTHER;
 	}
+	memcpy(n->key, key, strlen(key) + 1);
+	memcpy(n->value, value, strlen(value) + 1);
 
-	p = info->entries[bucket];
-	while (p) {
-		if (p->next) {
-			p = p->next;
-			continue;
-		}
+	//New entries go at the head of their bucket
+	n->next = info->entries[bucket];
+	if (n->next)
+		n->next->prev = n;
+	info->entries[bucket] = n;
+	info->num_entries++;
 
-		p->next = n;
-		n->prev = p;
-		break;
-	}
+	return MPI_SUCCESS;
+}
+
+/**
+ * Removes key from the given info
+ */
+int MPI_Info_delete(MPI_Info info, char *key) {
+	info_entry *p;
+
+	if (!info || !key)
+		return MPI_ERR_ARG;
+
+	p = info_find(info, key);
+	if (!p)
+		return MPI_ERR_ARG;
+
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		info->entries[hash_key(key)] = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+
+	free(p->key);
+	free(p->value);
+	free(p);
+	info->num_entries--;
 
 	return MPI_SUCCESS;
 }
 
 /**
  * Sets the value parameter to be the value for the given key
+ * At most valuelen characters are copied, then a terminating null, so
+ * value must hold valuelen + 1
  */
-int MPI_Info_get(MPI_Info info, char *key, int valuelen, 
+int MPI_Info_get(MPI_Info info, char *key, int valuelen,
 		 char *value, int *flag) {
-	int cur_key;
-	int i;
 	info_entry *p;
+	size_t len;
 
-	*flag = 0;
-	if (info->num_entries == 0)
+	if (!info || !key || !value || !flag || valuelen < 0)
 		return MPI_ERR_ARG;
 
-	for (i = 0; i < BUCKETS; i++) {
-		p = info->entries[i];
-		while (p) {
-			if (strncmp(p->key, key, MPI_MAX_INFO_KEY)) {
-				*flag = 1;
-				memcpy(value, p->value, (strlen(p->value) + 1 < valuelen) ? 
-				       strlen(p->value) + 1 : valuelen);
-				break;
-			}
-			
-			p = p->next;
-		}
+	*flag = 0;
+	p = info_find(info, key);
+	if (!p)
+		return MPI_SUCCESS;
 
-		info->entries[i] = NULL;
-	}
+	*flag = 1;
+	len = strlen(p->value);
+	if (len > valuelen)
+		len = valuelen;
+	memcpy(value, p->value, len);
+	value[len] = '\0';
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Sets valuelen to the length of the value for the given key
+ */
+int MPI_Info_get_valuelen(MPI_Info info, char *key, int *valuelen,
+			  int *flag) {
+	info_entry *p;
+
+	if (!info || !key || !valuelen || !flag)
+		return MPI_ERR_ARG;
+
+	p = info_find(info, key);
+	*flag = p != NULL;
+	if (p)
+		*valuelen = strlen(p->value);
 
 	return MPI_SUCCESS;
 }
@@ -183,7 +285,7 @@ int hash_key(char *key) {
 		return -1;
 
 	for (i = 0; i < len; i++) {
-		sum += (int) key[i];
+		sum += (unsigned char) key[i];
 	}
 
 	sum %= BUCKETS;
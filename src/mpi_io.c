@@ -1,188 +1,1152 @@
+#include <stdio.h>
+#include <string.h>
 #include "mpi.h"
-#include "plfs.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_rma.h"
+#include "upc_type.h"
+#include "upc_aio.h"
+#include "upc_file.h"
+
+/**
+ * Set the hints to the environment and the defaults
+ */
+static void file_hint_defaults(MPI_File fh) {
+	char *env;
+
+	env = getenv(FILE_CB_NODES_ENV);
+	fh->cb_nodes = env ? atoi(env) : 0;
+	fh->cb_buffer_size = FILE_CB_BUFFER_SIZE;
+	fh->cb_read = 1;
+	fh->cb_write = 1;
+	fh->striping_unit = FILE_STRIPING_UNIT;
+	fh->striping_factor = 0;
+	fh->ds_read = 1;
+	fh->ds_write = 1;
+	fh->ind_rd_buffer_size = FILE_IND_RD_BUFFER_SIZE;
+	fh->ind_wr_buffer_size = FILE_IND_WR_BUFFER_SIZE;
+	fh->direct_io = 0;
+	fh->write_behind = 0;
+	fh->compression = 0;
+	fh->compression_chunk = FILE_ZIP_CHUNK;
+	fh->compression_typesize = FILE_ZIP_TYPESIZE;
+	//A mapped file is already read from memory
+	fh->read_ahead = !fh->driver->map;
+}
+
+/**
+ * Read an enable, disable or automatic hint into on, leaving it alone
+ * if the hint is not given
+ */
+static void file_hint_switch(MPI_Info info, char *key, int *on) {
+	char value[MPI_MAX_INFO_VAL + 1];
+	int flag;
+
+	MPI_Info_get(info, key, MPI_MAX_INFO_VAL, value, &flag);
+	if (!flag)
+		return;
+
+	if (!strcmp(value, "disable") || !strcmp(value, "false"))
+		*on = 0;
+	else if (!strcmp(value, "enable") || !strcmp(value, "automatic") ||
+		 !strcmp(value, "true"))
+		*on = 1;
+}
+
+/**
+ * Apply the hints given in info over the current ones
+ * direct_io and compression only take effect when the file is opened
+ */
+static void file_hints(MPI_File fh, MPI_Info info) {
+	char value[MPI_MAX_INFO_VAL + 1];
+	int flag, on;
+
+	if (info == MPI_INFO_NULL)
+		return;
+
+	MPI_Info_get(info, "cb_nodes", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atoi(value) > 0)
+		fh->cb_nodes = atoi(value);
+
+	MPI_Info_get(info, "cb_buffer_size", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atol(value) > 0)
+		fh->cb_buffer_size = atol(value);
+
+	file_hint_switch(info, "romio_cb_read", &fh->cb_read);
+	file_hint_switch(info, "romio_cb_write", &fh->cb_write);
+
+	MPI_Info_get(info, "striping_unit", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atoll(value) > 0)
+		fh->striping_unit = atoll(value);
+
+	MPI_Info_get(info, "striping_factor", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atoi(value) > 0)
+		fh->striping_factor = atoi(value);
+
+	file_hint_switch(info, "romio_ds_read", &fh->ds_read);
+	file_hint_switch(info, "romio_ds_write", &fh->ds_write);
+
+	MPI_Info_get(info, "ind_rd_buffer_size", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atol(value) > 0)
+		fh->ind_rd_buffer_size = atol(value);
+
+	MPI_Info_get(info, "ind_wr_buffer_size", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag && atol(value) > 0)
+		fh->ind_wr_buffer_size = atol(value);
+
+	if (!fh->handle) {
+		file_hint_switch(info, "direct_io", &fh->direct_io);
+		file_hint_switch(info, "compression", &fh->compression);
+
+		MPI_Info_get(info, "compression_chunk_size", MPI_MAX_INFO_VAL,
+			     value, &flag);
+		if (flag && atoll(value) > 0)
+			fh->compression_chunk = atoll(value);
+
+		MPI_Info_get(info, "compression_typesize", MPI_MAX_INFO_VAL,
+			     value, &flag);
+		if (flag && atoi(value) > 0)
+			fh->compression_typesize = atoi(value);
+	}
+
+	on = fh->write_behind > 0;
+	file_hint_switch(info, "write_behind", &on);
+	if (!on)
+		fh->write_behind = 0;
+	else if (!fh->write_behind)
+		fh->write_behind = FILE_WRITE_BEHIND_SIZE;
+
+	MPI_Info_get(info, "write_behind_buffer_size", MPI_MAX_INFO_VAL, value,
+		     &flag);
+	if (flag && atol(value) > 0)
+		fh->write_behind = atol(value);
+
+	//Random access gains nothing from reading ahead
+	MPI_Info_get(info, "access_style", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag) {
+		free(fh->access_style);
+		fh->access_style = strdup(value);
+		if (strstr(value, "random"))
+			fh->read_ahead = 0;
+		else if (strstr(value, "sequential"))
+			fh->read_ahead = !fh->driver->map;
+	}
+
+	file_hint_switch(info, "read_ahead", &fh->read_ahead);
+}
+
+/**
+ * Apply new hints to an open file, first settling what the old ones
+ * left behind in the write-behind cache and the read-ahead buffers
+ */
+static int file_rehint(MPI_File fh, MPI_Info info) {
+	int ret;
+
+	ret = file_cache_flush(fh, 0, -1);
+	file_cache_free(fh);
+	file_prefetch_drop(fh, 0, -1);
+	file_hints(fh, info);
+
+	return ret;
+}
+
+/**
+ * The bytes of the sieving buffer of an access, or 0 with data sieving
+ * turned off, which moves the pieces one by one
+ */
+static size_t file_ds_size(MPI_File fh, int write) {
+	if (write)
+		return fh->ds_write ? fh->ind_wr_buffer_size : 0;
+
+	return fh->ds_read ? fh->ind_rd_buffer_size : 0;
+}
+
+static const file_driver *file_drivers[] = {
+	&file_pupc, &file_posix, &file_mmap
+};
+
+#define FILE_DRIVERS (sizeof(file_drivers) / sizeof(file_drivers[0]))
+
+/**
+ * Choose the backend of a file by the prefix of its name, then by the
+ * io_driver hint, then by the environment, and skip the prefix
+ * The mmap_read hint maps a file opened read-only
+ */
+static const file_driver *file_driver_of(char **filename, int amode,
+					 MPI_Info info) {
+	char value[MPI_MAX_INFO_VAL + 1];
+	char *name = NULL;
+	int i, flag = 0;
+
+	if ((amode & MPI_MODE_RDONLY) && info != MPI_INFO_NULL) {
+		MPI_Info_get(info, "mmap_read", MPI_MAX_INFO_VAL, value, &flag);
+		if (flag && !strcmp(value, "true")) {
+			file_driver_of(filename, 0, MPI_INFO_NULL);
+			return &file_mmap;
+		}
+		flag = 0;
+	}
+
+	for (i = 0; i < FILE_DRIVERS; i++) {
+		if (!strncmp(*filename, file_drivers[i]->prefix,
+			     strlen(file_drivers[i]->prefix))) {
+			*filename += strlen(file_drivers[i]->prefix);
+			return file_drivers[i];
+		}
+	}
+
+	if (info != MPI_INFO_NULL)
+		MPI_Info_get(info, "io_driver", MPI_MAX_INFO_VAL, value, &flag);
+	if (flag)
+		name = value;
+	else
+		name = getenv(FILE_DRIVER_ENV);
+
+	for (i = 0; name && i < FILE_DRIVERS; i++) {
+		if (!strcmp(name, file_drivers[i]->name))
+			return file_drivers[i];
+	}
+
+	return &file_pupc;
+}
+
+/**
+ * The bytes of data in a file, or -1 on failure
+ */
+static MPI_Offset file_size(MPI_File fh) {
+	if (fh->zip)
+		return fh->zip->size;
+
+	return fh->driver->size(fh);
+}
 
 /**
  * Opens a file
+ * A "posix:", "mmap:" or "pupc:" prefix on the name, or the io_driver
+ * hint, chooses the backend
+ * With the compression hint the file is a compressed container
  */
 int MPI_File_open(MPI_Comm comm, char *filename,
 		  int amode, MPI_Info info, MPI_File *fh) {
-	upcio_file_t *fd;
+	MPI_File f;
+	int ret;
 
-	if (!fh) {
+	if (!fh || !filename) {
 		return MPI_ERR_ARG;
 	}
 
-	fd = upc_all_fopen(filename, amode, 0644);
-	upc_barrier;
-	
-	if (!fd) {
-		return MPI_ERR_UNKNOWN;
+	if (!comm)
+		return MPI_ERR_COMM;
+
+	f = calloc(1, sizeof(struct MPI_File));
+	if (!f)
+		return MPI_ERR_OTHER;
+
+	f->driver = file_driver_of(&filename, amode, info);
+	f->amode = amode;
+	f->etype = MPI_BYTE;
+	f->filetype = MPI_BYTE;
+	MPI_Comm_dup(comm, &f->comm);
+	file_hint_defaults(f);
+	file_hints(f, info);
+
+	ret = f->driver->open(f, filename, amode);
+	if (!ret && f->compression) {
+		ret = file_zip_open(f);
+		if (ret)
+			f->driver->close(f);
+	}
+	if (ret) {
+		MPI_Comm_free(&f->comm);
+		free(f->access_style);
+		free(f);
+		return ret;
 	}
 
-	*fh = malloc(sizeof(struct MPI_File));
-	(*fh)->fd = fd;
-	(*fh)->info = info;
+	if (amode & MPI_MODE_APPEND)
+		f->position = file_size(f);
+
+	//Rank 0 allocates the lock and holds the shared file pointer, so any
+	//communicator can open a file
+	if (f->comm->rank == 0) {
+		f->sieve_lock = upc_global_lock_alloc();
+		f->shared_fp = upc_alloc(sizeof(int64_t));
+		*(shared [] int64_t *)f->shared_fp = f->position;
+	}
+	group_bcast(f->comm->group, &f->sieve_lock, sizeof(upc_lock_t *), 0);
+	group_bcast(f->comm->group, &f->shared_fp, sizeof(f->shared_fp), 0);
+
+	*fh = f;
 
 	return MPI_SUCCESS;
 }
 
 /**
- *  Writes to the given file
- *  Not non-blocking as there isn't a good async implementation yet 
+ * Write size bytes of buf at off through the file's driver, or read up
+ * to size bytes into buf, bypassing the file pointers
+ * Returns the bytes moved, or -1 on failure
  */
+ssize_t file_pio(MPI_File fh, void *buf, size_t size, MPI_Offset off,
+		 int write) {
+	//The chunks of a compressed file are only written by its aggregators
+	if (fh->zip)
+		return write ? -1 : file_zip_read(fh, buf, size, off);
 
-int MPI_File_iwrite(MPI_File fh, void *buf, int count,
-		    MPI_Datatype datatype, MPI_Request *request) {
-	ssize_t size, data_size;
-	int ret, error_code;
-	struct __struct_thread_upc_file_t *fhp;
-	Plfs_fd *fd;
-	
-	data_size = sizeof_datatype(datatype);
-	size = count * data_size;
-
-	fhp = (struct __struct_thread_upc_file_t *)fh->fd->th[MYTHREAD];
-	fd = (Plfs_fd *)fhp->adio_fd;
-
-	if( fhp->flags & UPC_RDONLY )
+	return fh->driver->pio(fh->handle, buf, size, off, write);
+}
+
+//Worker side of MPI_File_iwrite
+static ssize_t file_job_write(aio_job *job) {
+	return file_pio(job->file, job->buf, job->size, job->offset, 1);
+}
+
+//Worker side of MPI_File_iread, sieving a strided view
+static ssize_t file_job_read(aio_job *job) {
+	if (job->segs)
+		return file_sieve(job->file, job->segs, job->nsegs, job->buf,
+				  job->sieve, 0);
+
+	return file_pio(job->file, job->buf, job->size, job->offset, 0);
+}
+
+/**
+ * Queue a transfer at the individual file pointer, which moves past it
+ * at once so the next operation follows it
+ * A write through a strided view is sieved at once under the sieve
+ * lock, which cannot be held while the job waits in the queue
+ */
+static int file_queue(MPI_File fh, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Request *request, int write) {
+	aio_job *job;
+
+	if (!fh || !request)
+		return MPI_ERR_ARG;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	if (type_get(datatype) && !type_get(datatype)->committed)
+		return MPI_ERR_TYPE;
+
+	if (fh->amode & (write ? MPI_MODE_RDONLY : MPI_MODE_WRONLY))
+		return MPI_ERR_OTHER;
+
+	//A compressed file is only written collectively
+	if (write && fh->zip)
 		return MPI_ERR_OTHER;
 
-	if( fhp->async_flag == 1 )
+	job = aio_job_new(fh, buf, count, datatype, write);
+	if (!job)
 		return MPI_ERR_OTHER;
 
-	ret = UPC_ADIO_WriteContig( fd, buf, size, fhp->private_pointer, 
-				    &error_code );
+	if (file_view_map(fh, fh->position, job->size, &job->segs,
+			  &job->nsegs)) {
+		aio_finish(job);
+		return MPI_ERR_OTHER;
+	}
 
-	if (error_code == UPC_ADIO_FAILURE) {
-		ret = MPI_ERR_OTHER;
-	} else {
-		ret = MPI_SUCCESS;
+	if (job->nsegs && file_cache_flush(fh, job->segs[0].off,
+					   job->segs[job->nsegs - 1].off +
+					   job->segs[job->nsegs - 1].len -
+					   job->segs[0].off)) {
+		aio_finish(job);
+		return MPI_ERR_OTHER;
 	}
 
-	return ret;
+	if (write && job->nsegs)
+		file_prefetch_drop(fh, job->segs[0].off,
+				   job->segs[job->nsegs - 1].off +
+				   job->segs[job->nsegs - 1].len -
+				   job->segs[0].off);
+
+	job->run = write ? file_job_write : file_job_read;
+	job->file = fh;
+	job->offset = job->nsegs ? job->segs[0].off : 0;
+	job->sieve = file_ds_size(fh, write);
+	if (job->nsegs < 2) {
+		free(job->segs);
+		job->segs = NULL;
+	}
+	fh->position += job->size;
+
+	request->type = REQUEST_FILE;
+	request->state = job;
+	request->done = 0;
+
+	if (write && job->segs) {
+		upc_lock(fh->sieve_lock);
+		job->result = file_sieve(fh, job->segs, job->nsegs,
+					 job->buf, job->sieve, 1);
+		upc_unlock(fh->sieve_lock);
+		job->done = 1;
+		return MPI_SUCCESS;
+	}
+
+	//A contiguous read the read-ahead buffers hold completes at once
+	if (!write && job->nsegs == 1) {
+		job->result = file_prefetch_serve(fh, job->buf, job->size,
+						  job->offset);
+		file_prefetch_note(fh, job->offset, job->size);
+		if ((size_t)job->result == job->size) {
+			job->done = 1;
+			return MPI_SUCCESS;
+		}
+	}
+
+	return aio_submit(job);
 }
 
 /**
- * Reads from the given file
- * Not non-blocking as there isn't a good async implementation yet 
+ * Start writing to the given file
+ * The write runs on an I/O worker; the request completes through
+ * MPI_Test, MPI_Wait or MPI_Waitall
  */
+int MPI_File_iwrite(MPI_File fh, void *buf, int count,
+		    MPI_Datatype datatype, MPI_Request *request) {
+	return file_queue(fh, buf, count, datatype, request, 1);
+}
 
+/**
+ * Start reading from the given file
+ * buf must not be used until the request completes
+ */
 int MPI_File_iread(MPI_File fh, void  *buf, int count,
 		   MPI_Datatype  datatype, MPI_Request *request) {
-	ssize_t size, data_size;
-	int ret, error_code;
-	struct __struct_thread_upc_file_t *fhp;
-	Plfs_fd *fd;
-	
-	data_size = sizeof_datatype(datatype);
-	size = count * data_size;
-
-	fhp = (struct __struct_thread_upc_file_t *)fh->fd->th[MYTHREAD];
-	fd = (Plfs_fd *)fhp->adio_fd;
-
-	if( fhp->flags & UPC_RDONLY )
+	return file_queue(fh, buf, count, datatype, request, 0);
+}
+
+
+/**
+ * Move count elements of datatype between buf and the file at byte
+ * position pos of the view
+ * A collective access goes through two-phase I/O over the file's
+ * communicator, leaving the aggregators' writes running in split if it
+ * is set; an independent one through positioned I/O on this thread's
+ * handle alone, setting moved to the bytes of data moved
+ */
+static int file_access(MPI_File fh, MPI_Offset pos, void *buf, int count,
+		       MPI_Datatype datatype, MPI_Status *status, int write,
+		       int coll, MPI_Offset *moved, file_split *split) {
+	type_desc *t;
+	file_seg *segs;
+	char *packed;
+	size_t size;
+	ssize_t done;
+	int ret, err, nsegs;
+
+	if (moved)
+		*moved = 0;
+
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	if (pos < 0)
+		return MPI_ERR_ARG;
+
+	t = type_get(datatype);
+	if (t ? !t->committed : !type_basic_of(datatype))
+		return MPI_ERR_TYPE;
+
+	//With collective buffering turned off each rank moves its own data,
+	//but the chunks of a compressed file are written by the aggregators
+	if (coll && !(write ? fh->cb_write || fh->zip : fh->cb_read))
+		coll = 0;
+
+	if (!coll && (fh->amode & (write ? MPI_MODE_RDONLY : MPI_MODE_WRONLY)))
 		return MPI_ERR_OTHER;
 
-	if( fhp->async_flag == 1 )
+	if (!coll && write && fh->zip)
 		return MPI_ERR_OTHER;
 
-	ret = UPC_ADIO_ReadContig( fd, buf, size, fhp->private_pointer, 
-				   &error_code );
+	size = count * sizeof_datatype(datatype);
+	if (file_view_map(fh, pos, size, &segs, &nsegs))
+		return MPI_ERR_OTHER;
 
-	request->done = 1;
-	if (error_code == UPC_ADIO_FAILURE) {
-		ret = MPI_ERR_OTHER;
+	packed = buf;
+	if (t && type_dense(datatype)) {
+		packed = (char *)buf + t->lb;
+		t = NULL;
+	} else if (t) {
+		//A collective access still goes through the exchange without
+		//the data, and fails on every rank
+		packed = malloc(size + 1);
+		if (!packed && !coll) {
+			free(segs);
+			return MPI_ERR_OTHER;
+		}
+		if (packed && write)
+			type_pack(buf, count, datatype, packed);
+	}
+
+	//Read-ahead data under a write is stale
+	if (write && nsegs)
+		file_prefetch_drop(fh, segs[0].off, segs[nsegs - 1].off +
+				   segs[nsegs - 1].len - segs[0].off);
+
+	//Small writes go to the write-behind cache; anything else first
+	//flushes the cached data it overlaps
+	if (coll) {
+		err = file_cache_flush(fh, 0, -1);
+		ret = file_twophase(fh, segs, nsegs, packed, write, split);
+		if (!ret)
+			ret = err;
+		if (write && fh->zip && (err = file_zip_share(fh)) && !ret)
+			ret = err;
+		done = size;
+	} else if (write && nsegs == 1 &&
+		   (err = file_cache_write(fh, packed, size, segs[0].off))) {
+		done = err < 0 ? -1 : size;
+	} else if (nsegs && file_cache_flush(fh, segs[0].off,
+					     segs[nsegs - 1].off +
+					     segs[nsegs - 1].len - segs[0].off)) {
+		done = -1;
+	} else if (nsegs < 2 && write) {
+		done = nsegs ? file_pio(fh, packed, segs[0].len,
+					segs[0].off, 1) : 0;
+	} else if (nsegs < 2) {
+		done = nsegs ? file_read_ahead(fh, packed, segs[0].len,
+					       segs[0].off) : 0;
+	} else if (write) {
+		upc_lock(fh->sieve_lock);
+		done = file_sieve(fh, segs, nsegs, packed,
+				  file_ds_size(fh, 1), 1);
+		upc_unlock(fh->sieve_lock);
 	} else {
-		ret = MPI_SUCCESS;
+		done = file_sieve(fh, segs, nsegs, packed,
+				  file_ds_size(fh, 0), 0);
 	}
+	free(segs);
+
+	if (!coll)
+		ret = done < 0 || (write && done != size) ?
+			MPI_ERR_OTHER : MPI_SUCCESS;
+
+	if (moved)
+		*moved = ret ? 0 : done;
+
+	if (t) {
+		if (!write && !ret)
+			type_unpack(packed, done, buf, count, datatype);
+		free(packed);
+	}
+
+	if (status)
+		status->MPI_ERROR = ret;
 
 	return ret;
 }
 
-
 /**
- * Reads from the given file
+ * Reads from the given file at offset
+ * Aggregator threads read large stripe-aligned domains and the ranks
+ * fetch their pieces from the aggregators' buffers
  */
-
 int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset,
 			 void *buf, int count, MPI_Datatype datatype,
 			 MPI_Status *status) {
-	ssize_t size, data_size;
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, offset * sizeof_datatype(fh->etype), buf,
+			   count, datatype, status, 0, 1, NULL, NULL);
+}
+
+/**
+ * Writes to the given file at offset
+ * The ranks put their data into the aggregators' buffers, which write
+ * it with a few large requests
+ */
+int MPI_File_write_at_all(MPI_File fh, MPI_Offset offset, void *buf,
+			  int count, MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, offset * sizeof_datatype(fh->etype), buf,
+			   count, datatype, status, 1, 1, NULL, NULL);
+}
+
+/**
+ * Reads from the given file at offset, independently of other ranks
+ */
+int MPI_File_read_at(MPI_File fh, MPI_Offset offset, void *buf, int count,
+		     MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, offset * sizeof_datatype(fh->etype), buf,
+			   count, datatype, status, 0, 0, NULL, NULL);
+}
+
+/**
+ * Writes to the given file at offset, independently of other ranks
+ */
+int MPI_File_write_at(MPI_File fh, MPI_Offset offset, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, offset * sizeof_datatype(fh->etype), buf,
+			   count, datatype, status, 1, 0, NULL, NULL);
+}
+
+/**
+ * Reads from the given file at this thread's file pointer, which moves
+ * past the data read
+ */
+int MPI_File_read(MPI_File fh, void *buf, int count, MPI_Datatype datatype,
+		  MPI_Status *status) {
+	MPI_Offset moved;
 	int ret;
 
-	data_size = sizeof_datatype(datatype);
-	size = count * data_size;
-	data_size = upc_all_fread_local(fh->fd, buf, size, 1, 0);
-	if (data_size < 0)
-		ret = MPI_ERR_OTHER;
-	else
-		ret = MPI_SUCCESS;
+	if (!fh)
+		return MPI_ERR_ARG;
 
-	status->MPI_ERROR = ret;
+	ret = file_access(fh, fh->position, buf, count,
+			  datatype, status, 0, 0, &moved, NULL);
+	fh->position += moved;
 
 	return ret;
 }
 
 /**
- * Reads from the given file
+ * Writes to the given file at this thread's file pointer, which moves
+ * past the data written
  */
-int MPI_File_write_at_all(MPI_File fh, MPI_Offset offset, void *buf,			  
-			  int count, MPI_Datatype datatype, MPI_Status *status) {
-	ssize_t size, data_size;
+int MPI_File_write(MPI_File fh, void *buf, int count, MPI_Datatype datatype,
+		   MPI_Status *status) {
+	MPI_Offset moved;
 	int ret;
-	
-	data_size = sizeof_datatype(datatype);
-	size = count * data_size;
-	data_size = upc_all_fwrite_local(fh->fd, buf, size, 1, 0);
-	if (data_size < 0)
-		ret = MPI_ERR_OTHER;
-	else
-		ret = MPI_SUCCESS;
-	
-	status->MPI_ERROR = ret;
+
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	ret = file_access(fh, fh->position, buf, count,
+			  datatype, status, 1, 0, &moved, NULL);
+	fh->position += moved;
+
+	return ret;
+}
+
+//The byte position of the view at which an access at the file pointer
+//starts; the pointer moves past it
+static MPI_Offset file_advance(MPI_File fh, int count,
+			       MPI_Datatype datatype) {
+	MPI_Offset pos = fh->position;
+
+	if (count > 0)
+		fh->position += count * sizeof_datatype(datatype);
+
+	return pos;
+}
+
+/**
+ * Reads from the given file at this thread's file pointer, collectively
+ * The pointer moves past the data asked for
+ */
+int MPI_File_read_all(MPI_File fh, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, file_advance(fh, count, datatype), buf, count,
+			   datatype, status, 0, 1, NULL, NULL);
+}
+
+/**
+ * Writes to the given file at this thread's file pointer, collectively
+ */
+int MPI_File_write_all(MPI_File fh, void *buf, int count,
+		       MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_access(fh, file_advance(fh, count, datatype), buf, count,
+			   datatype, status, 1, 1, NULL, NULL);
+}
+
+/**
+ * Start a collective access at byte position pos of the view
+ * The data reaches the aggregators now, or comes back from them for a
+ * read, so buf is done with; the aggregators' writes are left running
+ * Errors are kept for the end of the access
+ */
+static int file_split_start(MPI_File fh, MPI_Offset pos, void *buf,
+			    int count, MPI_Datatype datatype, int write,
+			    file_split **split) {
+	file_split *s;
+
+	s = calloc(1, sizeof(file_split));
+	if (!s)
+		return MPI_ERR_OTHER;
+
+	s->err = file_access(fh, pos, buf, count, datatype, NULL, write, 1,
+			     NULL, s);
+	*split = s;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Begin the split collective of a file, of which there is one at a time
+ */
+static int file_begin(MPI_File fh, MPI_Offset pos, void *buf, int count,
+		      MPI_Datatype datatype, int write) {
+	if (fh->split)
+		return MPI_ERR_OTHER;
+
+	return file_split_start(fh, pos, buf, count, datatype, write,
+				&fh->split);
+}
+
+/**
+ * Wait for the split collective of a file and agree on its outcome
+ */
+static int file_end(MPI_File fh, MPI_Status *status) {
+	int err, gerr;
+
+	if (!fh || !fh->split)
+		return MPI_ERR_ARG;
+
+	err = file_split_finish(fh->split);
+	fh->split = NULL;
+	MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX, fh->comm);
+
+	if (status)
+		status->MPI_ERROR = gerr;
+
+	return gerr;
+}
+
+/**
+ * Begins a collective read at offset; the data is in buf once it returns
+ */
+int MPI_File_read_at_all_begin(MPI_File fh, MPI_Offset offset, void *buf,
+			       int count, MPI_Datatype datatype) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_begin(fh, offset * sizeof_datatype(fh->etype), buf, count,
+			  datatype, 0);
+}
+
+int MPI_File_read_at_all_end(MPI_File fh, void *buf, MPI_Status *status) {
+	return file_end(fh, status);
+}
+
+/**
+ * Begins a collective write at offset
+ * The aggregators write while the caller computes; buf may be reused
+ * once this returns
+ */
+int MPI_File_write_at_all_begin(MPI_File fh, MPI_Offset offset, void *buf,
+				int count, MPI_Datatype datatype) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_begin(fh, offset * sizeof_datatype(fh->etype), buf, count,
+			  datatype, 1);
+}
+
+/**
+ * Waits for the aggregators' writes of the split collective
+ */
+int MPI_File_write_at_all_end(MPI_File fh, void *buf, MPI_Status *status) {
+	return file_end(fh, status);
+}
+
+int MPI_File_read_all_begin(MPI_File fh, void *buf, int count,
+			    MPI_Datatype datatype) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_begin(fh, file_advance(fh, count, datatype), buf, count,
+			  datatype, 0);
+}
+
+int MPI_File_read_all_end(MPI_File fh, void *buf, MPI_Status *status) {
+	return file_end(fh, status);
+}
+
+int MPI_File_write_all_begin(MPI_File fh, void *buf, int count,
+			     MPI_Datatype datatype) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_begin(fh, file_advance(fh, count, datatype), buf, count,
+			  datatype, 1);
+}
+
+int MPI_File_write_all_end(MPI_File fh, void *buf, MPI_Status *status) {
+	return file_end(fh, status);
+}
+
+/**
+ * Start a nonblocking collective access, completed by MPI_Test or
+ * MPI_Wait, which report this rank's errors only
+ */
+static int file_icoll(MPI_File fh, MPI_Offset pos, void *buf, int count,
+		      MPI_Datatype datatype, MPI_Request *request, int write) {
+	file_split *split;
+	int ret;
+
+	if (!request)
+		return MPI_ERR_ARG;
+
+	ret = file_split_start(fh, pos, buf, count, datatype, write, &split);
+	if (ret)
+		return ret;
+
+	request->type = REQUEST_SPLIT;
+	request->state = split;
+	request->done = 0;
+
+	return MPI_SUCCESS;
+}
+
+int MPI_File_iread_at_all(MPI_File fh, MPI_Offset offset, void *buf,
+			  int count, MPI_Datatype datatype,
+			  MPI_Request *request) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_icoll(fh, offset * sizeof_datatype(fh->etype), buf, count,
+			  datatype, request, 0);
+}
+
+int MPI_File_iwrite_at_all(MPI_File fh, MPI_Offset offset, void *buf,
+			   int count, MPI_Datatype datatype,
+			   MPI_Request *request) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_icoll(fh, offset * sizeof_datatype(fh->etype), buf, count,
+			  datatype, request, 1);
+}
+
+int MPI_File_iread_all(MPI_File fh, void *buf, int count,
+		       MPI_Datatype datatype, MPI_Request *request) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_icoll(fh, file_advance(fh, count, datatype), buf, count,
+			  datatype, request, 0);
+}
+
+/**
+ * Starts a collective write at this thread's file pointer
+ * The data has reached the aggregators when this returns
+ */
+int MPI_File_iwrite_all(MPI_File fh, void *buf, int count,
+			MPI_Datatype datatype, MPI_Request *request) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	return file_icoll(fh, file_advance(fh, count, datatype), buf, count,
+			  datatype, request, 1);
+}
+
+/**
+ * Move the shared file pointer past bytes of view data with one atomic
+ * on rank 0, returning the position it moved from
+ */
+static MPI_Offset file_shared_claim(MPI_File fh, MPI_Offset bytes) {
+	return atomic_fetch_add(fh->shared_fp, bytes, fh->sieve_lock);
+}
+
+/**
+ * Reads from the given file at the shared file pointer, which moves past
+ * the data asked for, independently of other ranks
+ */
+int MPI_File_read_shared(MPI_File fh, void *buf, int count,
+			 MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	return file_access(fh, file_shared_claim(fh, count *
+						 sizeof_datatype(datatype)),
+			   buf, count, datatype, status, 0, 0, NULL, NULL);
+}
+
+/**
+ * Writes to the given file at the shared file pointer, independently of
+ * other ranks
+ * Ranks appending records this way each cost one remote atomic
+ */
+int MPI_File_write_shared(MPI_File fh, void *buf, int count,
+			  MPI_Datatype datatype, MPI_Status *status) {
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	return file_access(fh, file_shared_claim(fh, count *
+						 sizeof_datatype(datatype)),
+			   buf, count, datatype, status, 1, 0, NULL, NULL);
+}
+
+/**
+ * Collectively access the data of every rank at the shared file pointer
+ * in rank order
+ * A prefix sum gives each rank its place and the total, which the last
+ * rank claims for all with one atomic
+ */
+static int file_ordered(MPI_File fh, void *buf, int count,
+			MPI_Datatype datatype, MPI_Status *status, int write) {
+	long long bytes, end;
+	MPI_Offset base = 0;
+	int ret;
+
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	bytes = count > 0 ? count * sizeof_datatype(datatype) : 0;
+	ret = MPI_Scan(&bytes, &end, 1, MPI_LONG_LONG, MPI_SUM, fh->comm);
+	if (ret)
+		return ret;
+
+	if (fh->comm->rank == fh->comm->size - 1)
+		base = file_shared_claim(fh, end);
+	group_bcast(fh->comm->group, &base, sizeof(base), fh->comm->size - 1);
+
+	return file_access(fh, base + end - bytes, buf, count, datatype,
+			   status, write, 1, NULL, NULL);
+}
+
+int MPI_File_read_ordered(MPI_File fh, void *buf, int count,
+			  MPI_Datatype datatype, MPI_Status *status) {
+	return file_ordered(fh, buf, count, datatype, status, 0);
+}
+
+/**
+ * Writes the data of every rank in rank order at the shared file
+ * pointer with one collective write
+ */
+int MPI_File_write_ordered(MPI_File fh, void *buf, int count,
+			   MPI_Datatype datatype, MPI_Status *status) {
+	return file_ordered(fh, buf, count, datatype, status, 1);
+}
+
+/**
+ * Moves the shared file pointer, collectively
+ */
+int MPI_File_seek_shared(MPI_File fh, MPI_Offset offset, int whence) {
+	MPI_Offset size;
+	int err = MPI_SUCCESS;
+
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	if (whence != MPI_SEEK_SET && whence != MPI_SEEK_CUR &&
+	    whence != MPI_SEEK_END)
+		return MPI_ERR_ARG;
+
+	offset *= sizeof_datatype(fh->etype);
+	if (whence == MPI_SEEK_END) {
+		file_cache_flush(fh, 0, -1);
+		size = file_size(fh);
+		if (size < 0)
+			err = MPI_ERR_OTHER;
+		offset += size;
+	}
+
+	//Every rank's earlier claims land before the pointer is moved
+	group_barrier(fh->comm->group);
+	if (fh->comm->rank == 0 && !err) {
+		if (whence == MPI_SEEK_CUR)
+			offset += file_shared_claim(fh, 0);
+
+		if (offset < 0)
+			err = MPI_ERR_ARG;
+		else
+			atomic_swap(fh->shared_fp, offset, fh->sieve_lock);
+	}
+	group_bcast(fh->comm->group, &err, sizeof(int), 0);
+
+	return err;
+}
+
+/**
+ * Returns the shared file pointer in etypes
+ */
+int MPI_File_get_position_shared(MPI_File fh, MPI_Offset *offset) {
+	if (!fh || !offset)
+		return MPI_ERR_ARG;
+
+	*offset = file_shared_claim(fh, 0) / sizeof_datatype(fh->etype);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Sets the part of the file each rank sees: etype elements laid out by
+ * filetype, tiled from disp bytes into the file
+ * Resets the individual file pointer to the start of the view
+ */
+int MPI_File_set_view(MPI_File fh, MPI_Offset disp, MPI_Datatype etype,
+		      MPI_Datatype filetype, char *datarep, MPI_Info info) {
+	file_view *view;
+	size_t esize;
+	int ret;
+
+	if (!fh || disp < 0)
+		return MPI_ERR_ARG;
+
+	//Only the native representation is supported
+	if (datarep && strcmp(datarep, "native"))
+		return MPI_ERR_ARG;
+
+	if (type_get(etype) ? !type_get(etype)->committed :
+	    !type_basic_of(etype))
+		return MPI_ERR_TYPE;
+
+	esize = type_size(etype);
+	if (!esize || type_size(filetype) % esize)
+		return MPI_ERR_TYPE;
+
+	ret = file_view_new(filetype, &view);
+	if (ret)
+		return ret;
+
+	aio_drain(fh);
+	file_prefetch_drop(fh, 0, -1);
+	file_view_free(fh->view);
+	type_release(fh->etype);
+	type_release(fh->filetype);
+	type_hold(etype);
+	type_hold(filetype);
+
+	fh->view = view;
+	fh->disp = disp;
+	fh->etype = etype;
+	fh->filetype = filetype;
+	if (info != MPI_INFO_NULL)
+		ret = file_rehint(fh, info);
+
+	fh->position = 0;
+	group_barrier(fh->comm->group);
+	if (fh->comm->rank == 0)
+		atomic_swap(fh->shared_fp, 0, fh->sieve_lock);
+	group_barrier(fh->comm->group);
 
 	return ret;
 }
 
+/**
+ * Returns the view of the file
+ * Derived datatypes are returned with a reference the caller frees
+ */
+int MPI_File_get_view(MPI_File fh, MPI_Offset *disp, MPI_Datatype *etype,
+		      MPI_Datatype *filetype, char *datarep) {
+	if (!fh || !disp || !etype || !filetype)
+		return MPI_ERR_ARG;
+
+	*disp = fh->disp;
+	*etype = fh->etype;
+	*filetype = fh->filetype;
+	type_hold(*etype);
+	type_hold(*filetype);
+	if (datarep)
+		strcpy(datarep, "native");
+
+	return MPI_SUCCESS;
+}
+
 /**
  * Seeks within the given file
+ * Only this thread's file pointer moves, though the pupc driver finds
+ * the end of the file collectively
  */
 int MPI_File_seek(MPI_File fh, MPI_Offset offset, int whence) {
-	upc_off_t ret;
+	MPI_Offset size;
 
-	ret = upc_all_fseek(fh->fd, offset, whence);
-	if (ret < 0)
-		return MPI_ERR_OTHER;
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	//The individual file pointer counts bytes of data in the view
+	offset *= sizeof_datatype(fh->etype);
+	if (whence == MPI_SEEK_CUR) {
+		offset += fh->position;
+	} else if (whence == MPI_SEEK_END) {
+		file_cache_flush(fh, 0, -1);
+		size = file_size(fh);
+		if (size < 0)
+			return MPI_ERR_OTHER;
+		offset += size;
+	} else if (whence != MPI_SEEK_SET) {
+		return MPI_ERR_ARG;
+	}
+
+	if (offset < 0)
+		return MPI_ERR_ARG;
+
+	fh->position = offset;
 
 	return MPI_SUCCESS;
 }
 
 /**
  * Sets the file size
+ * A compressed file can grow, or shrink to a chunk boundary
  */
 int MPI_File_set_size(MPI_File fh, MPI_Offset size) {
 	int ret;
 
-	ret = upc_all_fset_size(fh->fd, size);
-	if (ret < 0)
-		return MPI_ERR_OTHER;
+	if (!fh || size < 0)
+		return MPI_ERR_ARG;
 
-	return MPI_SUCCESS;
+	ret = file_cache_flush(fh, 0, -1);
+	file_prefetch_drop(fh, 0, -1);
+	if (fh->zip)
+		return file_zip_set_size(fh, size);
+	if (fh->driver->set_size(fh, size))
+		ret = MPI_ERR_OTHER;
+
+	return ret;
 }
 
 /**
  * Closes the given file
  */
 int MPI_File_close(MPI_File *fh) {
-	int ret = MPI_SUCCESS;
+	int ret, err;
 
 	if (!fh || !*fh)
 		return MPI_ERR_ARG;
 
-	upc_barrier;
-	if(upc_all_fclose((*fh)->fd) != 0) {
-		ret = MPI_ERR_OTHER;
+	//Operations still queued must land before the file goes away
+	//A split collective left unended still lands
+	if ((*fh)->split) {
+		file_split_finish((*fh)->split);
+		(*fh)->split = NULL;
 	}
+	file_prefetch_free(*fh);
+	aio_drain(*fh);
+	err = file_cache_flush(*fh, 0, -1);
+	file_cache_free(*fh);
+	if ((*fh)->zip && file_zip_flush(*fh) && !err)
+		err = MPI_ERR_OTHER;
+	group_barrier((*fh)->comm->group);
+	ret = (*fh)->driver->close(*fh);
+	if (!ret)
+		ret = err;
+
+	if ((*fh)->comm->rank == 0) {
+		upc_lock_free((*fh)->sieve_lock);
+		upc_free((*fh)->shared_fp);
+	}
+	file_zip_free(*fh);
+	MPI_Comm_free(&(*fh)->comm);
+	file_view_free((*fh)->view);
+	type_release((*fh)->etype);
+	type_release((*fh)->filetype);
+	free((*fh)->access_style);
 
 	if (fh && *fh) {
 		free(*fh);
@@ -197,6 +1161,10 @@ int MPI_File_close(MPI_File *fh) {
 int MPI_File_delete(char *filename, MPI_Info info) {
 	int ret;
 
+	if (!filename)
+		return MPI_ERR_ARG;
+
+	file_driver_of(&filename, 0, info);
 	ret = unlink(filename);
 	if (ret < 0)
 		return MPI_ERR_OTHER;
@@ -205,35 +1173,110 @@ int MPI_File_delete(char *filename, MPI_Info info) {
 }
 
 /**
- * Returns the MPI_Info associated with the file
+ * Returns a new MPI_Info holding the hints in effect on the file, which
+ * the caller frees
  */
 int MPI_File_get_info(MPI_File fh, MPI_Info *info_used) {
-	if(!info_used)
+	char value[MPI_MAX_INFO_VAL + 1];
+	MPI_Info info;
+	int ret;
+
+	if (!fh || !info_used)
 		return MPI_ERR_ARG;
 
-	*info_used = fh->info;
+	ret = MPI_Info_create(&info);
+	if (ret)
+		return ret;
+
+#define FILE_INFO(key, fmt, val) do {					\
+		snprintf(value, sizeof(value), fmt, val);		\
+		if (!ret)						\
+			ret = MPI_Info_set(info, key, value);		\
+	} while (0)
+
+	FILE_INFO("io_driver", "%s", fh->driver->name);
+	FILE_INFO("cb_nodes", "%d", file_cb_nodes(fh));
+	FILE_INFO("cb_buffer_size", "%zu", fh->cb_buffer_size);
+	FILE_INFO("romio_cb_read", "%s", fh->cb_read ? "enable" : "disable");
+	FILE_INFO("romio_cb_write", "%s", fh->cb_write ? "enable" : "disable");
+	FILE_INFO("striping_unit", "%lld", (long long)fh->striping_unit);
+	if (fh->striping_factor)
+		FILE_INFO("striping_factor", "%d", fh->striping_factor);
+	FILE_INFO("romio_ds_read", "%s", fh->ds_read ? "enable" : "disable");
+	FILE_INFO("romio_ds_write", "%s", fh->ds_write ? "enable" : "disable");
+	FILE_INFO("ind_rd_buffer_size", "%zu", fh->ind_rd_buffer_size);
+	FILE_INFO("ind_wr_buffer_size", "%zu", fh->ind_wr_buffer_size);
+	FILE_INFO("direct_io", "%s", fh->direct_io ? "true" : "false");
+	FILE_INFO("write_behind", "%s", fh->write_behind ? "true" : "false");
+	if (fh->write_behind)
+		FILE_INFO("write_behind_buffer_size", "%zu", fh->write_behind);
+	FILE_INFO("read_ahead", "%s", fh->read_ahead ? "true" : "false");
+	FILE_INFO("compression", "%s", fh->zip ? "enable" : "disable");
+	if (fh->zip) {
+		FILE_INFO("compression_chunk_size", "%lld",
+			  (long long)fh->zip->chunk);
+		FILE_INFO("compression_typesize", "%d", fh->zip->typesize);
+	}
+	if (fh->access_style)
+		FILE_INFO("access_style", "%s", fh->access_style);
+
+#undef FILE_INFO
+
+	if (ret) {
+		MPI_Info_free(&info);
+		return ret;
+	}
+
+	*info_used = info;
 
 	return MPI_SUCCESS;
 }
 
+/**
+ * Sets new hints on the given file
+ * Every rank must give the same collective buffering hints
+ */
+int MPI_File_set_info(MPI_File fh, MPI_Info info) {
+	int ret;
+
+	if (!fh)
+		return MPI_ERR_ARG;
+
+	ret = file_rehint(fh, info);
+	group_barrier(fh->comm->group);
+
+	return ret;
+}
+
 /**
  * Flushes the file to disk
  */
 int MPI_File_sync(MPI_File fh) {
 	int ret;
 
-	ret = upc_all_fsync(fh->fd);
-	if (ret < 0)
-		return MPI_ERR_OTHER;
+	if (!fh)
+		return MPI_ERR_ARG;
 
-	return MPI_SUCCESS;
+	//Other ranks' writes become visible, so what was read ahead is stale
+	ret = file_cache_flush(fh, 0, -1);
+	file_prefetch_drop(fh, 0, -1);
+	if (fh->zip && file_zip_flush(fh))
+		ret = MPI_ERR_OTHER;
+	if (fh->driver->sync(fh))
+		ret = MPI_ERR_OTHER;
+
+	return ret;
 }
 
 /**
  * Returns the file size of the file
  */
 int MPI_File_get_size(MPI_File fh, MPI_Offset *size) {
-	*size =  upc_all_fget_size(fh->fd);
+	if (!fh || !size)
+		return MPI_ERR_ARG;
+
+	file_cache_flush(fh, 0, -1);
+	*size = file_size(fh);
 
 	if (*size < 0)
 		return MPI_ERR_OTHER;
@@ -242,13 +1285,37 @@ int MPI_File_get_size(MPI_File fh, MPI_Offset *size) {
 }
 
 /**
- * Waits for all asynchronous operations to complete
+ * Returns a pointer to byte offset of a file opened through the mmap
+ * driver, and the bytes that can be read from it, without copying
+ * The pointer is valid until the file is closed
  */
-int MPIO_Wait(MPIO_Request *request, MPI_Status *status) {
-	status->MPI_ERROR = 0;
-	while (!request->done) {
-		usleep(100);
-	}
+int MPIO_File_map(MPI_File fh, MPI_Offset offset, void **ptr,
+		  MPI_Offset *size) {
+	if (!fh || !ptr || !size)
+		return MPI_ERR_ARG;
+
+	//A compressed file holds no data to point at
+	if (!fh->driver->map || fh->zip)
+		return MPI_ERR_OTHER;
+
+	*size = 0;
+	*ptr = fh->driver->map(fh, offset, size);
+	if (!*ptr)
+		return MPI_ERR_ARG;
 
 	return MPI_SUCCESS;
 }
+
+/**
+ * Waits for an asynchronous operation to complete
+ */
+int MPIO_Wait(MPIO_Request *request, MPI_Status *status) {
+	return MPI_Wait(request, status);
+}
+
+/**
+ * Checks whether an asynchronous operation has completed
+ */
+int MPIO_Test(MPIO_Request *request, int *flag, MPI_Status *status) {
+	return MPI_Test(request, flag, status);
+}
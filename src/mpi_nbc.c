@@ -0,0 +1,555 @@
+/*
+  Non-blocking collectives
+
+  Each collective is a schedule of steps.  A step is a broadcast, a
+  reduction or a barrier that moves data through the NBC slots in the
+  sync blocks of the communicator's members, and is advanced by
+  nbc_progress() whenever the caller tests, waits, polls for a message
+  or waits in a blocking collective.  MPI_Ibarrier on a communicator of every thread uses the
+  split-phase upc_notify/upc_wait barrier instead.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_aio.h"
+
+#define NBC_BCAST     0
+#define NBC_REDUCE    1
+#define NBC_BARRIER   2
+#define NBC_MAX_STEPS 2
+
+//The slot a member of g uses for operation seq
+#define NBC_SLOT(g, rank, seq) ((g)->sync[rank]->nbc[(seq) % NBC_SLOTS])
+
+typedef struct nbc_step nbc_step;
+struct nbc_step {
+	int type;
+	int root;
+	int seq;
+	int started;
+	int remaining;		//peers this step is still waiting on
+};
+
+typedef struct nbc_state nbc_state;
+struct nbc_state {
+	int done;
+	int err;
+	int barrier;
+	int nsteps;
+	int cur;
+	nbc_step steps[NBC_MAX_STEPS];
+	coll_group *g;
+	void *sendbuf;
+	void *recvbuf;
+	int count;
+	MPI_Datatype datatype;
+	MPI_Op op;
+	size_t size;
+	char *pending;		//per-rank flags of peers still outstanding
+	char *tmp;
+	shared [] char *local;	//data published in this thread's slot
+	nbc_state *next;
+};
+
+//Operations that still need to be progressed
+static nbc_state *nbc_active = NULL;
+
+//The MPI_Ibarrier between its upc_notify and upc_wait
+static int nbc_barrier_pending = 0;
+static nbc_state *nbc_barrier_state = NULL;
+
+/**
+ * Publish this thread's part of a step
+ */
+static int nbc_step_start(nbc_state *st, nbc_step *step) {
+	coll_group *g = st->g;
+	int i;
+
+	step->started = 1;
+	step->remaining = 1;
+	if (g->rank == step->root || step->type == NBC_BARRIER) {
+		step->remaining = g->size - 1;
+		for (i = 0; i < g->size; i++) {
+			st->pending[i] = (i != g->rank);
+		}
+	}
+
+	if (step->type == NBC_BARRIER) {
+		NBC_SLOT(g, g->rank, step->seq).seq = step->seq;
+	} else if (step->type == NBC_BCAST && g->rank == step->root) {
+		st->local = upc_alloc(st->size + 1);
+		if (!st->local)
+			return MPI_ERR_OTHER;
+
+		memcpy((char *)st->local, st->recvbuf, st->size);
+		NBC_SLOT(g, g->rank, step->seq).data = st->local;
+		NBC_SLOT(g, g->rank, step->seq).data_size = st->size;
+		NBC_SLOT(g, g->rank, step->seq).seq = step->seq;
+	} else if (step->type == NBC_REDUCE && g->rank == step->root) {
+		if (st->recvbuf != st->sendbuf)
+			memcpy(st->recvbuf, st->sendbuf, st->size);
+	} else if (step->type == NBC_REDUCE) {
+		st->local = upc_alloc(st->size + 1);
+		if (!st->local)
+			return MPI_ERR_OTHER;
+
+		memcpy((char *)st->local, st->sendbuf, st->size);
+		NBC_SLOT(g, g->rank, step->seq).data = st->local;
+		NBC_SLOT(g, g->rank, step->seq).data_size = st->size;
+		NBC_SLOT(g, g->rank, step->seq).seq = step->seq;
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Check the peers a step is waiting on; returns 1 once it is complete
+ */
+static int nbc_step_test(nbc_state *st, nbc_step *step) {
+	coll_group *g = st->g;
+	int i;
+
+	if (step->type == NBC_BARRIER) {
+		//A peer has arrived once it has published this or a later seq
+		for (i = 0; i < g->size && step->remaining; i++) {
+			if (st->pending[i] && NBC_SLOT(g, i, step->seq).seq >= step->seq) {
+				st->pending[i] = 0;
+				step->remaining--;
+			}
+		}
+
+		if (step->remaining)
+			return 0;
+	} else if (step->type == NBC_BCAST && g->rank == step->root) {
+		//Wait for every peer to have copied the data out
+		for (i = 0; i < g->size && step->remaining; i++) {
+			if (st->pending[i] && NBC_SLOT(g, i, step->seq).ack >= step->seq) {
+				st->pending[i] = 0;
+				step->remaining--;
+			}
+		}
+
+		if (step->remaining)
+			return 0;
+
+		upc_free(st->local);
+		st->local = NULL;
+	} else if (step->type == NBC_BCAST) {
+		if (NBC_SLOT(g, step->root, step->seq).seq != step->seq)
+			return 0;
+
+		upc_memget(st->recvbuf, NBC_SLOT(g, step->root, step->seq).data,
+			   st->size);
+		NBC_SLOT(g, g->rank, step->seq).ack = step->seq;
+	} else if (g->rank == step->root) {
+		//Combine contributions in whatever order they arrive
+		for (i = 0; i < g->size && step->remaining; i++) {
+			if (!st->pending[i] || NBC_SLOT(g, i, step->seq).seq != step->seq)
+				continue;
+
+			upc_memget(st->tmp, NBC_SLOT(g, i, step->seq).data, st->size);
+			reduce_local(st->recvbuf, st->tmp, st->count, st->datatype, st->op);
+			st->pending[i] = 0;
+			step->remaining--;
+		}
+
+		if (step->remaining)
+			return 0;
+
+		//Release the contributors
+		NBC_SLOT(g, g->rank, step->seq).ack = step->seq;
+	} else {
+		if (NBC_SLOT(g, step->root, step->seq).ack < step->seq)
+			return 0;
+
+		upc_free(st->local);
+		st->local = NULL;
+	}
+
+	return 1;
+}
+
+/**
+ * Advance an operation through as many steps as are ready
+ */
+static void nbc_advance(nbc_state *st) {
+	nbc_step *step;
+	int err;
+
+	while (st->cur < st->nsteps) {
+		step = &st->steps[st->cur];
+		if (!step->started) {
+			err = nbc_step_start(st, step);
+			if (err) {
+				st->err = err;
+				break;
+			}
+		}
+
+		if (!nbc_step_test(st, step))
+			return;
+
+		st->g->nbc_owner[step->seq % NBC_SLOTS] = NULL;
+		st->cur++;
+	}
+
+	for (; st->cur < st->nsteps; st->cur++) {
+		st->g->nbc_owner[st->steps[st->cur].seq % NBC_SLOTS] = NULL;
+	}
+
+	free(st->pending);
+	free(st->tmp);
+	st->pending = NULL;
+	st->tmp = NULL;
+	st->done = 1;
+}
+
+/**
+ * Advance every outstanding non-blocking collective
+ */
+void nbc_progress() {
+	nbc_state *st, **prev;
+
+	prev = &nbc_active;
+	while ((st = *prev) != NULL) {
+		nbc_advance(st);
+		if (st->done)
+			*prev = st->next;
+		else
+			prev = &st->next;
+	}
+}
+
+/**
+ * Complete an outstanding MPI_Ibarrier
+ * Must be called before anything else that uses upc_notify
+ */
+void nbc_barrier_flush() {
+	if (!nbc_barrier_pending)
+		return;
+
+	upc_wait;
+	nbc_barrier_pending = 0;
+	if (nbc_barrier_state)
+		nbc_barrier_state->done = 1;
+
+	nbc_barrier_state = NULL;
+}
+
+/**
+ * Get ready for a blocking upc_barrier or upc_all_* collective
+ * A thread blocked in one cannot progress the schedules other threads
+ * wait on, so every thread first meets in a barrier that does
+ * Must be called by every thread
+ */
+void nbc_upc_enter() {
+	nbc_barrier_flush();
+	group_barrier(MPI_COMM_WORLD->group);
+}
+
+/**
+ * Set up a request for a new non-blocking collective on comm
+ */
+static nbc_state *nbc_new(MPI_Comm comm, MPI_Request *request) {
+	nbc_state *st;
+
+	st = malloc(sizeof(nbc_state));
+	if (!st)
+		return NULL;
+
+	memset(st, 0, sizeof(nbc_state));
+	st->g = comm->group;
+	request->done = 0;
+	request->type = REQUEST_COLL;
+	request->state = st;
+
+	return st;
+}
+
+/**
+ * Append a step, claiming the slot for its sequence number
+ */
+static void nbc_add_step(nbc_state *st, int type, int root) {
+	nbc_step *step;
+	int slot;
+
+	step = &st->steps[st->nsteps++];
+	step->type = type;
+	step->root = root;
+	step->seq = st->g->nbc_seq++;
+
+	//Wait for the operation that last used this slot
+	slot = step->seq % NBC_SLOTS;
+	while (st->g->nbc_owner[slot]) {
+		nbc_progress();
+	}
+
+	st->g->nbc_owner[slot] = st;
+}
+
+/**
+ * Start progressing a fully described operation
+ */
+static int nbc_post(nbc_state *st, MPI_Request *request) {
+	int i;
+
+	st->pending = malloc(st->g->size);
+	st->tmp = malloc(st->size + 1);
+	if (!st->pending || !st->tmp) {
+		//Give back the slots its steps claimed
+		for (i = 0; i < NBC_SLOTS; i++) {
+			if (st->g->nbc_owner[i] == st)
+				st->g->nbc_owner[i] = NULL;
+		}
+		free(st->pending);
+		free(st->tmp);
+		free(st);
+		request->state = NULL;
+		return MPI_ERR_OTHER;
+	}
+
+	st->next = nbc_active;
+	nbc_active = st;
+	nbc_advance(st);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Start a barrier; it completes in MPI_Test or MPI_Wait
+ */
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request *request) {
+	nbc_state *st;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!request)
+		return MPI_ERR_ARG;
+
+	if (!comm->world) {
+		st = nbc_new(comm, request);
+		if (!st)
+			return MPI_ERR_OTHER;
+
+		nbc_add_step(st, NBC_BARRIER, 0);
+		return nbc_post(st, request);
+	}
+
+	nbc_barrier_flush();
+	st = nbc_new(comm, request);
+	if (!st)
+		return MPI_ERR_OTHER;
+
+	st->barrier = 1;
+	upc_notify;
+	nbc_barrier_pending = 1;
+	nbc_barrier_state = st;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Start a broadcast of buffer from root
+ */
+int MPI_Ibcast(void *buffer, int count, MPI_Datatype datatype,
+	       int root, MPI_Comm comm, MPI_Request *request) {
+	nbc_state *st;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!request)
+		return MPI_ERR_ARG;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	st = nbc_new(comm, request);
+	if (!st)
+		return MPI_ERR_OTHER;
+
+	st->recvbuf = buffer;
+	st->count = count;
+	st->datatype = datatype;
+	st->size = count * sizeof_datatype(datatype);
+	nbc_add_step(st, NBC_BCAST, root);
+
+	return nbc_post(st, request);
+}
+
+/**
+ * Start a reduction of sendbuf into recvbuf on root
+ */
+int MPI_Ireduce(void *sendbuf, void *recvbuf, int count,
+		MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm,
+		MPI_Request *request) {
+	nbc_state *st;
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!request)
+		return MPI_ERR_ARG;
+
+	if (root < 0 || root >= comm->size)
+		return MPI_ERR_ROOT;
+
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
+
+	st = nbc_new(comm, request);
+	if (!st)
+		return MPI_ERR_OTHER;
+
+	st->sendbuf = sendbuf;
+	st->recvbuf = recvbuf;
+	st->count = count;
+	st->datatype = datatype;
+	st->op = op;
+	st->size = count * sizeof_datatype(datatype);
+	nbc_add_step(st, NBC_REDUCE, root);
+
+	return nbc_post(st, request);
+}
+
+/**
+ * Start a reduction whose result is delivered to every member
+ * Reduces to rank 0, then broadcasts from it
+ */
+int MPI_Iallreduce(void *sendbuf, void *recvbuf, int count,
+		   MPI_Datatype datatype, MPI_Op op, MPI_Comm comm,
+		   MPI_Request *request) {
+	nbc_state *st;
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!request)
+		return MPI_ERR_ARG;
+
+	if (sendbuf == MPI_IN_PLACE)
+		sendbuf = recvbuf;
+
+	err = reduce_local(recvbuf, sendbuf, 0, datatype, op);
+	if (err)
+		return err;
+
+	st = nbc_new(comm, request);
+	if (!st)
+		return MPI_ERR_OTHER;
+
+	st->sendbuf = sendbuf;
+	st->recvbuf = recvbuf;
+	st->count = count;
+	st->datatype = datatype;
+	st->op = op;
+	st->size = count * sizeof_datatype(datatype);
+	nbc_add_step(st, NBC_REDUCE, 0);
+	nbc_add_step(st, NBC_BCAST, 0);
+
+	return nbc_post(st, request);
+}
+
+/**
+ * Check whether a request has completed without blocking
+ * An MPI_Ibarrier is completed here with upc_wait
+ */
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status) {
+	nbc_state *st;
+	int err = MPI_SUCCESS;
+
+	if (!request || !flag)
+		return MPI_ERR_REQUEST;
+
+	*flag = 0;
+	if (request->type == REQUEST_COLL && request->state) {
+		st = request->state;
+		if (st->barrier)
+			nbc_barrier_flush();
+		else
+			nbc_progress();
+
+		if (!st->done)
+			return MPI_SUCCESS;
+
+		err = st->err;
+		free(st);
+		request->state = NULL;
+		request->done = 1;
+	}
+
+	if (request->type == REQUEST_FILE && request->state) {
+		if (!aio_test(request->state))
+			return MPI_SUCCESS;
+
+		err = aio_finish(request->state);
+		request->state = NULL;
+		request->done = 1;
+	}
+
+	if (request->type == REQUEST_SPLIT && request->state) {
+		if (!file_split_test(request->state))
+			return MPI_SUCCESS;
+
+		err = file_split_finish(request->state);
+		request->state = NULL;
+		request->done = 1;
+	}
+
+	if (!request->done)
+		return MPI_SUCCESS;
+
+	*flag = 1;
+	if (status != NULL) {
+		status->MPI_SOURCE = MPI_ANY_SOURCE;
+		status->MPI_TAG = MPI_ANY_TAG;
+		status->MPI_ERROR = err;
+	}
+
+	return err;
+}
+
+/**
+ * Block until a request has completed
+ */
+int MPI_Wait(MPI_Request *request, MPI_Status *status) {
+	int flag = 0;
+	int err;
+
+	//File operations complete on a worker, which wakes us
+	if (request && request->type == REQUEST_FILE && request->state)
+		aio_wait(request->state);
+	else if (request && request->type == REQUEST_SPLIT && request->state)
+		file_split_wait(request->state);
+
+	do {
+		err = MPI_Test(request, &flag, status);
+	} while (!err && !flag);
+
+	return err;
+}
+
+/**
+ * Block until all of the requests have completed
+ */
+int MPI_Waitall(int count, MPI_Request *requests, MPI_Status *statuses) {
+	int i, err, ret;
+
+	ret = MPI_SUCCESS;
+	for (i = 0; i < count; i++) {
+		err = MPI_Wait(&requests[i], statuses ? &statuses[i] : MPI_STATUS_IGNORE);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
@@ -0,0 +1,723 @@
+/*
+  One-sided communication
+
+  A window is a piece of UPC shared memory on every rank.  MPI_Put and
+  MPI_Get are upc_memput and upc_memget on the target's piece, started
+  asynchronously where the runtime allows and completed when the epoch
+  ends, so the target takes no part in the transfer.
+
+  MPI_Win_allocate_shared puts the ranks' memory one after another in a
+  single block on the lowest rank, which every rank reaches through an
+  ordinary pointer, so the node holds one copy and loads need no call.
+
+  Memory from MPI_Win_allocate, or memory given to MPI_Win_create that
+  already lies in the shared heap, is exposed as it is.  Other memory
+  passed to MPI_Win_create is private, so the window keeps a public copy
+  in shared memory and reconciles the two at every synchronization: a
+  byte the peers changed since the last one is copied into the caller's
+  memory, every other byte is published from it.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_rma.h"
+#include "upc_type.h"
+
+/**
+ * Reconcile a private window with its public copy
+ * Only called while no peer is accessing this rank's memory
+ */
+static void win_reconcile(MPI_Win win) {
+	char *pub;
+	size_t i;
+
+	if (!win->shadow)
+		return;
+
+	pub = (char *)win->local;
+	for (i = 0; i < win->size; i++) {
+		if (pub[i] != win->snapshot[i])
+			((char *)win->base)[i] = pub[i];
+		else
+			pub[i] = ((char *)win->base)[i];
+	}
+
+	memcpy(win->snapshot, pub, win->size);
+}
+
+#ifdef __BERKELEY_UPC__
+/**
+ * Remember a transfer to complete at the end of the epoch
+ */
+static int win_track(MPI_Win win, win_handle h) {
+	win_handle *pending;
+
+	if (win->npending == win->cap) {
+		pending = realloc(win->pending,
+				  sizeof(win_handle) * (win->cap * 2 + 16));
+		if (!pending) {
+			bupc_waitsync(h);
+			return MPI_SUCCESS;
+		}
+
+		win->pending = pending;
+		win->cap = win->cap * 2 + 16;
+	}
+
+	win->pending[win->npending++] = h;
+
+	return MPI_SUCCESS;
+}
+#endif
+
+/**
+ * Complete every transfer this rank has started on the window
+ */
+int win_flush_all(MPI_Win win) {
+#ifdef __BERKELEY_UPC__
+	int i;
+
+	for (i = 0; i < win->npending; i++) {
+		bupc_waitsync(win->pending[i]);
+	}
+
+	win->npending = 0;
+#endif
+	upc_fence;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Find bytes bytes at displacement disp in rank's part of the window
+ */
+int win_target(MPI_Win win, int rank, MPI_Aint disp, size_t bytes,
+	       shared [] char **addr) {
+	win_entry *e;
+	size_t off;
+
+	if (rank < 0 || rank >= win->comm->size)
+		return MPI_ERR_RANK;
+
+	e = &win->members[rank];
+	if (disp < 0)
+		return MPI_ERR_RMA_RANGE;
+
+	off = (size_t) disp * e->disp_unit;
+	if (off + bytes > e->size)
+		return MPI_ERR_RMA_RANGE;
+
+	*addr = e->base + off;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Agree over comm whether any rank failed
+ * Returns MPI_ERR_OTHER on every rank if one did
+ */
+static int win_agree(MPI_Comm comm, int failed) {
+	int any;
+
+	MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_MAX, comm);
+
+	return any ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Create a window over local, which the caller has already set up
+ * Every rank fails if one does
+ */
+static int win_setup(MPI_Win win, MPI_Comm comm) {
+	win_entry mine;
+	size_t words;
+	int i, err, failed = 0;
+
+	err = MPI_Comm_dup(comm, &win->comm);
+	if (err)
+		return err;
+
+	win->members = malloc(sizeof(win_entry) * win->comm->size);
+	win->post_seq = calloc(win->comm->size, sizeof(int));
+	win->start_seq = calloc(win->comm->size, sizeof(int));
+	win->post_group = malloc(sizeof(int) * win->comm->size);
+	win->start_group = malloc(sizeof(int) * win->comm->size);
+	win->lock_type = calloc(win->comm->size, sizeof(int));
+	mine.base = win->local;
+	mine.size = win->size;
+	mine.disp_unit = win->disp_unit;
+	words = WIN_CTL_WORDS * win->comm->size + 1;
+	mine.ctl = upc_alloc(sizeof(int) * words);
+	if (mine.ctl)
+		upc_memset(mine.ctl, 0, sizeof(int) * words);
+
+	mine.lock = upc_global_lock_alloc();
+	for (i = 0; i < WIN_LOCKS; i++) {
+		mine.stripe[i] = upc_global_lock_alloc();
+		if (!mine.stripe[i])
+			failed = 1;
+	}
+
+	if (!win->members || !win->post_seq || !win->start_seq ||
+	    !win->post_group || !win->start_group || !win->lock_type ||
+	    !mine.ctl || !mine.lock)
+		failed = 1;
+
+	err = win_agree(win->comm, failed);
+	if (!err)
+		err = group_allgather(win->comm->group, &mine, sizeof(win_entry),
+				      win->members);
+	if (!err)
+		return MPI_SUCCESS;
+
+	//No peer refers to this rank's control block and locks yet
+	upc_free(mine.ctl);
+	if (mine.lock)
+		upc_lock_free(mine.lock);
+	for (i = 0; i < WIN_LOCKS; i++) {
+		if (mine.stripe[i])
+			upc_lock_free(mine.stripe[i]);
+	}
+	MPI_Comm_free(&win->comm);
+
+	return err;
+}
+
+/**
+ * Allocate a window handle for size bytes with the given unit
+ */
+static MPI_Win win_new(MPI_Aint size, int disp_unit) {
+	MPI_Win win;
+
+	win = malloc(sizeof(struct MPI_Win));
+	if (!win)
+		return MPI_WIN_NULL;
+
+	memset(win, 0, sizeof(struct MPI_Win));
+	win->size = size;
+	win->disp_unit = disp_unit;
+
+	return win;
+}
+
+/**
+ * Free the memory of a window handle, but not what win_setup made or
+ * the block of a shared window
+ */
+static void win_discard(MPI_Win win) {
+	if (!win)
+		return;
+
+	if (win->shadow || win->allocated)
+		upc_free(win->local);
+
+	free(win->snapshot);
+	free(win->members);
+	free(win->post_seq);
+	free(win->start_seq);
+	free(win->post_group);
+	free(win->start_group);
+	free(win->lock_type);
+#ifdef __BERKELEY_UPC__
+	free(win->pending);
+#endif
+	free(win);
+}
+
+/**
+ * Expose size bytes at base to the other ranks of comm
+ */
+int MPI_Win_create(void *base, MPI_Aint size, int disp_unit, MPI_Info info,
+		   MPI_Comm comm, MPI_Win *win) {
+	shared void *s;
+	MPI_Win w;
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!win || size < 0 || disp_unit <= 0 || (size && !base))
+		return MPI_ERR_ARG;
+
+	//Every rank agrees on failing before the collective setup
+	w = win_new(size, disp_unit);
+	if (!w)
+		return win_agree(comm, 1);
+
+	w->base = base;
+
+	//Memory already in this thread's part of the shared heap needs no copy
+	s = NULL;
+#ifdef __BERKELEY_UPC__
+	if (size)
+		s = bupc_inverse_cast(base);
+#endif
+	if (s && upc_threadof(s) == MYTHREAD) {
+		w->local = (shared [] char *)s;
+	} else if (size) {
+		w->shadow = 1;
+		w->local = upc_alloc(size);
+		w->snapshot = malloc(size);
+		if (w->local && w->snapshot) {
+			memcpy((char *)w->local, base, size);
+			memcpy(w->snapshot, base, size);
+		}
+	}
+
+	err = win_agree(comm, size && (!w->local ||
+					(w->shadow && !w->snapshot)));
+	if (!err)
+		err = win_setup(w, comm);
+	if (err) {
+		win_discard(w);
+		return err;
+	}
+
+	*win = w;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Allocate size bytes of shared memory and expose them
+ * The local address is returned in *(void **)baseptr
+ */
+int MPI_Win_allocate(MPI_Aint size, int disp_unit, MPI_Info info,
+		     MPI_Comm comm, void *baseptr, MPI_Win *win) {
+	MPI_Win w;
+	int err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!win || !baseptr || size < 0 || disp_unit <= 0)
+		return MPI_ERR_ARG;
+
+	//Every rank agrees on failing before the collective setup
+	w = win_new(size, disp_unit);
+	if (!w)
+		return win_agree(comm, 1);
+
+	w->allocated = 1;
+	w->local = upc_alloc(size + 1);
+	w->base = (char *)w->local;
+	err = win_agree(comm, !w->local);
+	if (!err)
+		err = win_setup(w, comm);
+	if (err) {
+		win_discard(w);
+		return err;
+	}
+
+	*(void **)baseptr = w->base;
+	*win = w;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Allocate size bytes in a block shared by every rank of comm
+ * Each rank's part follows the previous rank's, and every rank can
+ * load and store any part through the pointer MPI_Win_shared_query
+ * returns
+ */
+int MPI_Win_allocate_shared(MPI_Aint size, int disp_unit, MPI_Info info,
+			    MPI_Comm comm, void *baseptr, MPI_Win *win) {
+	struct { MPI_Aint size; int castable; } mine, *all;
+	MPI_Aint off, total;
+	MPI_Win w;
+	int r, err;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!win || !baseptr || size < 0 || disp_unit <= 0)
+		return MPI_ERR_ARG;
+
+	//Every rank learns what every other one found, so all of them
+	//agree on failing
+	mine.size = size;
+	mine.castable = 1;
+	for (r = 0; r < comm->size; r++) {
+		if (!thread_castable(comm->threads[r]))
+			mine.castable = 0;
+	}
+
+	all = malloc(sizeof(mine) * comm->size);
+	w = win_new(size, disp_unit);
+	err = win_agree(comm, !all || !w);
+	if (!err)
+		err = group_allgather(comm->group, &mine, sizeof(mine), all);
+	off = 0;
+	total = 0;
+	for (r = 0; r < comm->size && !err; r++) {
+		if (!all[r].castable)
+			err = MPI_ERR_COMM;
+		if (r == comm->rank)
+			off = total;
+		total += all[r].size;
+	}
+	free(all);
+	if (err) {
+		win_discard(w);
+		return err;
+	}
+
+	if (comm->rank == 0)
+		w->segment = upc_alloc(total + 1);
+	group_bcast(comm->group, &w->segment, sizeof(w->segment), 0);
+	if (!w->segment) {
+		win_discard(w);
+		return MPI_ERR_OTHER;
+	}
+
+	w->local = w->segment + off;
+	w->base = thread_cast(w->local);
+	err = win_setup(w, comm);
+	if (err) {
+		if (comm->rank == 0)
+			upc_free(w->segment);
+		win_discard(w);
+		return err;
+	}
+
+	*(void **)baseptr = w->base;
+	*win = w;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Find rank's part of a shared window
+ * MPI_PROC_NULL finds the first part that is not empty
+ */
+int MPI_Win_shared_query(MPI_Win win, int rank, MPI_Aint *size,
+			 int *disp_unit, void *baseptr) {
+	win_entry *e;
+	int r;
+
+	if (win == MPI_WIN_NULL || !win->segment)
+		return MPI_ERR_WIN;
+
+	if (!size || !disp_unit || !baseptr)
+		return MPI_ERR_ARG;
+
+	if (rank == MPI_PROC_NULL) {
+		rank = 0;
+		for (r = win->comm->size - 1; r >= 0; r--) {
+			if (win->members[r].size)
+				rank = r;
+		}
+	}
+
+	if (rank < 0 || rank >= win->comm->size)
+		return MPI_ERR_RANK;
+
+	e = &win->members[rank];
+	*size = e->size;
+	*disp_unit = e->disp_unit;
+	*(void **)baseptr = thread_cast(e->base);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Free a window once every rank has finished with it
+ */
+int MPI_Win_free(MPI_Win *win) {
+	win_entry *mine;
+	MPI_Win w;
+	int i;
+
+	if (!win || *win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	w = *win;
+	win_flush_all(w);
+	group_barrier(w->comm->group);
+	win_reconcile(w);
+	if (w->segment && w->comm->rank == 0)
+		upc_free(w->segment);
+
+	mine = &w->members[w->comm->rank];
+	upc_free(mine->ctl);
+	upc_lock_free(mine->lock);
+	for (i = 0; i < WIN_LOCKS; i++) {
+		upc_lock_free(mine->stripe[i]);
+	}
+
+	MPI_Comm_free(&w->comm);
+	win_discard(w);
+	*win = MPI_WIN_NULL;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Check a transfer and find its target address
+ */
+static int rma_check(MPI_Win win, int origin_count,
+		     MPI_Datatype origin_datatype, int target_rank,
+		     MPI_Aint target_disp, int target_count,
+		     MPI_Datatype target_datatype, size_t *bytes,
+		     shared [] char **addr) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	//Only datatypes without holes are moved in one transfer
+	if (!type_dense(origin_datatype) || !type_dense(target_datatype))
+		return MPI_ERR_TYPE;
+
+	*bytes = origin_count * sizeof_datatype(origin_datatype);
+	if (target_count * sizeof_datatype(target_datatype) != *bytes)
+		return MPI_ERR_ARG;
+
+	return win_target(win, target_rank, target_disp, *bytes, addr);
+}
+
+/**
+ * Write origin_addr into the target's window
+ * The transfer completes by the end of the epoch
+ */
+int MPI_Put(void *origin_addr, int origin_count,
+	    MPI_Datatype origin_datatype, int target_rank,
+	    MPI_Aint target_disp, int target_count,
+	    MPI_Datatype target_datatype, MPI_Win win) {
+	shared [] char *addr;
+	size_t bytes;
+	int err;
+
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	err = rma_check(win, origin_count, origin_datatype, target_rank,
+			target_disp, target_count, target_datatype, &bytes,
+			&addr);
+	if (err || !bytes)
+		return err;
+
+	//Part of a shared window lies in another thread's memory
+	if (target_rank == win->comm->rank) {
+		memcpy(thread_cast(addr), origin_addr, bytes);
+		return MPI_SUCCESS;
+	}
+
+#ifdef __BERKELEY_UPC__
+	return win_track(win, bupc_memput_async(addr, origin_addr, bytes));
+#else
+	upc_memput(addr, origin_addr, bytes);
+
+	return MPI_SUCCESS;
+#endif
+}
+
+/**
+ * Read the target's window into origin_addr
+ * The data is only valid once the epoch has ended
+ */
+int MPI_Get(void *origin_addr, int origin_count,
+	    MPI_Datatype origin_datatype, int target_rank,
+	    MPI_Aint target_disp, int target_count,
+	    MPI_Datatype target_datatype, MPI_Win win) {
+	shared [] char *addr;
+	size_t bytes;
+	int err;
+
+	if (target_rank == MPI_PROC_NULL)
+		return MPI_SUCCESS;
+
+	err = rma_check(win, origin_count, origin_datatype, target_rank,
+			target_disp, target_count, target_datatype, &bytes,
+			&addr);
+	if (err || !bytes)
+		return err;
+
+	if (target_rank == win->comm->rank) {
+		memcpy(origin_addr, thread_cast(addr), bytes);
+		return MPI_SUCCESS;
+	}
+
+#ifdef __BERKELEY_UPC__
+	return win_track(win, bupc_memget_async(origin_addr, addr, bytes));
+#else
+	upc_memget(origin_addr, addr, bytes);
+
+	return MPI_SUCCESS;
+#endif
+}
+
+/**
+ * End the current epoch on every rank and start the next
+ * Private windows are reconciled between two barriers so no peer
+ * accesses them meanwhile
+ */
+int MPI_Win_fence(int assert, MPI_Win win) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	win_flush_all(win);
+	group_barrier(win->comm->group);
+	if (win->shadow) {
+		win_reconcile(win);
+		group_barrier(win->comm->group);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Translate the members of group to ranks of the window's communicator
+ */
+static int win_ranks(MPI_Win win, MPI_Group group, int *ranks) {
+	int i;
+
+	if (group == MPI_GROUP_NULL)
+		return MPI_ERR_GROUP;
+
+	for (i = 0; i < group->size; i++) {
+		ranks[i] = comm_rank_of(win->comm, group->threads[i]);
+		if (ranks[i] < 0)
+			return MPI_ERR_GROUP;
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Start an exposure epoch for the ranks in group
+ */
+int MPI_Win_post(MPI_Group group, int assert, MPI_Win win) {
+	win_entry *e;
+	int i, r, err;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	err = win_ranks(win, group, win->post_group);
+	if (err)
+		return err;
+
+	win->npost = group->size;
+	win_reconcile(win);
+	for (i = 0; i < win->npost; i++) {
+		r = win->post_group[i];
+		e = &win->members[r];
+		WIN_CTL(e, WIN_POSTED, win->comm->rank) = ++win->post_seq[r];
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Start an access epoch on the ranks in group once each has posted
+ */
+int MPI_Win_start(MPI_Group group, int assert, MPI_Win win) {
+	win_entry *me;
+	int i, r, err;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	err = win_ranks(win, group, win->start_group);
+	if (err)
+		return err;
+
+	win->nstart = group->size;
+	me = &win->members[win->comm->rank];
+	for (i = 0; i < win->nstart; i++) {
+		r = win->start_group[i];
+		++win->start_seq[r];
+		while (WIN_CTL(me, WIN_POSTED, r) < win->start_seq[r]) {
+			nbc_progress();
+		}
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * End the access epoch, telling each target its transfers are done
+ */
+int MPI_Win_complete(MPI_Win win) {
+	win_entry *e;
+	int i, r;
+
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	win_flush_all(win);
+	for (i = 0; i < win->nstart; i++) {
+		r = win->start_group[i];
+		e = &win->members[r];
+		WIN_CTL(e, WIN_COMPLETED, win->comm->rank) = win->start_seq[r];
+	}
+
+	win->nstart = 0;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Returns 1 once every origin of the exposure epoch has completed
+ */
+static int win_exposure_done(MPI_Win win) {
+	win_entry *me;
+	int i, r;
+
+	me = &win->members[win->comm->rank];
+	for (i = 0; i < win->npost; i++) {
+		r = win->post_group[i];
+		if (WIN_CTL(me, WIN_COMPLETED, r) < win->post_seq[r])
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * End the exposure epoch once every origin has completed
+ */
+int MPI_Win_wait(MPI_Win win) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	while (!win_exposure_done(win)) {
+		nbc_progress();
+	}
+
+	win->npost = 0;
+	win_reconcile(win);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * End the exposure epoch if every origin has completed
+ */
+int MPI_Win_test(MPI_Win win, int *flag) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	*flag = win_exposure_done(win);
+	if (*flag) {
+		win->npost = 0;
+		win_reconcile(win);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Synchronize the private and public copies of this rank's window
+ */
+int MPI_Win_sync(MPI_Win win) {
+	if (win == MPI_WIN_NULL)
+		return MPI_ERR_WIN;
+
+	upc_fence;
+	win_reconcile(win);
+
+	return MPI_SUCCESS;
+}
@@ -0,0 +1,614 @@
+/*
+  Process topologies and neighbourhood collectives
+
+  A Cartesian or distributed graph communicator keeps the list of ranks
+  it receives from and sends to.  When asked to reorder, a Cartesian
+  grid is cut into tiles the size of a node, so that most of a rank's
+  grid neighbours are threads on its own node.
+
+  A neighbourhood collective only synchronizes with the neighbours: each
+  receiver publishes that its scratch buffer is ready, each sender puts
+  its blocks straight into the receivers' scratch buffers and raises a
+  flag per block, and the receiver copies the blocks out once all of
+  its flags are up.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_topo.h"
+
+//A rank of the old communicator and its node, for reordering
+typedef struct topo_member topo_member;
+struct topo_member {
+	int node;
+	int rank;
+};
+
+/**
+ * Allocate a topology with room for its dimensions and neighbours
+ */
+static comm_topo *topo_new(int type, int ndims, int indegree,
+			   int outdegree) {
+	comm_topo *t;
+
+	t = malloc(sizeof(comm_topo));
+	if (!t)
+		return NULL;
+
+	t->type = type;
+	t->ndims = ndims;
+	t->indegree = indegree;
+	t->outdegree = outdegree;
+	t->epoch = 0;
+	t->dims = malloc(sizeof(int) * ndims + 1);
+	t->periods = malloc(sizeof(int) * ndims + 1);
+	t->sources = malloc(sizeof(int) * indegree + 1);
+	t->destinations = malloc(sizeof(int) * outdegree + 1);
+	t->slot = malloc(sizeof(int) * outdegree + 1);
+	if (!t->dims || !t->periods || !t->sources || !t->destinations ||
+	    !t->slot) {
+		topo_free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/**
+ * Free a topology
+ */
+void topo_free(comm_topo *t) {
+	if (!t)
+		return;
+
+	free(t->dims);
+	free(t->periods);
+	free(t->sources);
+	free(t->destinations);
+	free(t->slot);
+	free(t);
+}
+
+/**
+ * Coordinates of a rank in a row-major grid
+ */
+static void cart_coords(comm_topo *t, int rank, int *coords) {
+	int d;
+
+	for (d = t->ndims - 1; d >= 0; d--) {
+		coords[d] = rank % t->dims[d];
+		rank /= t->dims[d];
+	}
+}
+
+/**
+ * Rank at coords, wrapping periodic dimensions
+ * Returns MPI_PROC_NULL if coords is off a non-periodic edge
+ */
+static int cart_rank(comm_topo *t, int *coords) {
+	int d, c, rank;
+
+	rank = 0;
+	for (d = 0; d < t->ndims; d++) {
+		c = coords[d];
+		if (t->periods[d])
+			c = ((c % t->dims[d]) + t->dims[d]) % t->dims[d];
+		else if (c < 0 || c >= t->dims[d])
+			return MPI_PROC_NULL;
+
+		rank = rank * t->dims[d] + c;
+	}
+
+	return rank;
+}
+
+/**
+ * Rank disp steps from rank along direction
+ */
+static int cart_step(comm_topo *t, int rank, int direction, int disp) {
+	int coords[t->ndims];
+
+	cart_coords(t, rank, coords);
+	coords[direction] += disp;
+
+	return cart_rank(t, coords);
+}
+
+/**
+ * Order members by node, then by rank
+ */
+static int topo_member_cmp(const void *a, const void *b) {
+	const topo_member *x = a;
+	const topo_member *y = b;
+
+	if (x->node != y->node)
+		return x->node < y->node ? -1 : 1;
+
+	return x->rank - y->rank;
+}
+
+/**
+ * Advance a row-major index within extent; returns 0 once it wraps
+ */
+static int index_next(int *idx, int *extent, int ndims) {
+	int d;
+
+	for (d = ndims - 1; d >= 0; d--) {
+		if (++idx[d] < extent[d])
+			return 1;
+
+		idx[d] = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Give each node a compact tile of the grid
+ * The first n ranks of comm are ordered by node and the grid is cut
+ * into tiles of as many positions as the first node has members.  The
+ * members take the positions tile by tile, so cart_of[r] is the cart
+ * rank of rank r and most grid neighbours share a node.
+ */
+static int cart_map(MPI_Comm comm, int ndims, int *dims, int n,
+		    int *cart_of) {
+	topo_member *m;
+	int *tile, *ntiles, *ti, *ci;
+	int r, d, k, f, best, ppn, rest, cart;
+
+	m = malloc(sizeof(topo_member) * n);
+	tile = malloc(sizeof(int) * ndims * 4);
+	if (!m || !tile) {
+		free(m);
+		free(tile);
+		return 1;
+	}
+
+	ntiles = tile + ndims;
+	ti = ntiles + ndims;
+	ci = ti + ndims;
+	for (r = 0; r < n; r++) {
+		m[r].node = node_of[comm->threads[r]];
+		m[r].rank = r;
+	}
+
+	qsort(m, n, sizeof(topo_member), topo_member_cmp);
+	ppn = 0;
+	for (r = 0; r < n && m[r].node == m[0].node; r++) {
+		ppn++;
+	}
+
+	//Spread the prime factors of ppn over the dimensions with most room
+	for (d = 0; d < ndims; d++) {
+		tile[d] = 1;
+	}
+
+	rest = ppn;
+	for (f = 2; rest > 1; ) {
+		if (rest % f) {
+			f++;
+			continue;
+		}
+
+		best = -1;
+		for (d = 0; d < ndims; d++) {
+			if ((dims[d] / tile[d]) % f)
+				continue;
+
+			if (best < 0 || dims[d] / tile[d] > dims[best] / tile[best])
+				best = d;
+		}
+
+		if (best >= 0)
+			tile[best] *= f;
+
+		rest /= f;
+	}
+
+	for (d = 0; d < ndims; d++) {
+		ntiles[d] = dims[d] / tile[d];
+		ti[d] = 0;
+	}
+
+	k = 0;
+	do {
+		for (d = 0; d < ndims; d++) {
+			ci[d] = 0;
+		}
+
+		do {
+			cart = 0;
+			for (d = 0; d < ndims; d++) {
+				cart = cart * dims[d] + ti[d] * tile[d] + ci[d];
+			}
+
+			cart_of[m[k++].rank] = cart;
+		} while (index_next(ci, tile, ndims));
+	} while (index_next(ti, ntiles, ndims));
+
+	free(m);
+	free(tile);
+
+	return 0;
+}
+
+/**
+ * Create a Cartesian topology for the given rank
+ * The neighbours are the -1 and +1 ranks of each dimension in turn;
+ * what is sent to the -1 neighbour arrives as its +1 block
+ */
+static comm_topo *cart_topo(int ndims, int *dims, int *periods, int rank) {
+	comm_topo *t;
+	int d;
+
+	t = topo_new(MPI_CART, ndims, 2 * ndims, 2 * ndims);
+	if (!t)
+		return NULL;
+
+	for (d = 0; d < ndims; d++) {
+		t->dims[d] = dims[d];
+		t->periods[d] = periods[d] != 0;
+	}
+
+	for (d = 0; d < ndims; d++) {
+		t->sources[2 * d] = cart_step(t, rank, d, -1);
+		t->sources[2 * d + 1] = cart_step(t, rank, d, 1);
+		t->destinations[2 * d] = t->sources[2 * d];
+		t->destinations[2 * d + 1] = t->sources[2 * d + 1];
+		t->slot[2 * d] = 2 * d + 1;
+		t->slot[2 * d + 1] = 2 * d;
+	}
+
+	return t;
+}
+
+/**
+ * Create a communicator with a Cartesian grid of the first
+ * dims[0] * ... * dims[ndims - 1] ranks; the others get MPI_COMM_NULL
+ */
+int MPI_Cart_create(MPI_Comm comm_old, int ndims, int *dims, int *periods,
+		    int reorder, MPI_Comm *comm_cart) {
+	int *cart_of;
+	int r, d, n, key, err;
+
+	if (comm_old == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!comm_cart || !dims || !periods)
+		return MPI_ERR_ARG;
+
+	if (ndims < 1)
+		return MPI_ERR_DIMS;
+
+	n = 1;
+	for (d = 0; d < ndims; d++) {
+		if (dims[d] < 1)
+			return MPI_ERR_DIMS;
+
+		n *= dims[d];
+	}
+
+	if (n > comm_old->size)
+		return MPI_ERR_DIMS;
+
+	cart_of = malloc(sizeof(int) * comm_old->size);
+	if (!cart_of)
+		return MPI_ERR_OTHER;
+
+	for (r = 0; r < comm_old->size; r++) {
+		cart_of[r] = r < n ? r : MPI_UNDEFINED;
+	}
+
+	if (reorder && comm_old->num_nodes > 1)
+		cart_map(comm_old, ndims, dims, n, cart_of);
+
+	key = cart_of[comm_old->rank];
+	free(cart_of);
+	err = comm_build(comm_old, key == MPI_UNDEFINED ? MPI_UNDEFINED : 0,
+			 key, comm_cart);
+	if (err || *comm_cart == MPI_COMM_NULL)
+		return err;
+
+	(*comm_cart)->topo = cart_topo(ndims, dims, periods, (*comm_cart)->rank);
+	if (!(*comm_cart)->topo)
+		return MPI_ERR_OTHER;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Get the coordinates of rank in a Cartesian communicator
+ */
+int MPI_Cart_coords(MPI_Comm comm, int rank, int maxdims, int *coords) {
+	comm_topo *t;
+	int d;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	t = comm->topo;
+	if (!t || t->type != MPI_CART)
+		return MPI_ERR_TOPOLOGY;
+
+	if (rank < 0 || rank >= comm->size)
+		return MPI_ERR_RANK;
+
+	if (maxdims < t->ndims)
+		return MPI_ERR_DIMS;
+
+	cart_coords(t, rank, coords);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Get the rank at coords in a Cartesian communicator
+ */
+int MPI_Cart_rank(MPI_Comm comm, int *coords, int *rank) {
+	comm_topo *t;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	t = comm->topo;
+	if (!t || t->type != MPI_CART)
+		return MPI_ERR_TOPOLOGY;
+
+	*rank = cart_rank(t, coords);
+	if (*rank == MPI_PROC_NULL)
+		return MPI_ERR_ARG;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Get the ranks disp steps below and above the caller along direction
+ * Either is MPI_PROC_NULL past a non-periodic edge
+ */
+int MPI_Cart_shift(MPI_Comm comm, int direction, int disp,
+		   int *rank_source, int *rank_dest) {
+	comm_topo *t;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	t = comm->topo;
+	if (!t || t->type != MPI_CART)
+		return MPI_ERR_TOPOLOGY;
+
+	if (direction < 0 || direction >= t->ndims)
+		return MPI_ERR_DIMS;
+
+	*rank_source = cart_step(t, comm->rank, direction, -disp);
+	*rank_dest = cart_step(t, comm->rank, direction, disp);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Find our index in each destination's list of sources
+ * Every rank publishes its sources; the k-th edge to a destination
+ * pairs with the k-th time we appear in its list
+ */
+static int graph_slots(MPI_Comm comm, comm_topo *t) {
+	int *degrees, *offsets, *all;
+	size_t *sizes;
+	int r, i, j, k, dest, total, err;
+
+	degrees = malloc(sizeof(int) * comm->size);
+	offsets = malloc(sizeof(int) * comm->size);
+	sizes = malloc(sizeof(size_t) * comm->size);
+	if (!degrees || !offsets || !sizes) {
+		free(degrees);
+		free(offsets);
+		free(sizes);
+		return MPI_ERR_OTHER;
+	}
+
+	err = group_allgather(comm->group, &t->indegree, sizeof(int), degrees);
+	total = 0;
+	for (r = 0; r < comm->size; r++) {
+		offsets[r] = total;
+		sizes[r] = degrees[r] * sizeof(int);
+		total += degrees[r];
+	}
+
+	all = malloc(sizeof(int) * total + 1);
+	if (!all)
+		err = MPI_ERR_OTHER;
+
+	if (!err)
+		err = group_allgatherv(comm->group, t->sources, sizes, all);
+
+	for (j = 0; j < t->outdegree && !err; j++) {
+		dest = t->destinations[j];
+		t->slot[j] = -1;
+		if (dest == MPI_PROC_NULL)
+			continue;
+
+		//Earlier edges to the same destination use earlier entries
+		k = 0;
+		for (i = 0; i < j; i++) {
+			if (t->destinations[i] == dest)
+				k++;
+		}
+
+		for (i = 0; i < degrees[dest]; i++) {
+			if (all[offsets[dest] + i] == comm->rank && k-- == 0) {
+				t->slot[j] = i;
+				break;
+			}
+		}
+
+		if (t->slot[j] < 0)
+			err = MPI_ERR_TOPOLOGY;
+	}
+
+	free(degrees);
+	free(offsets);
+	free(sizes);
+	free(all);
+
+	return err;
+}
+
+/**
+ * Create a communicator whose ranks each list the ranks they receive
+ * from and send to
+ * Reordering could only renumber the ranks, not move the edges between
+ * threads, so the old rank order is kept; the weights are not used.
+ */
+int MPI_Dist_graph_create_adjacent(MPI_Comm comm_old, int indegree,
+				   int *sources, int *sourceweights,
+				   int outdegree, int *destinations,
+				   int *destweights, MPI_Info info,
+				   int reorder, MPI_Comm *comm_dist_graph) {
+	comm_topo *t;
+	int i, err;
+
+	if (comm_old == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!comm_dist_graph || indegree < 0 || outdegree < 0 ||
+	    (indegree && !sources) || (outdegree && !destinations))
+		return MPI_ERR_ARG;
+
+	for (i = 0; i < indegree; i++) {
+		if (sources[i] < 0 || sources[i] >= comm_old->size)
+			return MPI_ERR_RANK;
+	}
+
+	for (i = 0; i < outdegree; i++) {
+		if (destinations[i] < 0 || destinations[i] >= comm_old->size)
+			return MPI_ERR_RANK;
+	}
+
+	err = comm_build(comm_old, 0, comm_old->rank, comm_dist_graph);
+	if (err)
+		return err;
+
+	t = topo_new(MPI_DIST_GRAPH, 0, indegree, outdegree);
+	if (!t)
+		return MPI_ERR_OTHER;
+
+	memcpy(t->sources, sources, sizeof(int) * indegree);
+	memcpy(t->destinations, destinations, sizeof(int) * outdegree);
+	(*comm_dist_graph)->topo = t;
+
+	return graph_slots(*comm_dist_graph, t);
+}
+
+/**
+ * Exchange size-byte blocks with the neighbours of comm
+ * Block i of recvbuf comes from source i; destination j is sent block j
+ * of sendbuf if distinct is set, otherwise sendbuf itself
+ */
+static int neighbor_exchange(MPI_Comm comm, void *sendbuf, size_t size,
+			     int distinct, void *recvbuf) {
+	comm_topo *t;
+	coll_group *g;
+	group_sync_ptr mine;
+	shared [] char *scratch;
+	strict shared [] int *flags;
+	size_t head;
+	int i, dest, epoch;
+
+	t = comm->topo;
+	g = comm->group;
+	mine = g->sync[g->rank];
+	epoch = ++t->epoch;
+
+	//Every block of the last exchange has been copied out, so the
+	//scratch buffer can be resized and its flags lowered
+	head = (t->indegree * sizeof(int) + TOPO_ALIGN - 1) / TOPO_ALIGN * TOPO_ALIGN;
+	scratch = group_scratch(g, head + t->indegree * size + 1);
+	if (!scratch)
+		return MPI_ERR_OTHER;
+
+	flags = (strict shared [] int *)scratch;
+	for (i = 0; i < t->indegree; i++) {
+		flags[i] = 0;
+	}
+
+	mine->nbr_ready = epoch;
+
+	//Put each block straight into its destination's scratch buffer
+	for (i = 0; i < t->outdegree; i++) {
+		dest = t->destinations[i];
+		if (dest == MPI_PROC_NULL)
+			continue;
+
+		while (g->sync[dest]->nbr_ready < epoch)
+			nbc_progress();
+
+		scratch = g->sync[dest]->scratch;
+		upc_memput(scratch + head + t->slot[i] * size,
+			   (char *)sendbuf + (distinct ? i * size : 0), size);
+		flags = (strict shared [] int *)scratch;
+		flags[t->slot[i]] = epoch;
+	}
+
+	//Copy each block out once its sender has raised the flag
+	scratch = mine->scratch;
+	flags = (strict shared [] int *)scratch;
+	for (i = 0; i < t->indegree; i++) {
+		if (t->sources[i] == MPI_PROC_NULL)
+			continue;
+
+		while (flags[i] < epoch)
+			nbc_progress();
+
+		memcpy((char *)recvbuf + i * size,
+		       (char *)scratch + head + i * size, size);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Send the same sendcount elements to every neighbour and receive
+ * recvcount elements from each
+ */
+int MPI_Neighbor_allgather(void *sendbuf, int sendcount,
+			   MPI_Datatype sendtype, void *recvbuf,
+			   int recvcount, MPI_Datatype recvtype,
+			   MPI_Comm comm) {
+	size_t size;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!comm->topo)
+		return MPI_ERR_TOPOLOGY;
+
+	size = recvcount * sizeof_datatype(recvtype);
+	if (sendcount * sizeof_datatype(sendtype) != size)
+		return MPI_ERR_ARG;
+
+	return neighbor_exchange(comm, sendbuf, size, 0, recvbuf);
+}
+
+/**
+ * Send a separate block of sendcount elements to each neighbour and
+ * receive recvcount elements from each
+ */
+int MPI_Neighbor_alltoall(void *sendbuf, int sendcount,
+			  MPI_Datatype sendtype, void *recvbuf,
+			  int recvcount, MPI_Datatype recvtype,
+			  MPI_Comm comm) {
+	size_t size;
+
+	if (comm == MPI_COMM_NULL)
+		return MPI_ERR_COMM;
+
+	if (!comm->topo)
+		return MPI_ERR_TOPOLOGY;
+
+	size = recvcount * sizeof_datatype(recvtype);
+	if (sendcount * sizeof_datatype(sendtype) != size)
+		return MPI_ERR_ARG;
+
+	return neighbor_exchange(comm, sendbuf, size, 1, recvbuf);
+}
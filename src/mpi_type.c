@@ -0,0 +1,723 @@
+/*
+  Derived datatypes
+
+  Every constructor reduces its arguments to a list of blocks, each some
+  instances of an older type at a byte displacement, and works out the
+  size and extent.  MPI_Type_commit compiles the list into a copy plan:
+  the type is flattened into byte runs, runs that touch are joined and
+  equal runs at a constant stride fold into one looped run.  A strided
+  halo face then packs with one memcpy per row, and a type with no
+  holes with a single memcpy for the whole buffer.
+*/
+
+#include <string.h>
+#include "mpi.h"
+#include "upc_type.h"
+
+//Derived datatypes by handle, less TYPE_FIRST
+static type_desc **types;
+static int ntypes;
+
+/**
+ * Find a derived datatype, or NULL for a basic or unknown one
+ */
+type_desc *type_get(MPI_Datatype datatype) {
+	if (datatype < TYPE_FIRST || datatype >= TYPE_FIRST + ntypes)
+		return NULL;
+
+	return types[datatype - TYPE_FIRST];
+}
+
+static int type_valid(MPI_Datatype datatype) {
+	return type_basic_of(datatype) || type_get(datatype);
+}
+
+/**
+ * Bytes of data in one instance of any datatype
+ */
+size_t type_size(MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+
+	return t ? t->size : sizeof_datatype(datatype);
+}
+
+static MPI_Aint type_extent(MPI_Datatype datatype, MPI_Aint *lb) {
+	type_desc *t = type_get(datatype);
+
+	*lb = t ? t->lb : 0;
+
+	return t ? t->extent : (MPI_Aint) sizeof_datatype(datatype);
+}
+
+static size_t type_align(MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+
+	return t ? t->align : type_basic_of(datatype)->align;
+}
+
+/**
+ * Allocate a datatype of count blocks
+ */
+static type_desc *type_new(int combiner, int count) {
+	type_desc *t;
+
+	t = calloc(1, sizeof(type_desc));
+	if (!t)
+		return NULL;
+
+	t->combiner = combiner;
+	t->count = count;
+	t->blocklens = malloc(sizeof(int) * count + 1);
+	t->disps = malloc(sizeof(MPI_Aint) * count + 1);
+	t->types = malloc(sizeof(MPI_Datatype) * count + 1);
+	if (!t->blocklens || !t->disps || !t->types) {
+		free(t->blocklens);
+		free(t->disps);
+		free(t->types);
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/**
+ * Take a reference to a datatype, keeping it alive after MPI_Type_free
+ */
+void type_hold(MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+
+	if (t)
+		t->refs++;
+}
+
+/**
+ * Drop a reference to a datatype, freeing it with the last one
+ */
+void type_release(MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+	int i;
+
+	if (!t || --t->refs)
+		return;
+
+	for (i = 0; i < t->count; i++) {
+		type_release(t->types[i]);
+	}
+
+	if (t->plan)
+		free(t->plan->runs);
+	free(t->plan);
+	free(t->blocklens);
+	free(t->disps);
+	free(t->types);
+	free(t);
+	types[datatype - TYPE_FIRST] = NULL;
+}
+
+/**
+ * Work out the size and bounds of a new datatype and give it a handle
+ * A subarray sets its own bounds
+ */
+static int type_finish(type_desc *t, MPI_Datatype *newtype) {
+	type_desc **grown;
+	MPI_Aint lb, ub, lo, hi, clb, cext;
+	size_t align;
+	int i, h, first;
+
+	first = 1;
+	lb = ub = 0;
+	t->size = 0;
+	t->align = 1;
+	for (i = 0; i < t->count; i++) {
+		t->size += t->blocklens[i] * type_size(t->types[i]);
+		align = type_align(t->types[i]);
+		if (align > t->align)
+			t->align = align;
+
+		if (!t->blocklens[i])
+			continue;
+
+		cext = type_extent(t->types[i], &clb);
+		lo = t->disps[i] + clb;
+		hi = lo + t->blocklens[i] * cext;
+		if (first || lo < lb)
+			lb = lo;
+		if (first || hi > ub)
+			ub = hi;
+		first = 0;
+	}
+
+	if (t->combiner != TYPE_SUBARRAY) {
+		t->lb = lb;
+		t->extent = ub - lb;
+	}
+
+	//A struct is padded like the C struct it describes
+	if (t->combiner == TYPE_STRUCT && t->extent % t->align)
+		t->extent += t->align - t->extent % t->align;
+
+	for (h = 0; h < ntypes && types[h]; h++);
+	if (h == ntypes) {
+		grown = realloc(types, sizeof(type_desc *) * (ntypes * 2 + 16));
+		if (!grown) {
+			free(t->blocklens);
+			free(t->disps);
+			free(t->types);
+			free(t);
+			return MPI_ERR_OTHER;
+		}
+
+		types = grown;
+		memset(types + ntypes, 0, sizeof(type_desc *) * (ntypes + 16));
+		ntypes = ntypes * 2 + 16;
+	}
+
+	for (i = 0; i < t->count; i++) {
+		if (type_get(t->types[i]))
+			type_get(t->types[i])->refs++;
+	}
+
+	t->refs = 1;
+	types[h] = t;
+	*newtype = TYPE_FIRST + h;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Append count runs of len bytes at off, stride bytes apart, joining
+ * them to the last run where the two touch or continue one loop
+ */
+static int plan_add(type_plan *p, MPI_Aint off, size_t len, int count,
+		    MPI_Aint stride) {
+	type_run *last, *runs;
+
+	if (!len || !count)
+		return MPI_SUCCESS;
+
+	if (count > 1 && stride == (MPI_Aint) len) {
+		len *= count;
+		count = 1;
+	}
+
+	if (p->nruns) {
+		last = &p->runs[p->nruns - 1];
+		if (count == 1 && last->count == 1 &&
+		    last->off + (MPI_Aint) last->len == off) {
+			last->len += len;
+			return MPI_SUCCESS;
+		}
+
+		if (last->len == len && last->count == 1 &&
+		    (count == 1 || stride == off - last->off)) {
+			last->stride = off - last->off;
+			last->count += count;
+			return MPI_SUCCESS;
+		}
+
+		if (last->len == len && last->count > 1 &&
+		    (count == 1 || stride == last->stride) &&
+		    off == last->off + last->count * last->stride) {
+			last->count += count;
+			return MPI_SUCCESS;
+		}
+	}
+
+	if (p->nruns == p->cap) {
+		runs = realloc(p->runs, sizeof(type_run) * (p->cap * 2 + 8));
+		if (!runs)
+			return MPI_ERR_OTHER;
+
+		p->runs = runs;
+		p->cap = p->cap * 2 + 8;
+	}
+
+	runs = &p->runs[p->nruns++];
+	runs->off = off;
+	runs->len = len;
+	runs->count = count;
+	runs->stride = stride;
+
+	return MPI_SUCCESS;
+}
+
+static type_plan *type_plan_of(type_desc *t);
+
+/**
+ * Append n consecutive instances of datatype at off to a plan
+ */
+static int plan_emit(type_plan *p, MPI_Datatype datatype, MPI_Aint off,
+		     int n) {
+	type_desc *t = type_get(datatype);
+	type_plan *child;
+	type_run *r;
+	int i, j, err;
+
+	if (!t)
+		return plan_add(p, off, n * sizeof_datatype(datatype), 1, 0);
+
+	child = type_plan_of(t);
+	if (!child)
+		return MPI_ERR_OTHER;
+
+	if (child->dense)
+		return plan_add(p, off + t->lb, n * t->size, 1, 0);
+
+	//One run per instance loops over the instances
+	if (child->nruns == 1 && child->runs[0].count == 1)
+		return plan_add(p, off + child->runs[0].off, child->runs[0].len,
+				n, t->extent);
+
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < child->nruns; i++) {
+			r = &child->runs[i];
+			err = plan_add(p, off + j * t->extent + r->off, r->len,
+				       r->count, r->stride);
+			if (err)
+				return err;
+		}
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Compile a datatype's copy plan if it has none yet
+ */
+static type_plan *type_plan_of(type_desc *t) {
+	type_plan *p;
+	int i;
+
+	if (t->plan)
+		return t->plan;
+
+	p = calloc(1, sizeof(type_plan));
+	if (!p)
+		return NULL;
+
+	for (i = 0; i < t->count; i++) {
+		if (plan_emit(p, t->types[i], t->disps[i], t->blocklens[i])) {
+			free(p->runs);
+			free(p);
+			return NULL;
+		}
+	}
+
+	p->dense = t->size == (size_t) t->extent &&
+		   (!p->nruns || (p->nruns == 1 && p->runs[0].count == 1 &&
+				  p->runs[0].off == t->lb));
+	t->plan = p;
+
+	return p;
+}
+
+/**
+ * Returns 1 if count instances of datatype are one contiguous run
+ */
+int type_dense(MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+
+	if (!t)
+		return 1;
+
+	return t->committed && t->plan->dense;
+}
+
+//Walk every run of a plan; the common element widths get a constant
+//length so the compiler can inline the copy
+#define PLAN_COPY(p, base, packed, pack) do {				\
+	type_run *r;							\
+	char *at;							\
+	int i, k;							\
+	for (i = 0; i < (p)->nruns; i++) {				\
+		r = &(p)->runs[i];					\
+		at = (base) + r->off;					\
+		if (r->len == 8) {					\
+			for (k = 0; k < r->count; k++, at += r->stride) { \
+				memcpy((pack) ? (packed) : at,		\
+				       (pack) ? at : (packed), 8);	\
+				(packed) += 8;				\
+			}						\
+		} else if (r->len == 4) {				\
+			for (k = 0; k < r->count; k++, at += r->stride) { \
+				memcpy((pack) ? (packed) : at,		\
+				       (pack) ? at : (packed), 4);	\
+				(packed) += 4;				\
+			}						\
+		} else {						\
+			for (k = 0; k < r->count; k++, at += r->stride) { \
+				memcpy((pack) ? (packed) : at,		\
+				       (pack) ? at : (packed), r->len);	\
+				(packed) += r->len;			\
+			}						\
+		}							\
+	}								\
+} while (0)
+
+/**
+ * Pack count instances of datatype from inbuf into contiguous outbuf
+ */
+int type_pack(void *inbuf, int count, MPI_Datatype datatype, void *outbuf) {
+	type_desc *t = type_get(datatype);
+	char *out = outbuf;
+	int c;
+
+	if (!t) {
+		memcpy(outbuf, inbuf, count * sizeof_datatype(datatype));
+		return MPI_SUCCESS;
+	}
+
+	if (!t->committed)
+		return MPI_ERR_TYPE;
+
+	if (t->plan->dense) {
+		memcpy(outbuf, (char *)inbuf + t->lb, count * t->size);
+		return MPI_SUCCESS;
+	}
+
+	for (c = 0; c < count; c++) {
+		PLAN_COPY(t->plan, (char *)inbuf + c * t->extent, out, 1);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Unpack as many whole instances of datatype as bytes of inbuf hold,
+ * up to count, into outbuf
+ */
+int type_unpack(void *inbuf, size_t bytes, void *outbuf, int count,
+		MPI_Datatype datatype) {
+	type_desc *t = type_get(datatype);
+	char *in = inbuf;
+	size_t size;
+	int c;
+
+	size = type_size(datatype);
+	if (size && bytes < count * size)
+		count = bytes / size;
+
+	if (!t) {
+		memcpy(outbuf, inbuf, count * size);
+		return MPI_SUCCESS;
+	}
+
+	if (!t->committed)
+		return MPI_ERR_TYPE;
+
+	if (t->plan->dense) {
+		memcpy((char *)outbuf + t->lb, inbuf, count * size);
+		return MPI_SUCCESS;
+	}
+
+	for (c = 0; c < count; c++) {
+		PLAN_COPY(t->plan, (char *)outbuf + c * t->extent, in, 0);
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Free every datatype at MPI_Finalize
+ */
+void type_finalize() {
+	type_desc *t;
+	int h;
+
+	for (h = 0; h < ntypes; h++) {
+		t = types[h];
+		if (!t)
+			continue;
+
+		if (t->plan)
+			free(t->plan->runs);
+		free(t->plan);
+		free(t->blocklens);
+		free(t->disps);
+		free(t->types);
+		free(t);
+	}
+
+	free(types);
+	types = NULL;
+	ntypes = 0;
+}
+
+/**
+ * count instances of oldtype one after another
+ */
+int MPI_Type_contiguous(int count, MPI_Datatype oldtype,
+			MPI_Datatype *newtype) {
+	type_desc *t;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	if (!type_valid(oldtype) || !newtype)
+		return MPI_ERR_TYPE;
+
+	t = type_new(TYPE_CONTIGUOUS, 1);
+	if (!t)
+		return MPI_ERR_OTHER;
+
+	t->blocklens[0] = count;
+	t->disps[0] = 0;
+	t->types[0] = oldtype;
+
+	return type_finish(t, newtype);
+}
+
+/**
+ * count blocks of blocklength instances, stride instances apart
+ */
+int MPI_Type_vector(int count, int blocklength, int stride,
+		    MPI_Datatype oldtype, MPI_Datatype *newtype) {
+	MPI_Aint lb, extent;
+	type_desc *t;
+	int i;
+
+	if (count < 0 || blocklength < 0)
+		return MPI_ERR_COUNT;
+
+	if (!type_valid(oldtype) || !newtype)
+		return MPI_ERR_TYPE;
+
+	t = type_new(TYPE_VECTOR, count);
+	if (!t)
+		return MPI_ERR_OTHER;
+
+	extent = type_extent(oldtype, &lb);
+	for (i = 0; i < count; i++) {
+		t->blocklens[i] = blocklength;
+		t->disps[i] = (MPI_Aint) i * stride * extent;
+		t->types[i] = oldtype;
+	}
+
+	return type_finish(t, newtype);
+}
+
+/**
+ * Blocks of instances at displacements counted in instances
+ */
+int MPI_Type_indexed(int count, int *array_of_blocklengths,
+		     int *array_of_displacements, MPI_Datatype oldtype,
+		     MPI_Datatype *newtype) {
+	MPI_Aint lb, extent;
+	type_desc *t;
+	int i;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	if (!type_valid(oldtype) || !newtype)
+		return MPI_ERR_TYPE;
+
+	if (count && (!array_of_blocklengths || !array_of_displacements))
+		return MPI_ERR_ARG;
+
+	for (i = 0; i < count; i++) {
+		if (array_of_blocklengths[i] < 0)
+			return MPI_ERR_COUNT;
+	}
+
+	t = type_new(TYPE_INDEXED, count);
+	if (!t)
+		return MPI_ERR_OTHER;
+
+	extent = type_extent(oldtype, &lb);
+	for (i = 0; i < count; i++) {
+		t->blocklens[i] = array_of_blocklengths[i];
+		t->disps[i] = (MPI_Aint) array_of_displacements[i] * extent;
+		t->types[i] = oldtype;
+	}
+
+	return type_finish(t, newtype);
+}
+
+/**
+ * Blocks of any types at byte displacements
+ */
+int MPI_Type_create_struct(int count, int *array_of_blocklengths,
+			   MPI_Aint *array_of_displacements,
+			   MPI_Datatype *array_of_types,
+			   MPI_Datatype *newtype) {
+	type_desc *t;
+	int i;
+
+	if (count < 0)
+		return MPI_ERR_COUNT;
+
+	if (!newtype)
+		return MPI_ERR_TYPE;
+
+	if (count && (!array_of_blocklengths || !array_of_displacements ||
+		      !array_of_types))
+		return MPI_ERR_ARG;
+
+	for (i = 0; i < count; i++) {
+		if (array_of_blocklengths[i] < 0)
+			return MPI_ERR_COUNT;
+		if (!type_valid(array_of_types[i]))
+			return MPI_ERR_TYPE;
+	}
+
+	t = type_new(TYPE_STRUCT, count);
+	if (!t)
+		return MPI_ERR_OTHER;
+
+	for (i = 0; i < count; i++) {
+		t->blocklens[i] = array_of_blocklengths[i];
+		t->disps[i] = array_of_displacements[i];
+		t->types[i] = array_of_types[i];
+	}
+
+	return type_finish(t, newtype);
+}
+
+/**
+ * A subarray of an ndims array of oldtype, as one block per row of the
+ * fastest varying dimension; the extent is the whole array
+ */
+int MPI_Type_create_subarray(int ndims, int *array_of_sizes,
+			     int *array_of_subsizes, int *array_of_starts,
+			     int order, MPI_Datatype oldtype,
+			     MPI_Datatype *newtype) {
+	MPI_Aint lb, extent, *step, elems, off;
+	type_desc *t;
+	int d, r, s, rows, fast, *idx;
+
+	if (ndims <= 0 || !array_of_sizes || !array_of_subsizes ||
+	    !array_of_starts)
+		return MPI_ERR_ARG;
+
+	if (order != MPI_ORDER_C && order != MPI_ORDER_FORTRAN)
+		return MPI_ERR_ARG;
+
+	if (!type_valid(oldtype) || !newtype)
+		return MPI_ERR_TYPE;
+
+	for (d = 0; d < ndims; d++) {
+		if (array_of_sizes[d] <= 0 || array_of_subsizes[d] <= 0 ||
+		    array_of_starts[d] < 0 ||
+		    array_of_starts[d] + array_of_subsizes[d] > array_of_sizes[d])
+			return MPI_ERR_ARG;
+	}
+
+	fast = order == MPI_ORDER_C ? ndims - 1 : 0;
+	rows = 1;
+	for (d = 0; d < ndims; d++) {
+		if (d != fast)
+			rows *= array_of_subsizes[d];
+	}
+
+	step = malloc(sizeof(MPI_Aint) * ndims);
+	idx = calloc(ndims, sizeof(int));
+	t = type_new(TYPE_SUBARRAY, rows);
+	if (!step || !idx || !t) {
+		free(step);
+		free(idx);
+		if (t) {
+			free(t->blocklens);
+			free(t->disps);
+			free(t->types);
+			free(t);
+		}
+		return MPI_ERR_OTHER;
+	}
+
+	//Elements between neighbours along each dimension
+	elems = 1;
+	for (d = 0; d < ndims; d++) {
+		r = order == MPI_ORDER_C ? ndims - 1 - d : d;
+		step[r] = elems;
+		elems *= array_of_sizes[r];
+	}
+
+	extent = type_extent(oldtype, &lb);
+	for (r = 0; r < rows; r++) {
+		off = 0;
+		for (d = 0; d < ndims; d++) {
+			off += (array_of_starts[d] + idx[d]) * step[d];
+		}
+
+		t->blocklens[r] = array_of_subsizes[fast];
+		t->disps[r] = off * extent;
+		t->types[r] = oldtype;
+
+		//Next row, the slower dimensions counting like an odometer
+		for (d = 0; d < ndims - 1; d++) {
+			s = order == MPI_ORDER_C ? ndims - 2 - d : d + 1;
+			if (++idx[s] < array_of_subsizes[s])
+				break;
+			idx[s] = 0;
+		}
+	}
+
+	free(step);
+	free(idx);
+
+	t->lb = lb;
+	t->extent = elems * extent;
+
+	return type_finish(t, newtype);
+}
+
+/**
+ * Compile a datatype's copy plan so it can be used for communication
+ */
+int MPI_Type_commit(MPI_Datatype *datatype) {
+	type_desc *t;
+
+	if (!datatype || !type_valid(*datatype))
+		return MPI_ERR_TYPE;
+
+	t = type_get(*datatype);
+	if (!t)
+		return MPI_SUCCESS;
+
+	if (!type_plan_of(t))
+		return MPI_ERR_OTHER;
+
+	t->committed = 1;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Free a derived datatype; types built from it stay usable
+ */
+int MPI_Type_free(MPI_Datatype *datatype) {
+	if (!datatype || !type_get(*datatype))
+		return MPI_ERR_TYPE;
+
+	type_release(*datatype);
+	*datatype = MPI_DATATYPE_NULL;
+
+	return MPI_SUCCESS;
+}
+
+int MPI_Type_size(MPI_Datatype datatype, int *size) {
+	if (!type_valid(datatype))
+		return MPI_ERR_TYPE;
+
+	if (!size)
+		return MPI_ERR_ARG;
+
+	*size = type_size(datatype);
+
+	return MPI_SUCCESS;
+}
+
+int MPI_Type_get_extent(MPI_Datatype datatype, MPI_Aint *lb,
+			MPI_Aint *extent) {
+	if (!type_valid(datatype))
+		return MPI_ERR_TYPE;
+
+	if (!lb || !extent)
+		return MPI_ERR_ARG;
+
+	*extent = type_extent(datatype, lb);
+
+	return MPI_SUCCESS;
+}
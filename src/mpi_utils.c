@@ -1,30 +1,179 @@
+/*
+  Predefined datatypes
+
+  Each basic datatype has a constant descriptor giving its size,
+  alignment and kind, the kernel combining arrays of it and, where the
+  UPC collectives library has one, its reduction.  Everything that
+  needs to know about a datatype indexes the table instead of testing
+  the handle against each type in turn.
+*/
+
+#include <stddef.h>
 #include "mpi.h"
+#include "upc_type.h"
+
+//Alignment of a C type
+#define ALIGNOF(ctype) offsetof(struct { char c; ctype x; }, x)
+
+//Value and index pairs for MPI_MINLOC and MPI_MAXLOC
+typedef struct { float v; int i; } float_int;
+typedef struct { double v; int i; } double_int;
+typedef struct { long v; int i; } long_int;
+typedef struct { int v; int i; } two_int;
+typedef struct { short v; int i; } short_int;
+typedef struct { long double v; int i; } long_double_int;
+
+//Apply op element-wise to count elements of type ctype
+#define REDUCE_LOCAL(ctype, inout, in, count, op) do {		\
+	ctype *a = (ctype *)(inout);					\
+	ctype *b = (ctype *)(in);					\
+	int j;								\
+	for (j = 0; j < (count); j++) {					\
+		if ((op) == MPI_SUM)					\
+			a[j] += b[j];					\
+		else if ((op) == MPI_MAX && b[j] > a[j])		\
+			a[j] = b[j];					\
+		else if ((op) == MPI_MIN && b[j] < a[j])		\
+			a[j] = b[j];					\
+	}								\
+} while (0)
+
+//Keep the smaller or larger value of each pair, and the lower index
+//when the values are equal
+#define REDUCE_PAIR(ptype, inout, in, count, op) do {			\
+	ptype *a = (ptype *)(inout);					\
+	ptype *b = (ptype *)(in);					\
+	int j;								\
+	for (j = 0; j < (count); j++) {					\
+		if ((op) == MPI_MINLOC ? b[j].v < a[j].v : b[j].v > a[j].v) \
+			a[j] = b[j];					\
+		else if (b[j].v == a[j].v && b[j].i < a[j].i)		\
+			a[j].i = b[j].i;				\
+	}								\
+} while (0)
+
+//The combine kernel of a numeric type
+#define COMBINE(name, ctype)						\
+static int combine_##name(void *inout, void *in, int count, MPI_Op op) { \
+	if (op != MPI_SUM && op != MPI_MAX && op != MPI_MIN)		\
+		return MPI_ERR_OP;					\
+	REDUCE_LOCAL(ctype, inout, in, count, op);			\
+	return MPI_SUCCESS;						\
+}
+
+//The combine kernel of a pair type
+#define COMBINE_PAIR(name, ptype)					\
+static int combine_##name(void *inout, void *in, int count, MPI_Op op) { \
+	if (op != MPI_MINLOC && op != MPI_MAXLOC)			\
+		return MPI_ERR_OP;					\
+	REDUCE_PAIR(ptype, inout, in, count, op);			\
+	return MPI_SUCCESS;						\
+}
+
+//The UPC library reduction of one element per thread
+#define UPC_REDUCE(T)							\
+static void upc_reduce##T(shared void *dst, shared void *src, MPI_Op op) { \
+	upc_all_reduce##T(dst, src, op, THREADS, 1, NULL,		\
+			  UPC_IN_NOSYNC | UPC_OUT_ALLSYNC);		\
+}
+
+COMBINE(schar, signed char)
+COMBINE(uchar, unsigned char)
+COMBINE(short, short)
+COMBINE(ushort, unsigned short)
+COMBINE(int, int)
+COMBINE(uint, unsigned int)
+COMBINE(long, long)
+COMBINE(ulong, unsigned long)
+COMBINE(llong, long long)
+COMBINE(ullong, unsigned long long)
+COMBINE(float, float)
+COMBINE(double, double)
+COMBINE(ldouble, long double)
+COMBINE(int8, int8_t)
+COMBINE(uint8, uint8_t)
+COMBINE(int16, int16_t)
+COMBINE(uint16, uint16_t)
+COMBINE(int32, int32_t)
+COMBINE(uint32, uint32_t)
+COMBINE(int64, int64_t)
+COMBINE(uint64, uint64_t)
+COMBINE_PAIR(float_int, float_int)
+COMBINE_PAIR(double_int, double_int)
+COMBINE_PAIR(long_int, long_int)
+COMBINE_PAIR(two_int, two_int)
+COMBINE_PAIR(short_int, short_int)
+COMBINE_PAIR(long_double_int, long_double_int)
+
+UPC_REDUCE(C)
+UPC_REDUCE(UC)
+UPC_REDUCE(S)
+UPC_REDUCE(US)
+UPC_REDUCE(I)
+UPC_REDUCE(UI)
+UPC_REDUCE(L)
+UPC_REDUCE(UL)
+UPC_REDUCE(F)
+UPC_REDUCE(D)
+UPC_REDUCE(LD)
 
-//Return the size, in bytes, of the MPI datatype
+#define BASIC(ctype, class, combine, upc_reduce)			\
+	{ sizeof(ctype), ALIGNOF(ctype), class, combine, upc_reduce }
+
+static const type_basic type_basics[TYPE_BASICS] = {
+	[MPI_BYTE] = BASIC(unsigned char, TYPE_CLASS_BYTE, combine_uchar, upc_reduceUC),
+	[MPI_PACKED] = BASIC(char, TYPE_CLASS_BYTE, NULL, NULL),
+	[MPI_CHAR] = BASIC(char, TYPE_CLASS_INT, combine_schar, upc_reduceC),
+	[MPI_SHORT] = BASIC(short, TYPE_CLASS_INT, combine_short, upc_reduceS),
+	[MPI_INT] = BASIC(int, TYPE_CLASS_INT, combine_int, upc_reduceI),
+	[MPI_LONG] = BASIC(long, TYPE_CLASS_INT, combine_long, upc_reduceL),
+	[MPI_FLOAT] = BASIC(float, TYPE_CLASS_FLOAT, combine_float, upc_reduceF),
+	[MPI_DOUBLE] = BASIC(double, TYPE_CLASS_FLOAT, combine_double, upc_reduceD),
+	[MPI_LONG_DOUBLE] = BASIC(long double, TYPE_CLASS_FLOAT, combine_ldouble, upc_reduceLD),
+	[MPI_UNSIGNED_CHAR] = BASIC(unsigned char, TYPE_CLASS_UINT, combine_uchar, upc_reduceUC),
+	[MPI_SIGNED_CHAR] = BASIC(signed char, TYPE_CLASS_INT, combine_schar, upc_reduceC),
+	[MPI_UNSIGNED_SHORT] = BASIC(unsigned short, TYPE_CLASS_UINT, combine_ushort, upc_reduceUS),
+	[MPI_UNSIGNED_LONG] = BASIC(unsigned long, TYPE_CLASS_UINT, combine_ulong, upc_reduceUL),
+	[MPI_UNSIGNED] = BASIC(unsigned int, TYPE_CLASS_UINT, combine_uint, upc_reduceUI),
+	[MPI_LONG_INT] = BASIC(long_int, TYPE_CLASS_PAIR, combine_long_int, NULL),
+	[MPI_SHORT_INT] = BASIC(short_int, TYPE_CLASS_PAIR, combine_short_int, NULL),
+	[MPI_LONG_LONG_INT] = BASIC(long long, TYPE_CLASS_INT, combine_llong, NULL),
+	[MPI_LONG_LONG] = BASIC(long long, TYPE_CLASS_INT, combine_llong, NULL),
+	[MPI_UNSIGNED_LONG_LONG] = BASIC(unsigned long long, TYPE_CLASS_UINT, combine_ullong, NULL),
+	[MPI_DOUBLE_INT] = BASIC(double_int, TYPE_CLASS_PAIR, combine_double_int, NULL),
+	[MPI_FLOAT_INT] = BASIC(float_int, TYPE_CLASS_PAIR, combine_float_int, NULL),
+	[MPI_2INT] = BASIC(two_int, TYPE_CLASS_PAIR, combine_two_int, NULL),
+	[MPI_LONG_DOUBLE_INT] = BASIC(long_double_int, TYPE_CLASS_PAIR, combine_long_double_int, NULL),
+	[MPI_INT8_T] = BASIC(int8_t, TYPE_CLASS_INT, combine_int8, upc_reduceC),
+	[MPI_UINT8_T] = BASIC(uint8_t, TYPE_CLASS_UINT, combine_uint8, upc_reduceUC),
+	[MPI_INT16_T] = BASIC(int16_t, TYPE_CLASS_INT, combine_int16, upc_reduceS),
+	[MPI_UINT16_T] = BASIC(uint16_t, TYPE_CLASS_UINT, combine_uint16, upc_reduceUS),
+	[MPI_INT32_T] = BASIC(int32_t, TYPE_CLASS_INT, combine_int32, NULL),
+	[MPI_UINT32_T] = BASIC(uint32_t, TYPE_CLASS_UINT, combine_uint32, NULL),
+	[MPI_INT64_T] = BASIC(int64_t, TYPE_CLASS_INT, combine_int64, NULL),
+	[MPI_UINT64_T] = BASIC(uint64_t, TYPE_CLASS_UINT, combine_uint64, NULL),
+};
+
+/**
+ * Find the descriptor of a basic datatype, or NULL for any other handle
+ */
+const type_basic *type_basic_of(MPI_Datatype datatype) {
+	if (datatype < 0 || datatype >= TYPE_BASICS)
+		return NULL;
+
+	return &type_basics[datatype];
+}
+
+//Return the size, in bytes, of the MPI datatype, or 0 if it is unknown
 size_t sizeof_datatype(int datatype) {
-	size_t ret = 0;
-
-	if (datatype == MPI_BYTE || datatype == MPI_CHAR || 
-	    datatype == MPI_SIGNED_CHAR) {
-		ret = sizeof(char);
-	} else if (datatype == MPI_SHORT || datatype == MPI_SHORT_INT || 
-		   datatype == MPI_UNSIGNED_SHORT ) {
-		ret = sizeof(short int);
-	} else if (datatype == MPI_INT || datatype == MPI_UNSIGNED) {
-		ret = sizeof(int);
-	} else if (datatype == MPI_LONG) {
-		ret = sizeof(long);
-	} else if (datatype == MPI_FLOAT) {
-		ret = sizeof(float);
-	} else if (datatype == MPI_DOUBLE) {
-		ret = sizeof(double);
-	} else if (datatype == MPI_PACKED) {
-		ret = 1;
-	} else {
-		ret = sizeof(uint64_t);
-	}
-
-	return ret;	
+	type_desc *t;
+
+	if (datatype >= 0 && datatype < TYPE_BASICS)
+		return type_basics[datatype].size;
+
+	t = type_get(datatype);
+
+	return t ? t->size : 0;
 }
 
 int MPI_Errhandler_set(MPI_Comm comm, MPI_Errhandler errhandler) {
@@ -32,3 +181,19 @@ int MPI_Errhandler_set(MPI_Comm comm, MPI_Errhandler errhandler) {
 
 	return MPI_SUCCESS;
 }
+
+/**
+ * Combine count elements of in into inout according to op
+ * A count of 0 only validates the datatype and op
+ */
+int reduce_local(void *inout, void *in, int count, int datatype, int op) {
+	const type_basic *b = type_basic_of(datatype);
+
+	if (!b)
+		return MPI_ERR_TYPE;
+
+	if (!b->combine)
+		return MPI_ERR_OP;
+
+	return b->combine(inout, in, count, op);
+}
@@ -0,0 +1,269 @@
+/*
+  Asynchronous file I/O
+
+  MPI_File_iwrite and MPI_File_iread queue a job to a pool of worker
+  threads owned by the calling UPC thread and return at once, so a
+  checkpoint write overlaps the computation that follows it.  The
+  request completes through MPI_Test, MPI_Wait or MPI_Waitall.
+
+  The workers are plain POSIX threads, not UPC threads.  Under the
+  pthreads runtime every global of this file belongs to the UPC thread
+  that declared it, so a worker only touches the pool it was started
+  with and the jobs on it, and never calls into the UPC runtime.
+*/
+
+#include <upc.h>
+#include <pthread.h>
+#include "mpi.h"
+#include "upc_type.h"
+#include "upc_aio.h"
+
+//The worker pool of one UPC thread
+typedef struct aio_pool aio_pool;
+struct aio_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		//a job was queued, or the pool is stopping
+	pthread_cond_t done;		//a job completed
+	aio_job *head;
+	aio_job *tail;
+	pthread_t *workers;
+	int nworkers;
+	int stop;
+};
+
+static aio_pool *pool;
+
+/**
+ * Run queued jobs until the pool stops and its queue is empty
+ */
+static void *aio_worker(void *arg) {
+	aio_pool *p = arg;
+	aio_job *job;
+	ssize_t result;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->head && !p->stop) {
+			pthread_cond_wait(&p->work, &p->lock);
+		}
+
+		job = p->head;
+		if (!job)
+			break;
+
+		p->head = job->next;
+		if (!p->head)
+			p->tail = NULL;
+		pthread_mutex_unlock(&p->lock);
+
+		result = job->run(job);
+
+		pthread_mutex_lock(&p->lock);
+		job->result = result;
+		job->done = 1;
+		(*job->pending)--;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/**
+ * Start the pool on first use
+ * Returns NULL if no worker could be started
+ */
+static aio_pool *aio_pool_get() {
+	char *env;
+	int i, n;
+
+	if (pool)
+		return pool;
+
+	n = AIO_THREADS;
+	env = getenv(AIO_THREADS_ENV);
+	if (env && atoi(env) > 0)
+		n = atoi(env);
+
+	pool = calloc(1, sizeof(aio_pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = malloc(sizeof(pthread_t) * n);
+	if (!pool->workers) {
+		free(pool);
+		pool = NULL;
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&pool->workers[pool->nworkers], NULL,
+				   aio_worker, pool) == 0)
+			pool->nworkers++;
+	}
+
+	if (!pool->nworkers) {
+		aio_finalize();
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Make a job moving count elements of datatype between buf and fh
+ * A derived datatype is packed now for a write, or unpacked when a
+ * read completes
+ */
+aio_job *aio_job_new(MPI_File fh, void *buf, int count,
+		     MPI_Datatype datatype, int write) {
+	type_desc *t = type_get(datatype);
+	aio_job *job;
+
+	job = calloc(1, sizeof(aio_job));
+	if (!job)
+		return NULL;
+
+	job->size = count * sizeof_datatype(datatype);
+	job->pending = &fh->pending;
+	job->buf = buf;
+	if (t && type_dense(datatype)) {
+		job->buf = (char *)buf + t->lb;
+	} else if (t) {
+		job->packed = 1;
+		job->buf = malloc(job->size + 1);
+		if (!job->buf) {
+			free(job);
+			return NULL;
+		}
+
+		if (write) {
+			type_pack(buf, count, datatype, job->buf);
+		} else {
+			job->ubuf = buf;
+			job->count = count;
+			job->datatype = datatype;
+		}
+	}
+
+	return job;
+}
+
+/**
+ * Queue a job, or run it at once if no worker can be started
+ */
+int aio_submit(aio_job *job) {
+	aio_pool *p = aio_pool_get();
+
+	if (!p) {
+		job->result = job->run(job);
+		job->done = 1;
+		return MPI_SUCCESS;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	(*job->pending)++;
+	job->next = NULL;
+	if (p->tail)
+		p->tail->next = job;
+	else
+		p->head = job;
+	p->tail = job;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Returns 1 once a job has completed
+ */
+int aio_test(aio_job *job) {
+	int done;
+
+	if (!pool)
+		return job->done;
+
+	pthread_mutex_lock(&pool->lock);
+	done = job->done;
+	pthread_mutex_unlock(&pool->lock);
+
+	return done;
+}
+
+/**
+ * Sleep until a job has completed
+ */
+void aio_wait(aio_job *job) {
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Deliver a completed job and free it
+ * Returns the job's error code
+ */
+int aio_finish(aio_job *job) {
+	int err;
+
+	err = job->result < 0 ? MPI_ERR_OTHER : MPI_SUCCESS;
+	if (!err && job->ubuf)
+		type_unpack(job->buf, job->result, job->ubuf, job->count,
+			    job->datatype);
+
+	if (job->packed)
+		free(job->buf);
+	free(job->segs);
+	free(job);
+
+	return err;
+}
+
+/**
+ * Wait for every operation queued on fh to complete
+ */
+void aio_drain(MPI_File fh) {
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	while (fh->pending) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Finish the queued jobs and stop the workers
+ */
+void aio_finalize() {
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pthread_join(pool->workers[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+	pool = NULL;
+}
@@ -0,0 +1,136 @@
+/*
+  Write-behind cache
+
+  With the write_behind hint each thread keeps a buffer over one aligned
+  chunk of the file.  Independent writes smaller than the buffer are
+  copied into it and merged with the dirty runs they touch or overlap,
+  so a stream of small appended records reaches the backend as one
+  aligned write of the whole chunk once it fills.
+
+  Every other access on the thread first flushes the dirty runs it
+  overlaps, so reads see the thread's own writes and later writes are
+  not overtaken by older cached ones.  MPI_File_sync, MPI_File_close,
+  MPI_File_set_size and collective accesses flush everything.
+*/
+
+#include <string.h>
+#include "mpi.h"
+#include "upc_file.h"
+
+/**
+ * Flush the dirty runs overlapping [off, off + len), or every run if
+ * len is negative
+ */
+int file_cache_flush(MPI_File fh, MPI_Offset off, MPI_Offset len) {
+	file_cache *c = fh->cache;
+	file_seg *r;
+	int i, n = 0, err = MPI_SUCCESS;
+
+	if (!c || !c->nruns)
+		return MPI_SUCCESS;
+
+	//Nothing cached in the range
+	if (len >= 0 && (off >= c->runs[c->nruns - 1].off +
+			 c->runs[c->nruns - 1].len || off + len <= c->runs[0].off))
+		return MPI_SUCCESS;
+
+	for (i = 0; i < c->nruns; i++) {
+		r = &c->runs[i];
+		if (len < 0 || (r->off < off + len && off < r->off + r->len)) {
+			if (file_pio(fh, c->buf + (r->off - c->base), r->len,
+				     r->off, 1) != r->len)
+				err = MPI_ERR_OTHER;
+		} else {
+			c->runs[n++] = *r;
+		}
+	}
+	c->nruns = n;
+
+	return err;
+}
+
+/**
+ * Add [off, off + size) to the dirty runs, joining the runs it touches
+ */
+static void cache_mark(file_cache *c, MPI_Offset off, MPI_Offset size) {
+	MPI_Offset end = off + size;
+	int i, j;
+
+	//The first run ending at or after off, and the first starting after end
+	for (i = 0; i < c->nruns && c->runs[i].off + c->runs[i].len < off; i++)
+		;
+	for (j = i; j < c->nruns && c->runs[j].off <= end; j++)
+		;
+
+	if (i < j) {
+		if (c->runs[i].off < off)
+			off = c->runs[i].off;
+		if (c->runs[j - 1].off + c->runs[j - 1].len > end)
+			end = c->runs[j - 1].off + c->runs[j - 1].len;
+	}
+
+	memmove(&c->runs[i + 1], &c->runs[j], sizeof(file_seg) * (c->nruns - j));
+	c->nruns += 1 - (j - i);
+	c->runs[i].off = off;
+	c->runs[i].len = end - off;
+}
+
+/**
+ * Cache a small write
+ * Returns 1 if the write was cached, 0 if the caller must write it
+ * through, or -1 if flushing the cache failed
+ */
+int file_cache_write(MPI_File fh, void *buf, size_t size, MPI_Offset off) {
+	file_cache *c = fh->cache;
+
+	if (!fh->write_behind || size >= fh->write_behind)
+		return 0;
+
+	if (!c) {
+		c = calloc(1, sizeof(file_cache));
+		if (!c)
+			return 0;
+
+		c->cap = fh->write_behind;
+		c->buf = malloc(c->cap);
+		if (!c->buf) {
+			free(c);
+			return 0;
+		}
+		fh->cache = c;
+	}
+
+	//Move to the chunk of the write, or make room for a new run
+	if (c->nruns && (off < c->base || off + size > c->base + c->cap ||
+			 c->nruns == FILE_CACHE_RUNS)) {
+		if (file_cache_flush(fh, 0, -1))
+			return -1;
+	}
+
+	if (!c->nruns)
+		c->base = off - off % c->cap;
+
+	//A write across the end of the chunk goes through
+	if (off + size > c->base + c->cap)
+		return 0;
+
+	memcpy(c->buf + (off - c->base), buf, size);
+	cache_mark(c, off, size);
+
+	//A full chunk is written at once
+	if (c->nruns == 1 && c->runs[0].len == c->cap) {
+		if (file_cache_flush(fh, 0, -1))
+			return -1;
+	}
+
+	return 1;
+}
+
+void file_cache_free(MPI_File fh) {
+	if (!fh->cache)
+		return;
+
+	free(fh->cache->buf);
+	free(fh->cache);
+	fh->cache = NULL;
+}
@@ -0,0 +1,502 @@
+/*
+  Collectives over a group of threads
+
+  Every member of a group owns a synchronization block with affinity to
+  itself.  Members signal each other by writing epochs into the flags of
+  those blocks and exchange data through the scratch buffer each member
+  publishes in its block, so a group never needs upc_barrier or
+  upc_all_alloc and only its members take part.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+
+/**
+ * Allocate and reset a synchronization block with affinity to MYTHREAD
+ */
+group_sync_ptr group_sync_alloc() {
+	group_sync_ptr s;
+	int i;
+
+	s = upc_alloc(sizeof(group_sync));
+	if (!s)
+		return NULL;
+
+	for (i = 0; i < GROUP_ROUNDS; i++) {
+		s->flag[0][i] = 0;
+		s->flag[1][i] = 0;
+	}
+
+	for (i = 0; i < NBC_SLOTS; i++) {
+		s->nbc[i].seq = -1;
+		s->nbc[i].ack = -1;
+		s->nbc[i].data = NULL;
+	}
+
+	s->nbr_ready = 0;
+	s->scratch_size = 0;
+	s->scratch = NULL;
+
+	return s;
+}
+
+/**
+ * Create a group from its member threads and their sync blocks
+ * Returns NULL if MYTHREAD is not a member
+ */
+coll_group *group_new(int size, int *threads, group_sync_ptr *sync) {
+	coll_group *g;
+	int i;
+
+	g = malloc(sizeof(coll_group));
+	if (!g)
+		return NULL;
+
+	g->size = size;
+	g->rank = -1;
+	g->epoch = 0;
+	g->nbc_seq = 0;
+	memset(g->nbc_owner, 0, sizeof(g->nbc_owner));
+	g->threads = malloc(sizeof(int) * size);
+	g->sync = malloc(sizeof(group_sync_ptr) * size);
+	if (!g->threads || !g->sync) {
+		free(g->threads);
+		free(g->sync);
+		free(g);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		g->threads[i] = threads[i];
+		g->sync[i] = sync[i];
+		if (threads[i] == MYTHREAD)
+			g->rank = i;
+	}
+
+	if (g->rank < 0) {
+		free(g->threads);
+		free(g->sync);
+		free(g);
+		return NULL;
+	}
+
+	return g;
+}
+
+/**
+ * Free a group once every member has stopped using it
+ */
+void group_free(coll_group *g) {
+	group_sync_ptr mine;
+
+	if (!g)
+		return;
+
+	group_barrier(g);
+	mine = g->sync[g->rank];
+	if (mine->scratch)
+		upc_free(mine->scratch);
+
+	upc_free(mine);
+	free(g->threads);
+	free(g->sync);
+	free(g);
+}
+
+/**
+ * Return the rank of thread in the group, or -1
+ */
+int group_rank_of(coll_group *g, int thread) {
+	int i;
+
+	for (i = 0; i < g->size; i++) {
+		if (g->threads[i] == thread)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Return this thread's scratch buffer, growing it to at least size bytes
+ * Only called while no other member can be reading it
+ */
+shared [] char *group_scratch(coll_group *g, size_t size) {
+	group_sync_ptr mine;
+
+	mine = g->sync[g->rank];
+	if (mine->scratch_size >= size && mine->scratch)
+		return mine->scratch;
+
+	if (mine->scratch)
+		upc_free(mine->scratch);
+
+	mine->scratch = upc_alloc(size + 1);
+	mine->scratch_size = mine->scratch ? size : 0;
+
+	return mine->scratch;
+}
+
+/**
+ * Dissemination barrier among the members that also tells every member
+ * whether any of them failed
+ * A signal is the epoch, negated by a member that failed or heard of a
+ * failure, and alternates between two sets of flags so that it is read
+ * before the member sending it can reach the next barrier
+ * Progresses non-blocking collectives while it waits, since a member
+ * may only arrive once this thread's part of one is done
+ * Returns 1 if any member failed
+ */
+int group_agree(coll_group *g, int failed) {
+	group_sync_ptr mine;
+	int round, dist, epoch, parity, v;
+
+	epoch = ++g->epoch;
+	parity = epoch & 1;
+	mine = g->sync[g->rank];
+	for (round = 0, dist = 1; dist < g->size; round++, dist <<= 1) {
+		g->sync[(g->rank + dist) % g->size]->flag[parity][round] =
+			failed ? -epoch : epoch;
+		while ((v = mine->flag[parity][round]) != epoch && v != -epoch)
+			nbc_progress();
+
+		if (v < 0)
+			failed = 1;
+	}
+
+	return failed;
+}
+
+/**
+ * Dissemination barrier among the members
+ */
+void group_barrier(coll_group *g) {
+	group_agree(g, 0);
+}
+
+/*
+  In the collectives below a member whose part is missing, because its
+  scratch buffer or a buffer it was given is NULL, says so in the first
+  barrier.  Every member then skips the copies and returns the error.
+*/
+
+/**
+ * Broadcast size bytes from root
+ * Every member reads the root's scratch buffer
+ */
+int group_bcast(coll_group *g, void *buf, size_t size, int root) {
+	shared [] char *scratch;
+	int failed = size && !buf;
+
+	if (g->size == 1)
+		return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+
+	if (g->rank == root) {
+		scratch = group_scratch(g, size);
+		if (scratch && !failed)
+			memcpy((char *)scratch, buf, size);
+		else
+			failed = 1;
+	}
+
+	failed = group_agree(g, failed);
+	if (g->rank != root && !failed)
+		upc_memget(buf, g->sync[root]->scratch, size);
+
+	group_barrier(g);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Reduce count elements from every member into recvbuf on root
+ * The root combines the members' scratch buffers in rank order
+ * starting after itself
+ */
+int group_reduce(coll_group *g, void *sendbuf, void *recvbuf, int count,
+		 MPI_Datatype datatype, MPI_Op op, int root) {
+	shared [] char *scratch;
+	size_t size;
+	char *tmp;
+	int i, peer;
+	int failed;
+
+	size = count * sizeof_datatype(datatype);
+	failed = size && (!sendbuf || (g->rank == root && !recvbuf));
+	if (g->rank != root) {
+		scratch = group_scratch(g, size);
+		if (scratch && !failed)
+			memcpy((char *)scratch, sendbuf, size);
+		else
+			failed = 1;
+	} else if (recvbuf != sendbuf && !failed) {
+		memcpy(recvbuf, sendbuf, size);
+	}
+
+	failed = group_agree(g, failed);
+	if (g->rank == root && g->size > 1 && !failed) {
+		tmp = malloc(size + 1);
+		for (i = 1; i < g->size && tmp; i++) {
+			peer = (root + i) % g->size;
+			upc_memget(tmp, g->sync[peer]->scratch, size);
+			reduce_local(recvbuf, tmp, count, datatype, op);
+		}
+
+		if (!tmp)
+			failed = 1;
+
+		free(tmp);
+	}
+
+	return group_agree(g, failed) ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Gather size bytes from every member into recvbuf on root, in rank order
+ */
+int group_gather(coll_group *g, void *sendbuf, size_t size,
+		 void *recvbuf, int root) {
+	shared [] char *scratch;
+	int i;
+	int failed;
+
+	failed = size && (!sendbuf || (g->rank == root && !recvbuf));
+	if (g->rank != root) {
+		scratch = group_scratch(g, size);
+		if (scratch && !failed)
+			memcpy((char *)scratch, sendbuf, size);
+		else
+			failed = 1;
+	} else if ((char *)recvbuf + root * size != sendbuf && !failed) {
+		memcpy((char *)recvbuf + root * size, sendbuf, size);
+	}
+
+	failed = group_agree(g, failed);
+	if (g->rank == root && !failed) {
+		for (i = 0; i < g->size; i++) {
+			if (i != root)
+				upc_memget((char *)recvbuf + i * size,
+					   g->sync[i]->scratch, size);
+		}
+	}
+
+	group_barrier(g);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Gather each member's block into recvbuf on every member, back to back
+ * in rank order
+ * Member i's block is sizes[i] bytes, or size if sizes is NULL
+ */
+static int group_allgather_blocks(coll_group *g, void *sendbuf,
+				  size_t *sizes, size_t size, void *recvbuf) {
+	shared [] char *scratch;
+	size_t off, n;
+	int i;
+	int failed;
+
+	n = sizes ? sizes[g->rank] : size;
+	failed = !recvbuf || (n && !sendbuf);
+	scratch = group_scratch(g, n);
+	if (scratch && !failed)
+		memcpy((char *)scratch, sendbuf, n);
+	else
+		failed = 1;
+
+	failed = group_agree(g, failed);
+	off = 0;
+	for (i = 0; i < g->size && !failed; i++) {
+		n = sizes ? sizes[i] : size;
+		if (i == g->rank && (char *)recvbuf + off != sendbuf)
+			memcpy((char *)recvbuf + off, sendbuf, n);
+		else if (i != g->rank)
+			upc_memget((char *)recvbuf + off, g->sync[i]->scratch, n);
+
+		off += n;
+	}
+
+	group_barrier(g);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Gather sizes[i] bytes from each member i into recvbuf on every member
+ * The blocks are laid out back to back in rank order
+ */
+int group_allgatherv(coll_group *g, void *sendbuf, size_t *sizes,
+		     void *recvbuf) {
+	return group_allgather_blocks(g, sendbuf, sizes, 0, recvbuf);
+}
+
+/**
+ * Gather size bytes from every member into recvbuf on every member
+ */
+int group_allgather(coll_group *g, void *sendbuf, size_t size,
+		    void *recvbuf) {
+	return group_allgather_blocks(g, sendbuf, NULL, size, recvbuf);
+}
+
+/**
+ * Scatter size bytes to each member from consecutive blocks of the
+ * root's sendbuf
+ */
+int group_scatter(coll_group *g, void *sendbuf, size_t size,
+		  void *recvbuf, int root) {
+	shared [] char *scratch;
+	int failed;
+
+	failed = size && (!recvbuf || (g->rank == root && !sendbuf));
+	if (g->rank == root) {
+		scratch = group_scratch(g, g->size * size);
+		if (scratch && !failed) {
+			memcpy((char *)scratch, sendbuf, g->size * size);
+			if ((char *)sendbuf + root * size != recvbuf)
+				memcpy(recvbuf, (char *)sendbuf + root * size,
+				       size);
+		} else {
+			failed = 1;
+		}
+	}
+
+	failed = group_agree(g, failed);
+	if (g->rank != root && !failed)
+		upc_memget(recvbuf, g->sync[root]->scratch + g->rank * size, size);
+
+	group_barrier(g);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Exchange size bytes between every pair of members
+ * Block i of sendbuf goes to rank i and block i of recvbuf comes from
+ * it; sendbuf may be recvbuf since it is published before any block
+ * is received
+ */
+int group_alltoall(coll_group *g, void *sendbuf, size_t size,
+		   void *recvbuf) {
+	shared [] char *scratch;
+	int i, peer;
+	int failed;
+
+	failed = size && (!sendbuf || !recvbuf);
+	scratch = group_scratch(g, g->size * size);
+	if (scratch && !failed)
+		memcpy((char *)scratch, sendbuf, g->size * size);
+	else
+		failed = 1;
+
+	if (sendbuf != recvbuf && !failed)
+		memcpy((char *)recvbuf + g->rank * size,
+		       (char *)sendbuf + g->rank * size, size);
+
+	failed = group_agree(g, failed);
+	for (i = 1; i < g->size && !failed; i++) {
+		peer = (g->rank + i) % g->size;
+		upc_memget((char *)recvbuf + peer * size,
+			   g->sync[peer]->scratch + g->rank * size, size);
+	}
+
+	group_barrier(g);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Inclusive prefix reduction in rank order by recursive doubling
+ * In round k each member combines the partial result of the member
+ * 2^k ranks below it
+ */
+int group_scan(coll_group *g, void *sendbuf, void *recvbuf, int count,
+	       MPI_Datatype datatype, MPI_Op op) {
+	shared [] char *scratch;
+	size_t size;
+	char *tmp;
+	int dist;
+	int failed;
+
+	size = count * sizeof_datatype(datatype);
+	failed = size && (!sendbuf || !recvbuf);
+	if (recvbuf != sendbuf && !failed)
+		memcpy(recvbuf, sendbuf, size);
+
+	tmp = malloc(size + 1);
+	scratch = group_scratch(g, size);
+	if (!tmp || !scratch)
+		failed = 1;
+
+	//Every member hears of a failure in the first round
+	for (dist = 1; dist < g->size; dist <<= 1) {
+		if (!failed)
+			memcpy((char *)scratch, recvbuf, size);
+
+		failed = group_agree(g, failed);
+		if (g->rank >= dist && !failed)
+			upc_memget(tmp, g->sync[g->rank - dist]->scratch, size);
+
+		group_barrier(g);
+		if (g->rank >= dist && !failed)
+			reduce_local(recvbuf, tmp, count, datatype, op);
+	}
+
+	free(tmp);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Reduce the members' vectors element-wise and scatter the result so
+ * that rank i receives counts[i] elements
+ *
+ * Uses the pairwise algorithm: every member publishes its vector in
+ * its scratch buffer, then reads and combines only its own segment
+ * from each peer, starting with its right-hand neighbour so that no
+ * buffer is read by every member at once.
+ */
+int group_reduce_scatter(coll_group *g, void *sendbuf, void *recvbuf,
+			 int *counts, MPI_Datatype datatype, MPI_Op op) {
+	shared [] char *scratch;
+	size_t size, offset, total;
+	char *tmp;
+	int i, peer;
+	int failed;
+
+	size = sizeof_datatype(datatype);
+	total = 0;
+	offset = 0;
+	for (i = 0; i < g->size; i++) {
+		if (i == g->rank)
+			offset = total;
+		total += counts[i];
+	}
+
+	failed = total && (!sendbuf || (counts[g->rank] && !recvbuf));
+	tmp = malloc(counts[g->rank] * size + 1);
+	scratch = group_scratch(g, total * size);
+	if (!tmp || !scratch)
+		failed = 1;
+	if (!failed)
+		memcpy((char *)scratch, sendbuf, total * size);
+
+	failed = group_agree(g, failed);
+	if (!failed)
+		memmove(recvbuf, (char *)sendbuf + offset * size,
+			counts[g->rank] * size);
+
+	for (i = 1; i < g->size && !failed; i++) {
+		peer = (g->rank + i) % g->size;
+		upc_memget(tmp, g->sync[peer]->scratch + offset * size,
+			   counts[g->rank] * size);
+		reduce_local(recvbuf, tmp, counts[g->rank], datatype, op);
+	}
+
+	group_barrier(g);
+	free(tmp);
+
+	return failed ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
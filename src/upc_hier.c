@@ -0,0 +1,284 @@
+/*
+  Node-aware collectives
+
+  At MPI_Init the threads are split into nodes using the thread distance
+  reported by the runtime.  Within a communicator the member with the
+  lowest rank on each node leads it.  Each two-level collective runs an
+  intra-node phase in the node group, an inter-node phase among the
+  leaders and an intra-node fan-out, so only the leaders generate
+  network traffic.
+
+  A member that fails passes a NULL buffer to the next phase, which
+  fails it on every member of that group, so the error reaches every
+  member that waits on the result.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+
+int *node_of;
+
+/**
+ * Returns 1 if the two threads share a node
+ */
+static int same_node(int a, int b) {
+#ifdef __BERKELEY_UPC__
+	return bupc_thread_distance(a, b) <= BUPC_THREADS_NEAR;
+#else
+	return a == b;
+#endif
+}
+
+/**
+ * Number of members of comm on the node named node
+ */
+static int node_size(MPI_Comm comm, int node) {
+	int r, n;
+
+	n = 0;
+	for (r = 0; r < comm->size; r++) {
+		if (node_of[comm->threads[r]] == node)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * Rank in the leader group of the leader of node
+ */
+static int leader_rank(MPI_Comm comm, int node) {
+	int i;
+
+	for (i = 0; i < comm->leaders->size; i++) {
+		if (node_of[comm->leaders->threads[i]] == node)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Returns 1 if this thread can load and store thread's shared memory
+ * through an ordinary pointer
+ */
+int thread_castable(int thread) {
+#ifdef __BERKELEY_UPC__
+	return bupc_thread_castable(thread);
+#else
+	return thread == MYTHREAD;
+#endif
+}
+
+/**
+ * Local address of shared memory on a castable thread, or NULL
+ */
+void *thread_cast(shared void *ptr) {
+#ifdef __BERKELEY_UPC__
+	return bupc_cast(ptr);
+#else
+	if (upc_threadof(ptr) != MYTHREAD)
+		return NULL;
+
+	return (void *)ptr;
+#endif
+}
+
+/**
+ * Detect which threads share a node
+ */
+int hier_init() {
+	int t, u;
+
+	node_of = malloc(sizeof(int) * THREADS);
+	if (!node_of)
+		return 1;
+
+	//Each thread's node is named after the lowest thread on it
+	for (t = 0; t < THREADS; t++) {
+		node_of[t] = t;
+		for (u = 0; u < t; u++) {
+			if (node_of[u] == u && same_node(t, u)) {
+				node_of[t] = u;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Free the locality table
+ */
+void hier_finalize() {
+	free(node_of);
+	node_of = NULL;
+}
+
+/**
+ * Two-level barrier
+ * The node's arrival is known to its leader before the leaders
+ * synchronize, and the node is released after they have
+ */
+int hier_barrier(MPI_Comm comm) {
+	group_barrier(comm->node);
+	if (comm->leaders)
+		group_barrier(comm->leaders);
+
+	group_barrier(comm->node);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Two-level broadcast
+ * The root's node receives the data first so its leader can pass it to
+ * the other leaders, who then fan it out on their own nodes
+ */
+int hier_bcast(MPI_Comm comm, void *buf, size_t size, int root) {
+	int root_thread, root_node, err;
+
+	err = MPI_SUCCESS;
+	root_thread = comm->threads[root];
+	root_node = node_of[root_thread];
+	if (node_of[MYTHREAD] == root_node)
+		err |= group_bcast(comm->node, buf, size,
+				   group_rank_of(comm->node, root_thread));
+
+	if (comm->leaders)
+		err |= group_bcast(comm->leaders, err ? NULL : buf, size,
+				   leader_rank(comm, root_node));
+
+	if (node_of[MYTHREAD] != root_node)
+		err |= group_bcast(comm->node, err ? NULL : buf, size, 0);
+
+	return err ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Two-level reduce
+ * Leaders combine their node's contributions, the root's leader
+ * combines the leaders' partial results and hands the result to the
+ * root over its node
+ */
+int hier_reduce(MPI_Comm comm, void *sendbuf, void *recvbuf, int count,
+		MPI_Datatype datatype, MPI_Op op, int root) {
+	size_t size;
+	char *tmp;
+	int root_thread, root_node, on_root_node, err;
+
+	size = count * sizeof_datatype(datatype);
+	root_thread = comm->threads[root];
+	root_node = node_of[root_thread];
+	on_root_node = node_of[MYTHREAD] == root_node;
+	tmp = malloc(size + 1);
+
+	err = group_reduce(comm->node, sendbuf, tmp, count, datatype, op, 0);
+	if (comm->leaders)
+		err |= group_reduce(comm->leaders, err ? NULL : tmp,
+				    err ? NULL : tmp, count, datatype, op,
+				    leader_rank(comm, root_node));
+
+	//The root's leader hands the result over unless it is the root
+	if (on_root_node && comm->node->threads[0] != root_thread)
+		err |= group_bcast(comm->node, err ? NULL : tmp, size, 0);
+
+	if (comm->rank == root && !err)
+		memcpy(recvbuf, tmp, size);
+
+	free(tmp);
+
+	return err ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Two-level allreduce
+ * Node reduce to the leader, reduce and broadcast among the leaders,
+ * then a node broadcast from the leader
+ */
+int hier_allreduce(MPI_Comm comm, void *sendbuf, void *recvbuf, int count,
+		   MPI_Datatype datatype, MPI_Op op) {
+	size_t size;
+	char *tmp;
+	int err;
+
+	size = count * sizeof_datatype(datatype);
+	tmp = malloc(size + 1);
+
+	err = group_reduce(comm->node, sendbuf, tmp, count, datatype, op, 0);
+	if (comm->leaders) {
+		err |= group_reduce(comm->leaders, err ? NULL : tmp,
+				    err ? NULL : tmp, count, datatype, op, 0);
+		err |= group_bcast(comm->leaders, err ? NULL : tmp, size, 0);
+		if (!err)
+			memcpy(recvbuf, tmp, size);
+	}
+
+	err |= group_bcast(comm->node, err ? NULL : recvbuf, size, 0);
+	free(tmp);
+
+	return err ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * Two-level allgather of size bytes per member into recvbuf
+ * Leaders gather their node's blocks, exchange whole nodes and
+ * broadcast the assembled buffer on their node
+ */
+int hier_allgather(MPI_Comm comm, void *sendbuf, size_t size,
+		   void *recvbuf) {
+	char *node_buf, *all;
+	size_t *sizes;
+	size_t off;
+	int i, r, node, err;
+
+	node_buf = NULL;
+	all = NULL;
+	sizes = NULL;
+	if (comm->leaders) {
+		node_buf = malloc(comm->node->size * size + 1);
+		all = malloc(comm->size * size + 1);
+		sizes = malloc(sizeof(size_t) * comm->leaders->size);
+
+		//Without them the leader fails its node's gather
+		if (!all || !sizes) {
+			free(node_buf);
+			node_buf = NULL;
+		}
+	}
+
+	err = group_gather(comm->node, sendbuf, size, node_buf, 0);
+	if (comm->leaders) {
+		for (i = 0; i < comm->leaders->size && !err; i++) {
+			node = node_of[comm->leaders->threads[i]];
+			sizes[i] = node_size(comm, node) * size;
+		}
+
+		err |= group_allgatherv(comm->leaders, node_buf,
+					err ? NULL : sizes, err ? NULL : all);
+
+		//Blocks arrive grouped by node; move each to its rank's place
+		off = 0;
+		for (i = 0; i < comm->leaders->size && !err; i++) {
+			node = node_of[comm->leaders->threads[i]];
+			for (r = 0; r < comm->size; r++) {
+				if (node_of[comm->threads[r]] != node)
+					continue;
+
+				memcpy((char *)recvbuf + r * size, all + off, size);
+				off += size;
+			}
+		}
+	}
+
+	err |= group_bcast(comm->node, err ? NULL : recvbuf, comm->size * size,
+			   0);
+	free(node_buf);
+	free(all);
+	free(sizes);
+
+	return err ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
@@ -7,6 +7,7 @@
 #include <upc.h>
 #include "mpi.h"
 #include "upc_mpi.h"
+#include "upc_type.h"
 
 //The shared lock
 upc_lock_t *message_lock;
@@ -14,7 +15,6 @@ upc_lock_t *message_lock;
 //Initialize the shared array and shared lock
 int upc_all_mpi_init() {
 	int ret = 0;
-	int i;
 
 	message_list = upc_all_alloc(1, sizeof(message_shared) * THREADS);
 	message_lock = upc_all_lock_alloc();
@@ -38,8 +38,9 @@ int upc_all_mpi_finalize() {
 		return 0;
 
 	//Free each message in the list
-	if (!MYTHREAD)
+	if (!MYTHREAD) {
 		upc_free(message_list);
+	}
 
 	message_list = NULL;
 	upc_lock_free(message_lock);
@@ -48,8 +49,19 @@ int upc_all_mpi_finalize() {
 }
 
 //Create a new message and add it to the array
-int new_message(void *data, size_t data_size, int source, int dest, int tag) {
+int new_message(void *data, size_t data_size, int source, int dest, int tag,
+		int context) {
+	return new_message_typed(data, data_size, MPI_BYTE, source, dest, tag,
+				 context);
+}
+
+//Create a new message of count elements of datatype, packed straight
+//into the shared buffer, which has this thread's affinity
+int new_message_typed(void *buf, int count, MPI_Datatype datatype,
+		      int source, int dest, int tag, int context) {
 	message_local *new_msg;
+	shared [] char *data;
+	size_t data_size;
 	int found = 1;
 
 	if (dest < 0 || dest >= THREADS) {
@@ -58,17 +70,24 @@ int new_message(void *data, size_t data_size, int source, int dest, int tag) {
 	
 	while (found) {
 		upc_lock(message_lock);
-		found = find_message_nolock(MPI_ANY_SOURCE, dest, MPI_ANY_TAG);
+		found = find_message_nolock(MPI_ANY_SOURCE, dest, MPI_ANY_TAG,
+					    CONTEXT_ANY);
 		if (found) {
 			upc_unlock(message_lock);
+			nbc_progress();
 			usleep(10);
 		}
 	}
 
+	data_size = count * sizeof_datatype(datatype);
 	new_msg = malloc(sizeof(message_local));
-	if (!new_msg) {
+	data = upc_alloc(data_size + 1);
+	if (!new_msg || !data) {
 		//Error allocating memory for the new message
 		upc_unlock(message_lock);
+		free(new_msg);
+		if (data)
+			upc_free(data);
 		return 1;
 	}
 
@@ -76,10 +95,12 @@ int new_message(void *data, size_t data_size, int source, int dest, int tag) {
 	new_msg->source = source;
 	new_msg->tag = tag;
 	new_msg->dest = dest;
+	new_msg->context = context;
+	type_pack(buf, count, datatype, (char *)data);
 	upc_memput(&message_list[dest], new_msg, sizeof(message_shared));
-	message_list[dest].data = upc_alloc(data_size);
-	upc_memput(message_list[dest].data, data, data_size);
+	message_list[dest].data = (shared char *)data;
 	upc_unlock(message_lock);
+	free(new_msg);
 
 	return 0;
 }
@@ -110,7 +131,7 @@ int delete_message(int off) {
 }
 
 //Retrieve a message from the shared array
-message_local *get_message(int source, int dest, int tag) {
+message_local *get_message(int source, int dest, int tag, int context) {
 	message_local *ret, *lmsg;
 	int i;
 	int found = 0;
@@ -122,9 +143,10 @@ message_local *get_message(int source, int dest, int tag) {
 
 	while (!found) {
 		upc_lock(message_lock);
-		found = find_message_nolock(source, dest, tag);
+		found = find_message_nolock(source, dest, tag, context);
 		if (!found) {
 			upc_unlock(message_lock);
+			nbc_progress();
 			usleep(10);
 		}
 	}
@@ -148,6 +170,12 @@ message_local *get_message(int source, int dest, int tag) {
 		upc_unlock(message_lock);
 		return NULL;
 	} 
+
+	if (context != CONTEXT_ANY && lmsg->context != context) {
+		free(lmsg);
+		upc_unlock(message_lock);
+		return NULL;
+	}
 	
 	lmsg->data = malloc(lmsg->data_size);
 	upc_memget(lmsg->data, message_list[dest].data, lmsg->data_size);
@@ -160,7 +188,7 @@ message_local *get_message(int source, int dest, int tag) {
 }
 
 //Look for a message in the shared array
-int find_message(int source, int dest, int tag) {
+int find_message(int source, int dest, int tag, int context) {
   	message_local *lmsg;
 	int ret;
 
@@ -181,6 +209,10 @@ int find_message(int source, int dest, int tag) {
 		goto done;
 	}
 
+	if (context != CONTEXT_ANY && context != lmsg->context) {
+		goto done;
+	}
+
 	if (lmsg->tag == tag || tag == MPI_ANY_TAG) {
 		ret = 1;
 	} 
@@ -193,7 +225,7 @@ done:
 }
 
 //Same as find_message, but without the upc_lock calls
-int find_message_nolock(int source, int dest, int tag) {
+int find_message_nolock(int source, int dest, int tag, int context) {
 	message_local *lmsg;
 	int ret;
 
@@ -215,6 +247,11 @@ int find_message_nolock(int source, int dest, int tag) {
 		return ret;
 	}
 
+	if (context != CONTEXT_ANY && context != lmsg->context) {
+		free(lmsg);
+		return ret;
+	}
+
 	if (lmsg->tag == tag || tag == MPI_ANY_TAG) {
 		ret = 1;
 	} 
@@ -223,3 +260,8 @@ int find_message_nolock(int source, int dest, int tag) {
 
 	return ret;
 }
+
+//Return a pointer to the block of buf that has affinity to thread
+shared [] char *thread_block(shared void *buf, int thread) {
+	return (shared [] char *)(((shared char *)buf) + thread);
+}
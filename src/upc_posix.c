@@ -0,0 +1,300 @@
+/*
+  POSIX backend
+
+  Every thread opens the file itself and moves data with pread and
+  pwrite, so it needs neither PLFS nor pupc-io and works on any
+  communicator.  Rank 0 creates the file before the others open it.
+
+  With the direct_io hint a second descriptor is opened with O_DIRECT.
+  Transfers whose offset and length are aligned go through it, through
+  an aligned bounce buffer if the user's buffer is not; anything else
+  goes through the ordinary descriptor, which the kernel keeps coherent
+  with the direct one.
+
+  The mmap driver opens a file the same way and maps it read-only, so a
+  read is a copy out of the page cache, shared by every thread on the
+  node, and MPIO_File_map hands out pointers into the mapping.  The
+  size of the file is taken when it is opened.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_file.h"
+
+//The state of a file on one thread
+typedef struct posix_file posix_file;
+struct posix_file {
+	int fd;
+	int dfd;			//opened with O_DIRECT, or -1
+	char *map;			//the mmap driver's mapping, or NULL
+	MPI_Offset mapped;
+};
+
+//The open(2) flags of an MPI access mode, less creation
+static int posix_flags(int amode) {
+	if (amode & MPI_MODE_RDWR)
+		return O_RDWR;
+	if (amode & MPI_MODE_WRONLY)
+		return O_WRONLY;
+
+	return O_RDONLY;
+}
+
+static int posix_open(MPI_File fh, char *filename, int amode) {
+	posix_file *p;
+	int flags = posix_flags(amode), err = 0, any;
+
+	p = malloc(sizeof(posix_file));
+	if (!p)
+		return MPI_ERR_OTHER;
+	p->fd = p->dfd = -1;
+	p->map = NULL;
+	p->mapped = 0;
+
+	if (fh->comm->rank == 0) {
+		p->fd = open(filename, flags |
+			     (amode & MPI_MODE_CREATE ? O_CREAT : 0) |
+			     (amode & MPI_MODE_EXCL ? O_EXCL : 0), 0644);
+		err = p->fd < 0;
+	}
+	group_bcast(fh->comm->group, &err, sizeof(int), 0);
+
+	if (!err && fh->comm->rank != 0) {
+		p->fd = open(filename, flags);
+		err = p->fd < 0;
+	}
+
+#ifdef O_DIRECT
+	//Without O_DIRECT support the file is still usable, only buffered
+	if (!err && fh->direct_io)
+		p->dfd = open(filename, flags | O_DIRECT);
+#endif
+
+	MPI_Allreduce(&err, &any, 1, MPI_INT, MPI_MAX, fh->comm);
+	if (any) {
+		if (p->fd >= 0)
+			close(p->fd);
+		if (p->dfd >= 0)
+			close(p->dfd);
+		free(p);
+		return MPI_ERR_OTHER;
+	}
+
+	fh->handle = p;
+
+	return MPI_SUCCESS;
+}
+
+static int posix_close(MPI_File fh) {
+	posix_file *p = fh->handle;
+	int ret = MPI_SUCCESS;
+
+	if (p->dfd >= 0 && close(p->dfd) < 0)
+		ret = MPI_ERR_OTHER;
+	if (close(p->fd) < 0)
+		ret = MPI_ERR_OTHER;
+	free(p);
+
+	return ret;
+}
+
+/**
+ * Move all size bytes, or up to the end of file for a read
+ */
+static ssize_t posix_full(int fd, char *buf, size_t size, MPI_Offset off,
+			  int write) {
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		if (write)
+			ret = pwrite(fd, buf + done, size - done, off + done);
+		else
+			ret = pread(fd, buf + done, size - done, off + done);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/**
+ * An aligned transfer from an unaligned buffer, through a bounce buffer
+ */
+static ssize_t posix_bounce(int fd, char *buf, size_t size, MPI_Offset off,
+			    int write) {
+	size_t done = 0, chunk;
+	ssize_t ret = 0;
+	void *bounce;
+
+	chunk = size < FILE_DIRECT_BOUNCE ? size : FILE_DIRECT_BOUNCE;
+	if (posix_memalign(&bounce, FILE_DIRECT_ALIGN, chunk))
+		return -1;
+
+	while (done < size) {
+		if (chunk > size - done)
+			chunk = size - done;
+
+		if (write)
+			memcpy(bounce, buf + done, chunk);
+		ret = posix_full(fd, bounce, chunk, off + done, write);
+		if (ret < 0)
+			break;
+		if (!write)
+			memcpy(buf + done, bounce, ret);
+
+		done += ret;
+		if (ret < chunk)
+			break;
+	}
+
+	free(bounce);
+
+	return ret < 0 ? -1 : done;
+}
+
+static ssize_t posix_pio(void *handle, void *buf, size_t size,
+			 MPI_Offset off, int write) {
+	posix_file *p = handle;
+
+	if (p->dfd < 0 || off % FILE_DIRECT_ALIGN || size % FILE_DIRECT_ALIGN)
+		return posix_full(p->fd, buf, size, off, write);
+
+	if ((uintptr_t)buf % FILE_DIRECT_ALIGN)
+		return posix_bounce(p->dfd, buf, size, off, write);
+
+	return posix_full(p->dfd, buf, size, off, write);
+}
+
+static int posix_sync(MPI_File fh) {
+	posix_file *p = fh->handle;
+	int ret = MPI_SUCCESS;
+
+	if (fsync(p->fd) < 0)
+		ret = MPI_ERR_OTHER;
+	group_barrier(fh->comm->group);
+
+	return ret;
+}
+
+static MPI_Offset posix_size(MPI_File fh) {
+	posix_file *p = fh->handle;
+	struct stat st;
+
+	if (fstat(p->fd, &st) < 0)
+		return -1;
+
+	return st.st_size;
+}
+
+static int posix_set_size(MPI_File fh, MPI_Offset size) {
+	posix_file *p = fh->handle;
+	int err = 0;
+
+	if (fh->comm->rank == 0)
+		err = ftruncate(p->fd, size) < 0;
+	group_bcast(fh->comm->group, &err, sizeof(int), 0);
+
+	return err ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+const file_driver file_posix = {
+	"posix", "posix:", posix_open, posix_close, posix_pio, posix_sync,
+	posix_size, posix_set_size, NULL
+};
+
+static int mmap_open(MPI_File fh, char *filename, int amode) {
+	posix_file *p;
+	MPI_Offset size;
+	int err = 0, any, ret;
+
+	if (!(amode & MPI_MODE_RDONLY))
+		return MPI_ERR_ARG;
+
+	ret = posix_open(fh, filename, amode);
+	if (ret)
+		return ret;
+
+	p = fh->handle;
+	size = posix_size(fh);
+	if (size < 0) {
+		err = 1;
+	} else if (size > 0) {
+		p->map = mmap(NULL, size, PROT_READ, MAP_SHARED, p->fd, 0);
+		if (p->map == MAP_FAILED) {
+			p->map = NULL;
+			err = 1;
+		} else {
+			p->mapped = size;
+		}
+	}
+
+	MPI_Allreduce(&err, &any, 1, MPI_INT, MPI_MAX, fh->comm);
+	if (any) {
+		if (p->map)
+			munmap(p->map, p->mapped);
+		posix_close(fh);
+		return MPI_ERR_OTHER;
+	}
+
+	return MPI_SUCCESS;
+}
+
+static int mmap_close(MPI_File fh) {
+	posix_file *p = fh->handle;
+
+	if (p->map)
+		munmap(p->map, p->mapped);
+
+	return posix_close(fh);
+}
+
+static ssize_t mmap_pio(void *handle, void *buf, size_t size,
+			MPI_Offset off, int write) {
+	posix_file *p = handle;
+
+	if (write)
+		return -1;
+
+	if (off >= p->mapped)
+		return 0;
+
+	if (size > p->mapped - off)
+		size = p->mapped - off;
+	memcpy(buf, p->map + off, size);
+
+	return size;
+}
+
+static MPI_Offset mmap_size(MPI_File fh) {
+	return ((posix_file *)fh->handle)->mapped;
+}
+
+static int mmap_set_size(MPI_File fh, MPI_Offset size) {
+	return MPI_ERR_OTHER;
+}
+
+static void *mmap_map(MPI_File fh, MPI_Offset off, MPI_Offset *avail) {
+	posix_file *p = fh->handle;
+
+	if (off < 0 || off >= p->mapped)
+		return NULL;
+
+	*avail = p->mapped - off;
+
+	return p->map + off;
+}
+
+const file_driver file_mmap = {
+	"mmap", "mmap:", mmap_open, mmap_close, mmap_pio, posix_sync,
+	mmap_size, mmap_set_size, mmap_map
+};
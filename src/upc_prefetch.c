@@ -0,0 +1,301 @@
+/*
+  Read-ahead
+
+  Each thread watches the independent contiguous reads it makes on a
+  file.  Two reads the same distance apart, or one read straight after
+  another, make a pattern: sequential, or a constant stride.  While the
+  pattern holds the ranges the next reads will want are read ahead on
+  the I/O workers into a few buffers per file, so a later MPI_File_read
+  or MPI_File_iread is a copy out of memory.  A sequential stream, or a
+  stride shorter than a block, is read ahead a block at a time; a longer
+  stride a record at a time.
+
+  The number of ranges kept in flight adapts to the file: a read that
+  has to wait for its range means the backend is slower than the reader,
+  so the depth grows to overlap more requests, and a range dropped
+  before any read used it shrinks it again.
+
+  A write on the thread drops the ranges it overlaps before it lands, and
+  the write-behind cache is flushed over a range before it is read ahead.
+  Writes by other ranks become visible at MPI_File_sync, which drops
+  everything, as do MPI_File_set_size, MPI_File_set_view and close.
+*/
+
+#include <string.h>
+#include "mpi.h"
+#include "upc_aio.h"
+#include "upc_file.h"
+
+//Ranges kept in flight when a pattern is first seen
+#define PREFETCH_DEPTH 2
+
+//Worker side of a read-ahead
+static ssize_t prefetch_run(aio_job *job) {
+	return file_pio(job->file, job->buf, job->size, job->offset, 0);
+}
+
+static file_prefetch *prefetch_get(MPI_File fh) {
+	file_prefetch *p;
+
+	if (fh->prefetch)
+		return fh->prefetch;
+
+	p = calloc(1, sizeof(file_prefetch));
+	if (!p)
+		return NULL;
+
+	p->last = -1;
+	p->next = -1;
+	p->eof = -1;
+	p->depth = PREFETCH_DEPTH;
+	fh->prefetch = p;
+
+	return p;
+}
+
+/**
+ * Collect the read of a slot once it completes
+ * Returns 1 if it had to be waited for
+ */
+static int slot_collect(file_prefetch *p, file_slot *s) {
+	int waited = 0;
+
+	if (!s->job)
+		return 0;
+
+	if (!aio_test(s->job)) {
+		aio_wait(s->job);
+		waited = 1;
+	}
+
+	//A failed read leaves the range empty, so the reader goes to the file
+	s->len = s->job->result < 0 ? 0 : s->job->result;
+	if (s->job->result >= 0 && (size_t)s->job->result < s->job->size &&
+	    (p->eof < 0 || s->off + s->len < p->eof))
+		p->eof = s->off + s->len;
+	aio_finish(s->job);
+	s->job = NULL;
+
+	return waited;
+}
+
+/**
+ * Copy the read-ahead data at [off, off + size) into buf
+ * Returns the bytes copied from the start of the range
+ */
+size_t file_prefetch_serve(MPI_File fh, void *buf, size_t size,
+			   MPI_Offset off) {
+	file_prefetch *p = fh->prefetch;
+	file_slot *s = NULL;
+	MPI_Offset pos;
+	size_t done = 0, n;
+	int i;
+
+	if (!p)
+		return 0;
+
+	while (done < size) {
+		pos = off + done;
+		for (i = 0; i < FILE_PREFETCH_SLOTS; i++) {
+			s = &p->slots[i];
+			if (s->used && s->off <= pos && pos < s->off + s->len)
+				break;
+		}
+		if (i == FILE_PREFETCH_SLOTS)
+			break;
+
+		if (slot_collect(p, s) && p->depth < FILE_PREFETCH_SLOTS)
+			p->depth++;
+
+		//A short range is the end of file
+		if (pos >= s->off + s->len)
+			break;
+
+		n = s->off + s->len - pos;
+		if (n > size - done)
+			n = size - done;
+		memcpy((char *)buf + done, s->buf + (pos - s->off), n);
+		s->served = 1;
+		done += n;
+	}
+
+	return done;
+}
+
+/**
+ * Record a read of size bytes at off and read ahead if it follows a
+ * pattern
+ */
+void file_prefetch_note(MPI_File fh, MPI_Offset off, size_t size) {
+	file_prefetch *p;
+	file_slot *s;
+	aio_job *job;
+	MPI_Offset d, block, step;
+	int i, ahead, wasted = 0;
+
+	if (!fh->read_ahead || !size || size > FILE_PREFETCH_LARGEST)
+		return;
+
+	p = prefetch_get(fh);
+	if (!p)
+		return;
+
+	d = off - p->last;
+	if (p->last < 0 || d <= 0 || size != p->size)
+		p->hits = 0;
+	else if (d == p->stride)
+		p->hits++;
+	else
+		p->hits = d == p->size;	//one read straight after another
+	p->stride = p->last < 0 ? 0 : d;
+	p->size = size;
+	p->last = off;
+	if (!p->hits)
+		p->next = -1;
+
+	//Free the completed ranges behind the read, or all of them once the
+	//pattern breaks
+	ahead = 0;
+	for (i = 0; i < FILE_PREFETCH_SLOTS; i++) {
+		s = &p->slots[i];
+		if (!s->used)
+			continue;
+
+		if ((!p->hits || s->off + s->len <= off) &&
+		    (!s->job || aio_test(s->job))) {
+			slot_collect(p, s);
+			wasted += !s->served;
+			s->used = 0;
+		} else if (s->off + s->len > off + size) {
+			ahead++;
+		}
+	}
+
+	if (wasted && p->depth > 1)
+		p->depth--;
+
+	if (!p->hits)
+		return;
+
+	//A stride within a block is read ahead a block at a time, holes and
+	//all; a longer one a record at a time
+	if (p->stride < FILE_PREFETCH_BLOCK) {
+		block = FILE_PREFETCH_BLOCK;
+		step = FILE_PREFETCH_BLOCK;
+	} else {
+		block = size;
+		step = p->stride;
+	}
+	if (p->next <= off)
+		p->next = off + p->stride;
+
+	for (i = 0; i < FILE_PREFETCH_SLOTS && ahead < p->depth; i++) {
+		s = &p->slots[i];
+		if (s->used)
+			continue;
+
+		if (p->eof >= 0 && p->next >= p->eof)
+			break;
+
+		//The backend must hold the thread's own cached writes
+		if (file_cache_flush(fh, p->next, block))
+			break;
+
+		if (s->cap < block) {
+			free(s->buf);
+			s->cap = 0;
+			s->buf = malloc(block);
+			if (!s->buf)
+				break;
+			s->cap = block;
+		}
+
+		job = aio_job_new(fh, s->buf, block, MPI_BYTE, 0);
+		if (!job)
+			break;
+		job->run = prefetch_run;
+		job->file = fh;
+		job->offset = p->next;
+
+		s->job = job;
+		s->off = p->next;
+		s->len = block;
+		s->used = 1;
+		s->served = 0;
+		if (aio_submit(job)) {
+			aio_finish(job);
+			s->job = NULL;
+			s->used = 0;
+			break;
+		}
+
+		p->next += step;
+		ahead++;
+	}
+}
+
+/**
+ * Read up to size bytes at off, from the read-ahead buffers where they
+ * hold the data, and read ahead of the access
+ * Returns the bytes read, or -1 on failure
+ */
+ssize_t file_read_ahead(MPI_File fh, void *buf, size_t size, MPI_Offset off) {
+	size_t done;
+	ssize_t ret = 0;
+
+	done = file_prefetch_serve(fh, buf, size, off);
+	if (done < size) {
+		ret = file_pio(fh, (char *)buf + done, size - done,
+			       off + done, 0);
+		if (ret < 0)
+			return -1;
+	}
+
+	file_prefetch_note(fh, off, size);
+
+	return done + ret;
+}
+
+/**
+ * Drop the ranges overlapping [off, off + len), or every range and the
+ * pattern if len is negative
+ * Called before a write, which may also move the end of file
+ */
+void file_prefetch_drop(MPI_File fh, MPI_Offset off, MPI_Offset len) {
+	file_prefetch *p = fh->prefetch;
+	file_slot *s;
+	int i;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < FILE_PREFETCH_SLOTS; i++) {
+		s = &p->slots[i];
+		if (s->used && (len < 0 ||
+				(s->off < off + len && off < s->off + s->len))) {
+			slot_collect(p, s);
+			s->used = 0;
+		}
+	}
+
+	p->eof = -1;
+	if (len < 0) {
+		p->last = -1;
+		p->hits = 0;
+		p->next = -1;
+	}
+}
+
+void file_prefetch_free(MPI_File fh) {
+	int i;
+
+	if (!fh->prefetch)
+		return;
+
+	file_prefetch_drop(fh, 0, -1);
+	for (i = 0; i < FILE_PREFETCH_SLOTS; i++) {
+		free(fh->prefetch->slots[i].buf);
+	}
+	free(fh->prefetch);
+	fh->prefetch = NULL;
+}
@@ -0,0 +1,111 @@
+/*
+  PUPC-IO backend
+
+  Files are opened with upc_all_fopen over every thread and moved with
+  the positioned ADIO calls on each thread's own PLFS handle.  This is
+  the default driver, and the only one that understands PLFS paths.
+  The upc_all_* calls block in upc_barrier, so each collective entry
+  point first goes through nbc_upc_enter().
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "plfs.h"
+#include "upc_mpi.h"
+#include "upc_file.h"
+
+//The state of a file on one thread
+typedef struct pupc_file pupc_file;
+struct pupc_file {
+	upcio_file_t *fd;
+	Plfs_fd *adio_fd;		//this thread's PLFS handle
+};
+
+static int pupc_open(MPI_File fh, char *filename, int amode) {
+	struct __struct_thread_upc_file_t *fhp;
+	pupc_file *p;
+	upcio_file_t *fd;
+	int failed, any;
+
+	//pupc-io opens files over every thread
+	if (!fh->comm->world)
+		return MPI_ERR_COMM;
+
+	nbc_upc_enter();
+	fd = upc_all_fopen(filename, amode, 0644);
+	upc_barrier;
+
+	if (!fd)
+		return MPI_ERR_UNKNOWN;
+
+	//The file is only closed collectively, so every thread agrees first
+	p = malloc(sizeof(pupc_file));
+	failed = !p;
+	MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_MAX, fh->comm);
+	if (any) {
+		free(p);
+		upc_all_fclose(fd);
+		return MPI_ERR_OTHER;
+	}
+
+	fhp = (struct __struct_thread_upc_file_t *)fd->th[MYTHREAD];
+	p->fd = fd;
+	p->adio_fd = fhp->adio_fd;
+	fh->handle = p;
+
+	return MPI_SUCCESS;
+}
+
+static int pupc_close(MPI_File fh) {
+	pupc_file *p = fh->handle;
+	int ret;
+
+	nbc_upc_enter();
+	ret = upc_all_fclose(p->fd);
+	free(p);
+
+	return ret != 0 ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+static ssize_t pupc_pio(void *handle, void *buf, size_t size, MPI_Offset off,
+			int write) {
+	pupc_file *p = handle;
+	int error_code;
+	ssize_t ret;
+
+	if (write)
+		ret = UPC_ADIO_WriteContig(p->adio_fd, buf, size, off,
+					   &error_code);
+	else
+		ret = UPC_ADIO_ReadContig(p->adio_fd, buf, size, off,
+					  &error_code);
+
+	return error_code == UPC_ADIO_FAILURE ? -1 : ret;
+}
+
+static int pupc_sync(MPI_File fh) {
+	pupc_file *p = fh->handle;
+
+	nbc_upc_enter();
+	return upc_all_fsync(p->fd) < 0 ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+//Collective in pupc-io
+static MPI_Offset pupc_size(MPI_File fh) {
+	pupc_file *p = fh->handle;
+
+	nbc_upc_enter();
+	return upc_all_fget_size(p->fd);
+}
+
+static int pupc_set_size(MPI_File fh, MPI_Offset size) {
+	pupc_file *p = fh->handle;
+
+	nbc_upc_enter();
+	return upc_all_fset_size(p->fd, size) < 0 ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+const file_driver file_pupc = {
+	"pupc", "pupc:", pupc_open, pupc_close, pupc_pio, pupc_sync,
+	pupc_size, pupc_set_size, NULL
+};
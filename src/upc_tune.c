@@ -0,0 +1,400 @@
+/*
+  Collective algorithm selection
+
+  A tuning table is a list of rules, one per line:
+
+      <collective> <threads> <nodes> <max bytes> <algorithm>
+
+  for example "bcast 256 8 4096 hier".  Any of the numeric fields may be
+  "*".  The first rule that names the collective and matches the size of
+  the communicator, the number of nodes it spans and a message of at
+  most max bytes picks the algorithm.
+  Rules are read at MPI_Init from MPITOUPC_TUNING (separated by ';') and
+  then from the file named by MPITOUPC_TUNING_FILE.  If MPITOUPC_TUNE
+  names a file, every algorithm is timed at MPI_Init on this machine and
+  the fastest ones are written there as a new table.
+*/
+
+#include <upc.h>
+#include <stdio.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_tune.h"
+
+//Iterations timed for small messages; large ones use a tenth
+#define TUNE_ITERS 20
+
+//Largest receive buffer the tuner allocates
+#define TUNE_MAX_BUFFER (64 * 1048576)
+
+static char *coll_names[COLL_COUNT] = {
+	"barrier", "bcast", "reduce", "allreduce", "allgather"
+};
+
+static char *alg_names[ALG_COUNT] = {
+	"upc", "linear", "flat", "hier"
+};
+
+//Message sizes the tuner times
+static size_t tune_sizes[] = {
+	8, 64, 512, 4096, 32768, 262144, 1048576
+};
+#define TUNE_NSIZES (int)(sizeof(tune_sizes) / sizeof(tune_sizes[0]))
+
+static tune_rule *tune_rules = NULL;
+static int tune_nrules = 0;
+static int tune_cap = 0;
+
+//Algorithm forced while the tuner times it
+static int tune_force = -1;
+
+/**
+ * Returns 1 if alg is available for coll on comm
+ * The UPC library always involves every thread
+ */
+static int coll_has(MPI_Comm comm, int coll, int alg) {
+	if (alg == ALG_HIER)
+		return comm->hier;
+
+	if (alg == ALG_LINEAR)
+		return coll == COLL_BCAST;
+
+	if (alg == ALG_UPC)
+		return comm->world && coll != COLL_ALLREDUCE;
+
+	return alg == ALG_FLAT;
+}
+
+/**
+ * The algorithm used when no rule matches
+ */
+static int coll_default(MPI_Comm comm, int coll) {
+	if (comm->hier)
+		return ALG_HIER;
+
+	if (coll == COLL_BCAST)
+		return ALG_LINEAR;
+
+	if (coll == COLL_ALLREDUCE || !comm->world)
+		return ALG_FLAT;
+
+	return ALG_UPC;
+}
+
+/**
+ * Pick the algorithm for a collective on comm moving bytes bytes per
+ * member
+ */
+int coll_select(MPI_Comm comm, int coll, size_t bytes) {
+	tune_rule *r;
+	int i;
+
+	if (tune_force >= 0)
+		return tune_force;
+
+	for (i = 0; i < tune_nrules; i++) {
+		r = &tune_rules[i];
+		if (r->coll != coll)
+			continue;
+
+		if (r->threads != TUNE_ANY && r->threads != comm->size)
+			continue;
+
+		if (r->nodes != TUNE_ANY && r->nodes != comm->num_nodes)
+			continue;
+
+		if (r->max_bytes != TUNE_ANY_SIZE && bytes > r->max_bytes)
+			continue;
+
+		if (coll_has(comm, coll, r->alg))
+			return r->alg;
+	}
+
+	return coll_default(comm, coll);
+}
+
+/**
+ * Append a rule to the table
+ */
+static int tune_add(int coll, int threads, int nodes, size_t max_bytes,
+		    int alg) {
+	tune_rule *rules;
+
+	if (tune_nrules == tune_cap) {
+		rules = realloc(tune_rules, sizeof(tune_rule) * (tune_cap * 2 + 16));
+		if (!rules)
+			return 1;
+
+		tune_rules = rules;
+		tune_cap = tune_cap * 2 + 16;
+	}
+
+	tune_rules[tune_nrules].coll = coll;
+	tune_rules[tune_nrules].threads = threads;
+	tune_rules[tune_nrules].nodes = nodes;
+	tune_rules[tune_nrules].max_bytes = max_bytes;
+	tune_rules[tune_nrules].alg = alg;
+	tune_nrules++;
+
+	return 0;
+}
+
+/**
+ * Return the index of name in names, or -1
+ */
+static int name_index(char **names, int n, char *name) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(names[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Parse one rule; blank lines and lines starting with '#' are skipped
+ */
+static int tune_parse_line(char *line) {
+	char coll[32], threads[32], nodes[32], bytes[32], alg[32];
+	int c, a;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	if (*line == '#' || *line == '\n' || *line == '\0')
+		return 0;
+
+	if (sscanf(line, "%31s %31s %31s %31s %31s", coll, threads, nodes,
+		   bytes, alg) != 5)
+		return 1;
+
+	c = name_index(coll_names, COLL_COUNT, coll);
+	a = name_index(alg_names, ALG_COUNT, alg);
+	if (c < 0 || a < 0)
+		return 1;
+
+	return tune_add(c, strcmp(threads, "*") ? atoi(threads) : TUNE_ANY,
+			strcmp(nodes, "*") ? atoi(nodes) : TUNE_ANY,
+			strcmp(bytes, "*") ? strtoul(bytes, NULL, 10) : TUNE_ANY_SIZE,
+			a);
+}
+
+/**
+ * Load the rules in a tuning file
+ */
+static void tune_load_file(char *path) {
+	char line[256];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		tune_parse_line(line);
+	}
+
+	fclose(f);
+}
+
+/**
+ * Load rules separated by ';'
+ */
+static void tune_load_rules(char *rules) {
+	char *copy, *line;
+
+	copy = malloc(strlen(rules) + 1);
+	if (!copy)
+		return;
+
+	strcpy(copy, rules);
+	for (line = strtok(copy, ";"); line; line = strtok(NULL, ";")) {
+		tune_parse_line(line);
+	}
+
+	free(copy);
+}
+
+/**
+ * Write the table in the format read by tune_load_file
+ */
+static int tune_write(char *path) {
+	tune_rule *r;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f)
+		return 1;
+
+	fprintf(f, "# collective threads nodes max_bytes algorithm\n");
+	for (i = 0; i < tune_nrules; i++) {
+		r = &tune_rules[i];
+		fprintf(f, "%s %d %d ", coll_names[r->coll], r->threads, r->nodes);
+		if (r->max_bytes == TUNE_ANY_SIZE)
+			fprintf(f, "* ");
+		else
+			fprintf(f, "%lu ", (unsigned long) r->max_bytes);
+
+		fprintf(f, "%s\n", alg_names[r->alg]);
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/**
+ * Run one collective with bytes bytes per thread
+ */
+static void tune_call(int coll, size_t bytes, char *sendbuf, char *recvbuf) {
+	int count;
+
+	count = bytes / sizeof(double);
+	if (coll == COLL_BARRIER) {
+		MPI_Barrier(MPI_COMM_WORLD);
+	} else if (coll == COLL_BCAST) {
+		MPI_Bcast(sendbuf, bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+	} else if (coll == COLL_REDUCE) {
+		MPI_Reduce(sendbuf, recvbuf, count, MPI_DOUBLE, MPI_SUM, 0,
+			   MPI_COMM_WORLD);
+	} else if (coll == COLL_ALLREDUCE) {
+		MPI_Allreduce(sendbuf, recvbuf, count, MPI_DOUBLE, MPI_SUM,
+			      MPI_COMM_WORLD);
+	} else {
+		MPI_Allgather(sendbuf, bytes, MPI_BYTE, recvbuf, bytes,
+			      MPI_BYTE, MPI_COMM_WORLD);
+	}
+}
+
+/**
+ * Time the forced algorithm for one collective and message size
+ * Returns the slowest thread's time per call on every thread, so all
+ * of them reach the same decision
+ */
+static double tune_time(int coll, size_t bytes, char *sendbuf,
+			char *recvbuf) {
+	double start, elapsed, slowest;
+	int i, iters;
+
+	iters = bytes > 65536 ? TUNE_ITERS / 10 : TUNE_ITERS;
+	tune_call(coll, bytes, sendbuf, recvbuf);
+	group_barrier(MPI_COMM_WORLD->group);
+	start = MPI_Wtime();
+	for (i = 0; i < iters; i++) {
+		tune_call(coll, bytes, sendbuf, recvbuf);
+	}
+
+	elapsed = (MPI_Wtime() - start) / iters;
+	group_reduce(MPI_COMM_WORLD->group, &elapsed, &slowest, 1, MPI_DOUBLE,
+		     MPI_MAX, 0);
+	group_bcast(MPI_COMM_WORLD->group, &slowest, sizeof(double), 0);
+
+	return slowest;
+}
+
+/**
+ * Time every available algorithm of every collective, replace the
+ * table with the fastest and write it to path
+ */
+static int tune_run(char *path) {
+	char *sendbuf, *recvbuf;
+	size_t bytes, max;
+	double t, best_time;
+	tune_rule *prev;
+	int coll, alg, best, i;
+
+	max = tune_sizes[TUNE_NSIZES - 1];
+	sendbuf = calloc(max, 1);
+	recvbuf = calloc(THREADS * max < TUNE_MAX_BUFFER ?
+			 THREADS * max : TUNE_MAX_BUFFER, 1);
+	if (!sendbuf || !recvbuf) {
+		free(sendbuf);
+		free(recvbuf);
+		return 1;
+	}
+
+	tune_nrules = 0;
+	best_time = 0;
+	for (coll = 0; coll < COLL_COUNT; coll++) {
+		for (i = 0; i < TUNE_NSIZES; i++) {
+			bytes = coll == COLL_BARRIER ? 0 : tune_sizes[i];
+			if (coll == COLL_ALLGATHER && THREADS * bytes > TUNE_MAX_BUFFER)
+				break;
+
+			best = -1;
+			for (alg = 0; alg < ALG_COUNT; alg++) {
+				if (!coll_has(MPI_COMM_WORLD, coll, alg))
+					continue;
+
+				if (coll == COLL_REDUCE && alg == ALG_UPC &&
+				    bytes != sizeof(double))
+					continue;
+
+				tune_force = alg;
+				t = tune_time(coll, bytes, sendbuf, recvbuf);
+				tune_force = -1;
+				if (best < 0 || t < best_time) {
+					best = alg;
+					best_time = t;
+				}
+			}
+
+			//Extend the previous rule when the same algorithm wins
+			prev = tune_nrules ? &tune_rules[tune_nrules - 1] : NULL;
+			if (prev && prev->coll == coll && prev->alg == best)
+				prev->max_bytes = bytes;
+			else
+				tune_add(coll, THREADS, MPI_COMM_WORLD->num_nodes,
+					 bytes, best);
+
+			if (coll == COLL_BARRIER)
+				break;
+		}
+
+		//The largest size timed covers everything above it
+		if (tune_nrules && tune_rules[tune_nrules - 1].coll == coll)
+			tune_rules[tune_nrules - 1].max_bytes = TUNE_ANY_SIZE;
+	}
+
+	free(sendbuf);
+	free(recvbuf);
+	if (!MYTHREAD)
+		tune_write(path);
+
+	return 0;
+}
+
+/**
+ * Load the tuning table, running the tuner first if requested
+ */
+int tune_init() {
+	char *env;
+
+	env = getenv(TUNE_RULES_ENV);
+	if (env)
+		tune_load_rules(env);
+
+	env = getenv(TUNE_FILE_ENV);
+	if (env)
+		tune_load_file(env);
+
+	env = getenv(TUNE_OUTPUT_ENV);
+	if (env)
+		return tune_run(env);
+
+	return 0;
+}
+
+/**
+ * Free the tuning table
+ */
+void tune_finalize() {
+	free(tune_rules);
+	tune_rules = NULL;
+	tune_nrules = 0;
+	tune_cap = 0;
+}
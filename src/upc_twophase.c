@@ -0,0 +1,476 @@
+/*
+  Two-phase collective I/O
+
+  MPI_File_write_at_all and MPI_File_read_at_all do not let every
+  thread reach the file system with its own small request.  The range
+  of the file the ranks touch together is cut into one file domain per
+  aggregator, each starting on a stripe boundary so no two aggregators
+  share a stripe.  The domains are covered in rounds of one buffer: the
+  ranks put the pieces of their data falling in an aggregator's current
+  window straight into that aggregator's shared buffer, and after a
+  barrier the aggregators write their windows with a few large
+  requests.  Reads run the other way round.
+
+  Every rank learns the segments of every rank up front, so an
+  aggregator knows which bytes of its window were filled without
+  further messages, and never writes over the holes between them.
+
+  A split or nonblocking collective write does not wait for the file
+  system: each round an aggregator copies the runs of its window and
+  queues their write to the I/O workers, keeping a few rounds in flight,
+  and the end call waits for them.
+
+  The domains and windows of a compressed file are laid on its chunks
+  instead of stripes, and the aggregators compress whole chunks, so its
+  writes are never left running.
+*/
+
+#include <upc.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_aio.h"
+#include "upc_file.h"
+
+//The file domains of one collective operation
+typedef struct cb_layout cb_layout;
+struct cb_layout {
+	MPI_Offset base;		//first byte of the first domain
+	MPI_Offset end;			//past the last byte accessed
+	MPI_Offset domain;		//bytes in each domain
+	MPI_Offset window;		//bytes each aggregator moves per round
+	int naggr;
+	int size;
+};
+
+//The rank of aggregator a, spreading the aggregators over the ranks
+#define AGGR_RANK(l, a) ((int)((long)(a) * (l)->size / (l)->naggr))
+
+//Order segments by file offset
+static int seg_cmp(const void *a, const void *b) {
+	const file_seg *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/**
+ * Find the window of aggregator a in round r
+ * Returns 0 if the window is empty
+ */
+static int window_of(cb_layout *l, int a, int r,
+		     MPI_Offset *start, MPI_Offset *end) {
+	MPI_Offset stop;
+
+	*start = l->base + a * l->domain + r * l->window;
+	stop = l->base + (a + 1) * l->domain;
+	*end = *start + l->window;
+	if (*end > stop)
+		*end = stop;
+	if (*end > l->end)
+		*end = l->end;
+
+	return *start < *end;
+}
+
+/**
+ * Clip the segments of all, sorted by offset, to [start, end) and merge
+ * what is left into runs
+ * Returns the number of runs
+ */
+static int window_runs(file_seg *all, int total, MPI_Offset start,
+		       MPI_Offset end, file_seg *runs) {
+	MPI_Offset s, e;
+	int i, n = 0;
+
+	for (i = 0; i < total && all[i].off < end; i++) {
+		s = all[i].off > start ? all[i].off : start;
+		e = all[i].off + all[i].len;
+		if (e > end)
+			e = end;
+		if (s >= e)
+			continue;
+
+		if (n && s <= runs[n - 1].off + runs[n - 1].len) {
+			if (e > runs[n - 1].off + runs[n - 1].len)
+				runs[n - 1].len = e - runs[n - 1].off;
+		} else {
+			runs[n].off = s;
+			runs[n].len = e - s;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+//Worker side of a split collective write
+static ssize_t split_run(aio_job *job) {
+	return file_sieve(job->file, job->segs, job->nsegs, job->buf, 0, 1);
+}
+
+/**
+ * Queue the write of the n runs of a window starting at start to the I/O
+ * workers from a copy of local, first collecting the write queued
+ * FILE_SPLIT_ROUNDS rounds ago
+ */
+static int aggr_defer(MPI_File fh, file_split *split, file_seg *runs, int n,
+		      char *local, MPI_Offset start) {
+	aio_job *job, **grown;
+	size_t size = 0;
+	int i;
+
+	if (split->njobs >= FILE_SPLIT_ROUNDS) {
+		job = split->jobs[split->njobs - FILE_SPLIT_ROUNDS];
+		if (job) {
+			aio_wait(job);
+			if (aio_finish(job))
+				split->err = MPI_ERR_OTHER;
+			split->jobs[split->njobs - FILE_SPLIT_ROUNDS] = NULL;
+		}
+	}
+
+	grown = realloc(split->jobs, sizeof(aio_job *) * (split->njobs + 1));
+	if (!grown)
+		return MPI_ERR_OTHER;
+	split->jobs = grown;
+
+	for (i = 0; i < n; i++) {
+		size += runs[i].len;
+	}
+
+	job = calloc(1, sizeof(aio_job));
+	if (!job)
+		return MPI_ERR_OTHER;
+	job->buf = malloc(size);
+	job->segs = malloc(sizeof(file_seg) * n);
+	if (!job->buf || !job->segs) {
+		free(job->buf);
+		free(job->segs);
+		free(job);
+		return MPI_ERR_OTHER;
+	}
+
+	for (i = 0, size = 0; i < n; i++) {
+		memcpy(job->buf + size, local + (runs[i].off - start),
+		       runs[i].len);
+		size += runs[i].len;
+	}
+	memcpy(job->segs, runs, sizeof(file_seg) * n);
+
+	job->run = split_run;
+	job->file = fh;
+	job->size = size;
+	job->nsegs = n;
+	job->pending = &fh->pending;
+	job->packed = 1;
+	split->jobs[split->njobs++] = job;
+
+	return aio_submit(job);
+}
+
+/**
+ * Write or read the window of aggregator a in round r between the file
+ * and local, the aggregator's buffer
+ * With split set a write is queued to the I/O workers
+ */
+static int aggr_io(MPI_File fh, cb_layout *l, file_seg *all, int total,
+		   file_seg *runs, char *local, int a, int r, int write,
+		   file_split *split) {
+	MPI_Offset start, end, span;
+	ssize_t ret;
+	int i, n;
+
+	if (!window_of(l, a, r, &start, &end))
+		return MPI_SUCCESS;
+
+	n = window_runs(all, total, start, end, runs);
+	if (!n)
+		return MPI_SUCCESS;
+
+	if (write && fh->zip)
+		return file_zip_write(fh, runs, n, local, start);
+
+	if (write && split)
+		return aggr_defer(fh, split, runs, n, local, start);
+
+	if (write) {
+		for (i = 0; i < n; i++) {
+			ret = file_pio(fh, local + (runs[i].off - start),
+				       runs[i].len, runs[i].off, 1);
+			if (ret != runs[i].len)
+				return MPI_ERR_OTHER;
+		}
+
+		return MPI_SUCCESS;
+	}
+
+	//One read spanning the holes; bytes past the end of file read as 0
+	span = runs[n - 1].off + runs[n - 1].len - runs[0].off;
+	ret = file_pio(fh, local + (runs[0].off - start), span, runs[0].off,
+		       0);
+	if (ret < 0)
+		return MPI_ERR_OTHER;
+	if (ret < span)
+		memset(local + (runs[0].off - start) + ret, 0, span - ret);
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Put the pieces of this rank's data in round r into the aggregators'
+ * buffers, or get them back out
+ */
+static void rank_exchange(cb_layout *l, shared [] char **wins,
+			  file_seg *segs, int nsegs, char *buf, int r,
+			  int write) {
+	MPI_Offset memoff = 0, start, end, s, e;
+	shared [] char *dst;
+	char *src;
+	int i, a, last;
+
+	for (i = 0; i < nsegs; memoff += segs[i].len, i++) {
+		if (segs[i].len <= 0)
+			continue;
+
+		a = (segs[i].off - l->base) / l->domain;
+		last = (segs[i].off + segs[i].len - 1 - l->base) / l->domain;
+		for (; a <= last && a < l->naggr; a++) {
+			if (!window_of(l, a, r, &start, &end))
+				continue;
+
+			s = segs[i].off > start ? segs[i].off : start;
+			e = segs[i].off + segs[i].len;
+			if (e > end)
+				e = end;
+			if (s >= e)
+				continue;
+
+			dst = wins[AGGR_RANK(l, a)] + (s - start);
+			src = buf + memoff + (s - segs[i].off);
+			if (write)
+				upc_memput(dst, src, e - s);
+			else
+				upc_memget(src, dst, e - s);
+		}
+	}
+}
+
+/**
+ * Agree over comm whether any rank failed to allocate its buffers
+ * Returns MPI_ERR_OTHER on every rank if one did
+ */
+static int twophase_agree(MPI_Comm comm, int failed) {
+	int any;
+
+	MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_MAX, comm);
+
+	return any ? MPI_ERR_OTHER : MPI_SUCCESS;
+}
+
+/**
+ * The number of aggregators of a collective access: the cb_nodes hint,
+ * or one per node, but no more than there are stripe targets or ranks
+ * Compressing is bound by the CPU, so by default every rank of a
+ * compressed file aggregates
+ */
+int file_cb_nodes(MPI_File fh) {
+	int n;
+
+	if (fh->cb_nodes > 0) {
+		n = fh->cb_nodes;
+	} else if (fh->zip) {
+		n = fh->comm->size;
+	} else {
+		n = fh->comm->num_nodes;
+		if (fh->striping_factor > 0 && fh->striping_factor < n)
+			n = fh->striping_factor;
+	}
+
+	return n < fh->comm->size ? n : fh->comm->size;
+}
+
+/**
+ * Collectively write the segments of every rank from their packed
+ * buffers, or read them into the buffers
+ * Every rank of the file's communicator must call this
+ * With split set the writes are left running and this rank's error is
+ * returned; the caller combines the errors once they complete
+ * A rank whose buf is NULL takes part without its data and fails the
+ * access
+ */
+int file_twophase(MPI_File fh, file_seg *segs, int nsegs, char *buf,
+		  int write, file_split *split) {
+	MPI_Comm comm = fh->comm;
+	shared [] char *mine = NULL;
+	shared [] char **wins;
+	file_seg *all, *runs;
+	size_t *sizes;
+	int *counts;
+	cb_layout l;
+	MPI_Offset lo = -1, unit;
+	int total = 0, me = -1, rounds, r, a, i;
+	int err = MPI_SUCCESS, gerr, lost;
+
+	lost = !buf && nsegs > 0;
+	if (lost)
+		nsegs = 0;
+
+	all = runs = NULL;
+	counts = malloc(sizeof(int) * comm->size);
+	sizes = malloc(sizeof(size_t) * comm->size);
+	wins = malloc(sizeof(shared [] char *) * comm->size);
+	err = twophase_agree(comm, !counts || !sizes || !wins);
+	if (err)
+		goto out;
+
+	group_allgather(comm->group, &nsegs, sizeof(int), counts);
+	for (i = 0; i < comm->size; i++) {
+		sizes[i] = counts[i] * sizeof(file_seg);
+		total += counts[i];
+	}
+
+	all = malloc(sizeof(file_seg) * total + 1);
+	runs = malloc(sizeof(file_seg) * total + 1);
+	err = twophase_agree(comm, !all || !runs);
+	if (err)
+		goto out;
+	group_allgatherv(comm->group, segs, sizes, all);
+	qsort(all, total, sizeof(file_seg), seg_cmp);
+
+	l.end = 0;
+	for (i = 0; i < total; i++) {
+		if (all[i].len <= 0)
+			continue;
+		if (lo < 0 || all[i].off < lo)
+			lo = all[i].off;
+		if (all[i].off + all[i].len > l.end)
+			l.end = all[i].off + all[i].len;
+	}
+
+	if (lo < 0)
+		goto out;
+
+	//One domain of whole stripes, or chunks, per aggregator, dropping
+	//aggregators that would be left without one
+	if (fh->zip)
+		unit = fh->zip->chunk;
+	else
+		unit = fh->striping_unit > 0 ? fh->striping_unit : 1;
+	l.size = comm->size;
+	l.naggr = file_cb_nodes(fh);
+	l.base = lo - lo % unit;
+	l.domain = (l.end - l.base + l.naggr - 1) / l.naggr;
+	l.domain = (l.domain + unit - 1) / unit * unit;
+	l.naggr = (l.end - l.base + l.domain - 1) / l.domain;
+
+	l.window = fh->cb_buffer_size > 0 ? fh->cb_buffer_size : l.domain;
+	if (l.window >= unit)
+		l.window -= l.window % unit;
+	else if (fh->zip)
+		l.window = unit;
+	if (l.window > l.domain)
+		l.window = l.domain;
+	rounds = (l.domain + l.window - 1) / l.window;
+
+	for (a = 0; a < l.naggr; a++) {
+		if (AGGR_RANK(&l, a) == comm->rank)
+			me = a;
+	}
+
+	if (me >= 0)
+		mine = upc_alloc(l.window);
+	group_allgather(comm->group, &mine, sizeof(mine), wins);
+
+	//Every rank sees an aggregator without a buffer, so all skip the
+	//rounds rather than put data through NULL
+	for (a = 0; a < l.naggr; a++) {
+		if (!wins[AGGR_RANK(&l, a)])
+			err = MPI_ERR_OTHER;
+	}
+	if (err)
+		rounds = 0;
+
+	for (r = 0; r < rounds; r++) {
+		if (write) {
+			rank_exchange(&l, wins, segs, nsegs, buf, r, 1);
+			group_barrier(comm->group);
+			if (me >= 0 && !err)
+				err = aggr_io(fh, &l, all, total, runs,
+					      (char *)mine, me, r, 1, split);
+		} else {
+			if (me >= 0 && !err)
+				err = aggr_io(fh, &l, all, total, runs,
+					      (char *)mine, me, r, 0, split);
+			group_barrier(comm->group);
+			rank_exchange(&l, wins, segs, nsegs, buf, r, 0);
+		}
+
+		//The buffers are reused by the next round
+		group_barrier(comm->group);
+	}
+
+	if (mine)
+		upc_free(mine);
+
+out:
+	free(counts);
+	free(sizes);
+	free(wins);
+	free(all);
+	free(runs);
+
+	if (lost && !err)
+		err = MPI_ERR_OTHER;
+
+	if (split)
+		return err;
+
+	MPI_Allreduce(&err, &gerr, 1, MPI_INT, MPI_MAX, comm);
+
+	return gerr;
+}
+
+/**
+ * Returns 1 once every write of a split collective has completed
+ */
+int file_split_test(file_split *split) {
+	int i;
+
+	for (i = 0; i < split->njobs; i++) {
+		if (split->jobs[i] && !aio_test(split->jobs[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+void file_split_wait(file_split *split) {
+	int i;
+
+	for (i = 0; i < split->njobs; i++) {
+		if (split->jobs[i])
+			aio_wait(split->jobs[i]);
+	}
+}
+
+/**
+ * Wait for the writes of a split collective and free it
+ * Returns this rank's error code
+ */
+int file_split_finish(file_split *split) {
+	int i, err = split->err;
+
+	for (i = 0; i < split->njobs; i++) {
+		if (!split->jobs[i])
+			continue;
+
+		aio_wait(split->jobs[i]);
+		if (aio_finish(split->jobs[i]))
+			err = MPI_ERR_OTHER;
+	}
+
+	free(split->jobs);
+	free(split);
+
+	return err;
+}
@@ -0,0 +1,280 @@
+/*
+  File views and data sieving
+
+  MPI_File_set_view flattens the filetype once into the runs of one
+  instance.  An access of some bytes at a position in the view is then
+  mapped to a list of file segments by walking the runs from the
+  position, tiling the filetype every extent bytes and joining runs
+  that touch, so an interleaved checkpoint layout costs a binary search
+  and a loop rather than a seek per piece.
+
+  Independent accesses through a strided view are sieved: one large
+  extent covering many segments is read into a buffer and the pieces
+  are copied out, or merged in and the extent written back once.  The
+  caller of a sieved write holds the file's sieve lock, since the bytes
+  between the segments may belong to another rank.
+*/
+
+#include <string.h>
+#include "mpi.h"
+#include "upc_type.h"
+#include "upc_file.h"
+
+/**
+ * Flatten a filetype into a view
+ * Sets view to NULL for a filetype whose data is contiguous
+ */
+int file_view_new(MPI_Datatype filetype, file_view **view) {
+	type_desc *t = type_get(filetype);
+	type_run *r;
+	file_view *v;
+	int i, j, n;
+
+	*view = NULL;
+	if (!t)
+		return type_basic_of(filetype) ? MPI_SUCCESS : MPI_ERR_TYPE;
+
+	if (!t->committed)
+		return MPI_ERR_TYPE;
+
+	if (t->plan->dense || !t->size)
+		return MPI_SUCCESS;
+
+	for (i = 0, n = 0; i < t->plan->nruns; i++) {
+		n += t->plan->runs[i].count;
+	}
+
+	v = calloc(1, sizeof(file_view));
+	if (!v)
+		return MPI_ERR_OTHER;
+
+	v->segs = malloc(sizeof(file_seg) * n);
+	v->data = malloc(sizeof(MPI_Offset) * n);
+	if (!v->segs || !v->data) {
+		file_view_free(v);
+		return MPI_ERR_OTHER;
+	}
+
+	for (i = 0; i < t->plan->nruns; i++) {
+		r = &t->plan->runs[i];
+		for (j = 0; j < r->count; j++) {
+			if (!r->len)
+				continue;
+
+			//Filetypes must have monotonically nondecreasing displacements
+			if (v->nsegs && r->off + j * r->stride <
+			    v->segs[v->nsegs - 1].off + v->segs[v->nsegs - 1].len) {
+				file_view_free(v);
+				return MPI_ERR_TYPE;
+			}
+
+			v->segs[v->nsegs].off = r->off + j * r->stride;
+			v->segs[v->nsegs].len = r->len;
+			v->data[v->nsegs] = v->size;
+			v->size += r->len;
+			v->nsegs++;
+		}
+	}
+
+	v->extent = t->extent;
+	*view = v;
+
+	return MPI_SUCCESS;
+}
+
+void file_view_free(file_view *view) {
+	if (!view)
+		return;
+
+	free(view->segs);
+	free(view->data);
+	free(view);
+}
+
+/**
+ * Append a segment to a growing list, joining it to the last one if
+ * they touch
+ */
+static int seg_append(file_seg **segs, int *n, int *cap, MPI_Offset off,
+		      MPI_Offset len) {
+	file_seg *grown;
+
+	if (*n && (*segs)[*n - 1].off + (*segs)[*n - 1].len == off) {
+		(*segs)[*n - 1].len += len;
+		return MPI_SUCCESS;
+	}
+
+	if (*n == *cap) {
+		grown = realloc(*segs, sizeof(file_seg) * *cap * 2);
+		if (!grown)
+			return MPI_ERR_OTHER;
+		*segs = grown;
+		*cap *= 2;
+	}
+
+	(*segs)[*n].off = off;
+	(*segs)[*n].len = len;
+	(*n)++;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Map bytes of data at byte position pos of the file's view to a list
+ * of file segments in view order
+ * The list is allocated and must be freed by the caller
+ */
+int file_view_map(MPI_File fh, MPI_Offset pos, MPI_Offset bytes,
+		  file_seg **segs, int *nsegs) {
+	file_view *v = fh->view;
+	MPI_Offset inst, skip, len;
+	int lo, hi, mid, i, cap = 16;
+
+	*nsegs = 0;
+	*segs = malloc(sizeof(file_seg) * cap);
+	if (!*segs)
+		return MPI_ERR_OTHER;
+
+	if (bytes <= 0)
+		return MPI_SUCCESS;
+
+	if (!v) {
+		(*segs)[0].off = fh->disp + pos;
+		(*segs)[0].len = bytes;
+		*nsegs = 1;
+		return MPI_SUCCESS;
+	}
+
+	//The run holding pos
+	inst = pos / v->size;
+	skip = pos % v->size;
+	lo = 0;
+	hi = v->nsegs - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (v->data[mid] <= skip)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	i = lo;
+	skip -= v->data[i];
+	while (bytes > 0) {
+		len = v->segs[i].len - skip;
+		if (len > bytes)
+			len = bytes;
+
+		if (seg_append(segs, nsegs, &cap, fh->disp + inst * v->extent +
+			       v->segs[i].off + skip, len)) {
+			free(*segs);
+			*segs = NULL;
+			*nsegs = 0;
+			return MPI_ERR_OTHER;
+		}
+
+		bytes -= len;
+		skip = 0;
+		if (++i == v->nsegs) {
+			i = 0;
+			inst++;
+		}
+	}
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Move the data of segments in file order between buf and the file,
+ * sieving runs of segments through extents of at most bufsize bytes
+ * Returns the bytes of data moved, or -1 on failure
+ */
+ssize_t file_sieve(MPI_File fh, file_seg *segs, int nsegs, char *buf,
+		   size_t bufsize, int write) {
+	MPI_Offset start, end, data;
+	ssize_t moved = 0, ret;
+	char *sieve = NULL;
+	int i, j, k;
+
+	for (i = 0; i < nsegs; i = j) {
+		//Gather the segments that fit in one extent; a mapped file is
+		//read piece by piece, straight from the mapping
+		start = segs[i].off;
+		end = segs[i].off + segs[i].len;
+		data = segs[i].len;
+		for (j = i + 1; j < nsegs && (write || !fh->driver->map) &&
+			     segs[j].off >= end &&
+			     segs[j].off + segs[j].len - start <= bufsize; j++) {
+			end = segs[j].off + segs[j].len;
+			data += segs[j].len;
+		}
+
+		if (j == i + 1) {
+			ret = file_pio(fh, buf, segs[i].len, segs[i].off,
+				       write);
+			if (ret < 0 || (write && ret != segs[i].len))
+				goto fail;
+
+			//A short read is the end of file
+			moved += ret;
+			buf += segs[i].len;
+			if (ret < segs[i].len)
+				break;
+
+			continue;
+		}
+
+		if (!sieve) {
+			sieve = malloc(bufsize);
+			if (!sieve)
+				return -1;
+		}
+
+		//A write reads the holes first unless the segments cover the
+		//extent
+		ret = end - start;
+		if (!write || data < end - start) {
+			ret = file_pio(fh, sieve, end - start, start, 0);
+			if (ret < 0)
+				goto fail;
+			memset(sieve + ret, 0, end - start - ret);
+		}
+
+		for (k = i; k < j; k++) {
+			if (write)
+				memcpy(sieve + (segs[k].off - start), buf,
+				       segs[k].len);
+			else if (segs[k].off < start + ret)
+				memcpy(buf, sieve + (segs[k].off - start),
+				       segs[k].len);
+			buf += segs[k].len;
+		}
+
+		if (write) {
+			if (file_pio(fh, sieve, end - start, start, 1) !=
+			    end - start)
+				goto fail;
+			moved += data;
+		} else {
+			//Count the data before the end of file
+			for (k = i; k < j && segs[k].off < start + ret; k++) {
+				if (segs[k].off + segs[k].len > start + ret)
+					moved += start + ret - segs[k].off;
+				else
+					moved += segs[k].len;
+			}
+
+			if (ret < end - start)
+				break;
+		}
+	}
+
+	free(sieve);
+
+	return moved;
+
+fail:
+	free(sieve);
+
+	return -1;
+}
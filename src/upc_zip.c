@@ -0,0 +1,703 @@
+/*
+  Compressed files
+
+  With the compression hint at MPI_File_open the data of a file is kept
+  in chunks of compression_chunk_size bytes, each compressed on its own
+  and stored wherever there was room, and an index in the file says
+  where.  A read decompresses only the chunks it touches, so any offset
+  can be read back through any of the usual calls.
+
+  Chunks are written by collective calls alone.  Two-phase I/O lays the
+  file domains on chunk boundaries, so every chunk has one aggregator,
+  which merges the ranks' data with what the chunk held, compresses it
+  and claims space for it at the end of the stored bytes with one atomic
+  on rank 0, unless it fits where the chunk was.  By default every rank
+  aggregates, so the compression runs on all the writing threads at
+  once.  Afterwards the ranks swap the chunks they rewrote, so every
+  rank holds the whole index; rank 0 writes it to the file at
+  MPI_File_sync and close.
+
+  The codec is a byte-oriented LZ77: a token of literal and match
+  lengths, the literals and a 16 bit offset back.  Before it the bytes
+  of each chunk are shuffled into planes of compression_typesize bytes,
+  1 for none, so the slowly changing exponents of floating point fields
+  become long runs.  A chunk that does not shrink is stored as is.
+
+  The index is read on the I/O workers by read-ahead and MPI_File_iread,
+  so it is only changed once they are drained.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "mpi.h"
+#include "upc_mpi.h"
+#include "upc_group.h"
+#include "upc_rma.h"
+#include "upc_aio.h"
+#include "upc_file.h"
+
+#define ZIP_MAGIC     "MPIUPCZ1"
+#define ZIP_HASH_BITS 14
+#define ZIP_MIN_MATCH 4
+#define ZIP_MAX_OFF   65535
+
+//Literals left at the end of the input, so a match never reads past it
+#define ZIP_TAIL      12
+
+//The start of a compressed file
+typedef struct zip_header zip_header;
+struct zip_header {
+	char magic[8];
+	int64_t chunk;
+	int64_t typesize;
+	int64_t size;
+	int64_t nchunks;
+	int64_t index;			//offset of the index
+	int64_t end;			//of the stored bytes
+};
+
+//The most bytes n bytes can compress to
+static size_t zip_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+static uint32_t zip_read32(const uint8_t *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t zip_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - ZIP_HASH_BITS);
+}
+
+//Write the part of a length that does not fit its nibble
+static uint8_t *zip_put_len(uint8_t *op, size_t len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+/**
+ * Emit the literals [lit, lit + nlit) followed by a match of mlen bytes
+ * off bytes back, or by nothing if mlen is 0
+ */
+static uint8_t *zip_emit(uint8_t *op, const uint8_t *lit, size_t nlit,
+			 size_t off, size_t mlen) {
+	uint8_t *token = op++;
+	size_t m = mlen ? mlen - ZIP_MIN_MATCH : 0;
+
+	*token = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15)
+		op = zip_put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (!mlen)
+		return op;
+
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	if (m >= 15)
+		op = zip_put_len(op, m - 15);
+
+	return op;
+}
+
+/**
+ * Compress n bytes of src into dst, which holds zip_bound(n)
+ * Returns the compressed size
+ */
+static size_t zip_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+	const uint8_t *ip = src, *anchor = src, *end = src + n, *ref;
+	const uint8_t *limit = n > ZIP_TAIL ? end - ZIP_TAIL : src;
+	uint32_t *table, v, h;
+	uint8_t *op = dst;
+	size_t mlen, misses = 0;
+
+	table = calloc(1 << ZIP_HASH_BITS, sizeof(uint32_t));
+	if (!table)
+		limit = src;
+
+	while (ip < limit) {
+		v = zip_read32(ip);
+		h = zip_hash(v);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > ZIP_MAX_OFF || zip_read32(ref) != v) {
+			//Step faster through data that does not match
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+
+		mlen = ZIP_MIN_MATCH;
+		while (ip + mlen < end - 5 && ip[mlen] == ref[mlen]) {
+			mlen++;
+		}
+
+		op = zip_emit(op, anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+		misses = 0;
+	}
+
+	op = zip_emit(op, anchor, end - anchor, 0, 0);
+	free(table);
+
+	return op - dst;
+}
+
+/**
+ * Decompress n bytes of src into dst, which holds cap bytes
+ * Returns the decompressed size, or -1 if src is corrupt
+ */
+static ssize_t zip_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+			      size_t cap) {
+	const uint8_t *ip = src, *iend = src + n, *ref;
+	uint8_t *op = dst, *oend = dst + cap;
+	size_t lit, mlen, off;
+	uint8_t b;
+
+	while (ip < iend) {
+		b = *ip++;
+		lit = b >> 4;
+		mlen = b & 15;
+
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		//The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!off || off > (size_t)(op - dst))
+			return -1;
+
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += ZIP_MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		//A match may overlap the bytes it produces
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
+
+/**
+ * Gather byte b of every element of width ts into plane b, or spread
+ * the planes back out; the bytes past the last whole element stay put
+ */
+static void zip_shuffle(const uint8_t *src, uint8_t *dst, size_t n, int ts,
+			int back) {
+	size_t i, elems = n / ts;
+	int b;
+
+	for (b = 0; b < ts; b++) {
+		for (i = 0; i < elems; i++) {
+			if (back)
+				dst[i * ts + b] = src[b * elems + i];
+			else
+				dst[b * elems + i] = src[i * ts + b];
+		}
+	}
+	memcpy(dst + elems * ts, src + elems * ts, n - elems * ts);
+}
+
+/**
+ * Compress the n bytes of a chunk into out, which holds zip_bound(n),
+ * using tmp of n bytes
+ * Returns the bytes to store and sets raw if they are the chunk as is
+ */
+static size_t zip_encode(file_zip *z, char *data, size_t n, char *out,
+			 char *tmp, int *raw) {
+	size_t len;
+
+	if (z->typesize > 1) {
+		zip_shuffle((uint8_t *)data, (uint8_t *)tmp, n, z->typesize, 0);
+		data = tmp;
+	}
+
+	//A chunk that does not shrink is stored from the caller's bytes
+	len = zip_compress((uint8_t *)data, n, (uint8_t *)out);
+	*raw = len >= n;
+
+	return *raw ? n : len;
+}
+
+/**
+ * Read chunk e from the file and decompress it into out, which holds
+ * e->ulen bytes
+ * Returns 0, or -1 if it cannot be read
+ */
+static int zip_load(MPI_File fh, file_zchunk *e, char *out) {
+	file_zip *z = fh->zip;
+	char *stored, *tmp = NULL;
+	ssize_t ret;
+
+	stored = malloc(e->len + 1);
+	if (!stored)
+		return -1;
+
+	ret = fh->driver->pio(fh->handle, stored, e->len, e->off, 0);
+	if (ret != e->len) {
+		free(stored);
+		return -1;
+	}
+
+	if (e->raw) {
+		if (e->len == e->ulen)
+			memcpy(out, stored, e->len);
+		free(stored);
+		return e->len == e->ulen ? 0 : -1;
+	}
+
+	if (z->typesize > 1) {
+		tmp = malloc(e->ulen + 1);
+		if (!tmp) {
+			free(stored);
+			return -1;
+		}
+	}
+
+	ret = zip_decompress((uint8_t *)stored, e->len,
+			     (uint8_t *)(tmp ? tmp : out), e->ulen);
+	if (ret == e->ulen && tmp)
+		zip_shuffle((uint8_t *)tmp, (uint8_t *)out, e->ulen,
+			    z->typesize, 1);
+
+	free(stored);
+	free(tmp);
+
+	return ret == e->ulen ? 0 : -1;
+}
+
+/**
+ * Read the header and index of a compressed file, or start them for an
+ * empty one, on every rank
+ * Called collectively once the driver has opened the file
+ */
+int file_zip_open(MPI_File fh) {
+	coll_group *g = fh->comm->group;
+	zip_header h;
+	file_zip *z;
+	MPI_Offset phys;
+	int err = MPI_SUCCESS, any;
+
+	//Every rank asks, as the pupc driver finds the size collectively
+	memset(&h, 0, sizeof(h));
+	phys = fh->driver->size(fh);
+	if (fh->comm->rank == 0) {
+		if (phys < 0) {
+			err = MPI_ERR_OTHER;
+		} else if (phys == 0) {
+			memcpy(h.magic, ZIP_MAGIC, sizeof(h.magic));
+			h.chunk = fh->compression_chunk;
+			h.typesize = fh->compression_typesize;
+			h.end = FILE_ZIP_HEADER;
+		} else if (fh->driver->pio(fh->handle, &h, sizeof(h), 0, 0) !=
+			   sizeof(h) || memcmp(h.magic, ZIP_MAGIC,
+					       sizeof(h.magic)) ||
+			   h.chunk <= 0 || h.typesize <= 0 || h.nchunks < 0) {
+			//Not a compressed file
+			err = MPI_ERR_OTHER;
+		}
+	}
+	group_bcast(g, &err, sizeof(int), 0);
+	if (err)
+		return err;
+	group_bcast(g, &h, sizeof(h), 0);
+
+	z = calloc(1, sizeof(file_zip));
+	if (z)
+		z->index = calloc(h.nchunks + 1, sizeof(file_zchunk));
+	if (fh->comm->rank == 0 && z && z->index && h.nchunks &&
+	    fh->driver->pio(fh->handle, z->index,
+			    h.nchunks * sizeof(file_zchunk), h.index, 0) !=
+	    h.nchunks * sizeof(file_zchunk))
+		err = MPI_ERR_OTHER;
+	if (!z || !z->index)
+		err = MPI_ERR_OTHER;
+	MPI_Allreduce(&err, &any, 1, MPI_INT, MPI_MAX, fh->comm);
+	if (any) {
+		if (z)
+			free(z->index);
+		free(z);
+		return any;
+	}
+	group_bcast(g, z->index, h.nchunks * sizeof(file_zchunk), 0);
+
+	z->chunk = h.chunk;
+	z->typesize = h.typesize;
+	z->size = h.size;
+	z->nchunks = h.nchunks;
+	//A new file gets a header even if nothing is written to it
+	z->dirty = !(fh->amode & MPI_MODE_RDONLY) && !h.nchunks && !h.size;
+
+	if (fh->comm->rank == 0) {
+		z->end = upc_alloc(sizeof(int64_t));
+		*(shared [] int64_t *)z->end = h.end;
+	}
+	group_bcast(g, &z->end, sizeof(z->end), 0);
+	fh->zip = z;
+
+	return MPI_SUCCESS;
+}
+
+/**
+ * Read up to size bytes of data at off, decompressing the chunks they
+ * fall in; chunks never written read as zeros
+ * Runs on the I/O workers too, so it only reads the index
+ * Returns the bytes read, or -1 on failure
+ */
+ssize_t file_zip_read(MPI_File fh, void *buf, size_t size, MPI_Offset off) {
+	file_zip *z = fh->zip;
+	file_zchunk *e;
+	MPI_Offset c, in, n, have;
+	char *out = buf, *tmp = NULL;
+	size_t done = 0;
+
+	if (off >= z->size)
+		return 0;
+	if (off + size > z->size)
+		size = z->size - off;
+
+	while (done < size) {
+		c = (off + done) / z->chunk;
+		in = off + done - c * z->chunk;
+		n = z->chunk - in;
+		if (n > size - done)
+			n = size - done;
+
+		e = c < z->nchunks ? &z->index[c] : NULL;
+		have = e && e->off ? e->ulen - in : 0;
+		if (have < 0)
+			have = 0;
+		if (have > n)
+			have = n;
+
+		if (have && !in && have == e->ulen) {
+			//The whole chunk goes straight to the caller
+			if (zip_load(fh, e, out + done))
+				goto fail;
+		} else if (have) {
+			if (!tmp) {
+				tmp = malloc(z->chunk);
+				if (!tmp)
+					return -1;
+			}
+			if (zip_load(fh, e, tmp))
+				goto fail;
+			memcpy(out + done, tmp + in, have);
+		}
+		memset(out + done + have, 0, n - have);
+
+		done += n;
+	}
+
+	free(tmp);
+
+	return done;
+
+fail:
+	free(tmp);
+
+	return -1;
+}
+
+/**
+ * Compress the chunks the n runs of an aggregator's window touch and
+ * write them to the file, local holding the window from start
+ * The domains are laid on chunk boundaries, so no other aggregator
+ * writes these chunks; a chunk the runs cover only in part is merged
+ * with what it held
+ */
+int file_zip_write(MPI_File fh, file_seg *runs, int n, char *local,
+		   MPI_Offset start) {
+	file_zip *z = fh->zip;
+	file_zchunk old, *e;
+	file_zupdate *grown;
+	MPI_Offset c, last, cs, ce, s, t, hi;
+	char *out, *tmp, *merged, *data;
+	size_t len;
+	int i, j, raw, err = MPI_SUCCESS;
+
+	out = malloc(zip_bound(z->chunk));
+	tmp = malloc(z->chunk);
+	merged = malloc(z->chunk);
+	if (!out || !tmp || !merged) {
+		err = MPI_ERR_OTHER;
+		goto out;
+	}
+
+	c = runs[0].off / z->chunk;
+	last = (runs[n - 1].off + runs[n - 1].len - 1) / z->chunk;
+	for (i = 0; c <= last; c++) {
+		cs = c * z->chunk;
+		ce = cs + z->chunk;
+		while (i < n && runs[i].off + runs[i].len <= cs)
+			i++;
+		if (i == n || runs[i].off >= ce)
+			continue;
+
+		//The end of the data in the chunk after the write
+		hi = 0;
+		for (j = i; j < n && runs[j].off < ce; j++) {
+			t = runs[j].off + runs[j].len;
+			hi = (t < ce ? t : ce) - cs;
+		}
+
+		memset(&old, 0, sizeof(old));
+		if (c < z->nchunks)
+			old = z->index[c];
+		if (old.off && old.ulen > hi)
+			hi = old.ulen;
+
+		//One run over all of it needs nothing of the old chunk
+		if (runs[i].off <= cs && runs[i].off + runs[i].len >= cs + hi) {
+			data = local + (cs - start);
+		} else {
+			memset(merged, 0, hi);
+			if (old.off && zip_load(fh, &old, merged)) {
+				err = MPI_ERR_OTHER;
+				goto out;
+			}
+			for (j = i; j < n && runs[j].off < ce; j++) {
+				s = runs[j].off > cs ? runs[j].off : cs;
+				t = runs[j].off + runs[j].len;
+				if (t > ce)
+					t = ce;
+				memcpy(merged + (s - cs), local + (s - start), t - s);
+			}
+			data = merged;
+		}
+
+		len = zip_encode(z, data, hi, out, tmp, &raw);
+
+		grown = realloc(z->updates,
+				sizeof(file_zupdate) * (z->nupdates + 1));
+		if (!grown) {
+			err = MPI_ERR_OTHER;
+			goto out;
+		}
+		z->updates = grown;
+		e = &z->updates[z->nupdates].entry;
+		z->updates[z->nupdates].chunk = c;
+
+		//A chunk that still fits is rewritten where it was
+		e->off = old.off && len <= old.len ? old.off :
+			atomic_fetch_add(z->end, len, fh->sieve_lock);
+		e->len = len;
+		e->ulen = hi;
+		e->raw = raw;
+		if (fh->driver->pio(fh->handle, raw ? data : out, len, e->off,
+				    1) != len) {
+			err = MPI_ERR_OTHER;
+			goto out;
+		}
+		z->nupdates++;
+	}
+
+out:
+	free(out);
+	free(tmp);
+	free(merged);
+
+	return err;
+}
+
+/**
+ * Bring every rank's index up to date with the chunks the aggregators
+ * rewrote
+ * Called collectively after each collective write
+ */
+int file_zip_share(MPI_File fh) {
+	coll_group *g = fh->comm->group;
+	file_zip *z = fh->zip;
+	file_zupdate *all = NULL;
+	file_zchunk *grown;
+	MPI_Offset need, end;
+	size_t *sizes;
+	int *counts;
+	int i, total = 0, failed = 0, err = MPI_SUCCESS;
+
+	//Every rank fails together, so the indexes stay the same
+	counts = malloc(sizeof(int) * fh->comm->size);
+	sizes = malloc(sizeof(size_t) * fh->comm->size);
+	if (group_agree(g, !counts || !sizes))
+		err = MPI_ERR_OTHER;
+
+	if (!err)
+		err = group_allgather(g, &z->nupdates, sizeof(int), counts);
+	for (i = 0; !err && i < fh->comm->size; i++) {
+		sizes[i] = counts[i] * sizeof(file_zupdate);
+		total += counts[i];
+	}
+
+	if (!err) {
+		all = malloc(sizeof(file_zupdate) * total + 1);
+		err = group_allgatherv(g, z->updates, sizes, all);
+	}
+
+	if (!err) {
+		//Read-ahead and nonblocking reads may be looking at the index
+		aio_drain(fh);
+
+		need = z->nchunks;
+		for (i = 0; i < total; i++) {
+			if (all[i].chunk >= need)
+				need = all[i].chunk + 1;
+		}
+
+		if (need > z->nchunks) {
+			grown = realloc(z->index, sizeof(file_zchunk) * need);
+			if (grown)
+				z->index = grown;
+			else
+				failed = 1;
+		}
+
+		if (group_agree(g, failed))
+			err = MPI_ERR_OTHER;
+	}
+
+	if (!err) {
+		if (need > z->nchunks) {
+			memset(z->index + z->nchunks, 0,
+			       sizeof(file_zchunk) * (need - z->nchunks));
+			z->nchunks = need;
+		}
+
+		for (i = 0; i < total; i++) {
+			z->index[all[i].chunk] = all[i].entry;
+			end = all[i].chunk * z->chunk + all[i].entry.ulen;
+			if (end > z->size)
+				z->size = end;
+		}
+		if (total)
+			z->dirty = 1;
+	}
+	z->nupdates = 0;
+
+	free(counts);
+	free(sizes);
+	free(all);
+
+	return err;
+}
+
+/**
+ * Write the index and then the header to the file from rank 0, if the
+ * index changed
+ * Called collectively by MPI_File_sync and close
+ */
+int file_zip_flush(MPI_File fh) {
+	file_zip *z = fh->zip;
+	zip_header h;
+	size_t bytes = z->nchunks * sizeof(file_zchunk);
+	int err = MPI_SUCCESS;
+
+	if (!z->dirty)
+		return MPI_SUCCESS;
+
+	//The old index stays whole until the header points past it
+	if (fh->comm->rank == 0) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, ZIP_MAGIC, sizeof(h.magic));
+		h.chunk = z->chunk;
+		h.typesize = z->typesize;
+		h.size = z->size;
+		h.nchunks = z->nchunks;
+		h.index = atomic_fetch_add(z->end, bytes, fh->sieve_lock);
+		h.end = h.index + bytes;
+
+		if (fh->driver->pio(fh->handle, z->index, bytes, h.index, 1) !=
+		    bytes ||
+		    fh->driver->pio(fh->handle, &h, sizeof(h), 0, 1) !=
+		    sizeof(h))
+			err = MPI_ERR_OTHER;
+	}
+	group_bcast(fh->comm->group, &err, sizeof(int), 0);
+	z->dirty = 0;
+
+	return err;
+}
+
+/**
+ * Set the size of the data of a compressed file
+ * It can grow, or shrink to a chunk boundary; shrinking to nothing
+ * gives the space back
+ */
+int file_zip_set_size(MPI_File fh, MPI_Offset size) {
+	file_zip *z = fh->zip;
+	MPI_Offset keep;
+	int ret = MPI_SUCCESS;
+
+	if (size < z->size && size % z->chunk)
+		return MPI_ERR_OTHER;
+
+	aio_drain(fh);
+	keep = (size + z->chunk - 1) / z->chunk;
+	if (keep < z->nchunks)
+		z->nchunks = keep;
+	z->size = size;
+	z->dirty = 1;
+
+	if (!size) {
+		if (fh->comm->rank == 0)
+			atomic_swap(z->end, FILE_ZIP_HEADER, fh->sieve_lock);
+		if (fh->driver->set_size(fh, FILE_ZIP_HEADER))
+			ret = MPI_ERR_OTHER;
+	}
+	group_barrier(fh->comm->group);
+
+	return ret;
+}
+
+void file_zip_free(MPI_File fh) {
+	if (!fh->zip)
+		return;
+
+	if (fh->comm->rank == 0)
+		upc_free(fh->zip->end);
+	free(fh->zip->index);
+	free(fh->zip->updates);
+	free(fh->zip);
+	fh->zip = NULL;
+}